@@ -50,6 +50,20 @@ public:
         return res;
     }
     
+    /// projects a block of points stored as separate coordinate arrays
+    /// models may override it to avoid a virtual call per point
+    virtual void projectPointBlock(const double * x, const double * y, const double * z,
+            double * u, double * v, int numPoints) const
+    {
+        for (int i = 0; i < numPoints; i++)
+        {
+            Vector2d p;
+            projectPoint(Vector3d(x[i], y[i], z[i]), p);
+            u[i] = p[0];
+            v[i] = p[1];
+        }
+    }
+    
     bool projectPointCloud(const vector<Vector3d> & src, vector<Vector2d> & dst) const
     {
         dst.resize(src.size());
@@ -7,6 +7,13 @@ The mapping system itself
 
 //STL
 #include <vector>
+#include <array>
+#include <deque>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <cstdint>
+#include <utility>
 
 //Eigen
 #include <Eigen/Eigen>
@@ -14,8 +21,16 @@ The mapping system itself
 //Ceres solver
 #include <ceres/ceres.h>
 
+#include "covisibility_graph.h"
 #include "extractor.h"
 #include "geometry.h"
+#include "landmark_store.h"
+#include "map_file.h"
+#include "matcher.h"
+#include "pose_graph.h"
+#include "spatial_index.h"
+#include "thread_pool.h"
+#include "tiled_map.h"
 #include "vision.h"
 
 //Structure is used to perform map improvement
@@ -26,39 +41,56 @@ using Eigen::Vector2d;
 using Eigen::Vector3d;
 using Eigen::Matrix3d;
 
-struct Observation
+//what the residuals of a pose seen by a camera have in common
+struct PoseCacheEntry
 {
-    Observation(double u, double v, unsigned int poseIdx, CameraID camId)
-        : pt(u, v), poseIdx(poseIdx), cameraId(camId) {}
+    //the rotation parameter block of the pose
+    const double * rot;
+    Matrix3d RcamBase;
     
-    Observation(Vector2d pt, unsigned int poseIdx, CameraID camId)
-        : pt(pt), poseIdx(poseIdx), cameraId(camId) {}
-    //observed coordinates
-    Vector2d pt;
+    //the value of rot the following fields correspond to
+    Vector3d rotCached;
+    Matrix3d Rco;  // RcamBase * RbaseOrig
+    Matrix3d RcoLxiInv;
     
-    //index of corresponding positions in StereoCartograpy::trajectory
-    unsigned int poseIdx; 
+    //position in the active list of the cache, -1 if inactive
+    int activeIdx = -1;
     
-    //Either left or right camera
-    CameraID cameraId;
+    void compute();
 };
 
-struct LandMark
+//Computes the rotation and the pose Jacobian factor once per pose
+//and evaluation point, instead of once per residual.
+//Must be the evaluation callback of the problem the residuals are in
+class PoseCache : public ceres::EvaluationCallback
 {
-    //3D position in the globa frame
-    Vector3d X;
+public:
+    //the entry stays valid until clear
+    const PoseCacheEntry * addPose(const double * rot, const Transformation<double> & TbaseCam);
+    
+    //only the active entries are kept up to date, the ones of the poses in the problem
+    //an entry is refreshed when activated
+    void activate(const PoseCacheEntry * entry);
+    void deactivate(const PoseCacheEntry * entry);
+    void deactivateAll();
+    
+    //only the active poses that have moved are recomputed
+    //the Jacobian factor is cheap enough to be always computed with the rotation
+    void PrepareForEvaluation(bool evaluateJacobians, bool newEvaluationPoint);
+    
+    void clear() { entryVec.clear(); activeVec.clear(); }
     
-    //Feature descriptor
-    Matrix<float, 64, 1> d;
+    int numActive() const { return activeVec.size(); }
     
-    //All Vec6drealted measurements
-    vector<Observation> observations;
+private:
+    deque<PoseCacheEntry> entryVec;
+    vector<PoseCacheEntry *> activeVec;
 };
 
 struct ReprojectionErrorStereo : public ceres::SizedCostFunction<2, 3, 3, 3>
 {
     ReprojectionErrorStereo(const Vector2d pt, const Transformation<double> & TbaseCam,
-            const ICamera * camera);
+            const ICamera * camera, const PoseCacheEntry * poseCache = NULL);
     
     // args : double lm[3], double pose[6]
     bool Evaluate(double const* const* args,
@@ -74,6 +106,8 @@ struct ReprojectionErrorStereo : public ceres::SizedCostFunction<2, 3, 3, 3>
     //provides projection model
     const ICamera * camera;
     
+    //optional, shared pose quantities
+    const PoseCacheEntry * poseCache;
 };
 
 struct ReprojectionErrorFixed : public ceres::SizedCostFunction<2, 3>
@@ -122,23 +156,195 @@ struct OdometryError : public ceres::SizedCostFunction<2, 3, 3>
 
 
 //TODO implement camera calibration in the future
+//The problem persists between the calls to compute. The landmarks and poses
+//are the parameter blocks, so each solve starts from the previous solution,
+//and the residual blocks are created once per observation.
+//The problem owns the cost functions, removing a residual block deletes it
 class MapInitializer
 {
 public:
+    MapInitializer();
    
-    void addObservation(Vector3d & X, Vector2d pt, Transformation<double> & pose,
-            const ICamera * cam, const Transformation<double> & TbaseCam);
+    ceres::ResidualBlockId addObservation(Vector3d & X, Vector2d pt, Transformation<double> & pose,
+            const ICamera * cam, const Transformation<double> & TbaseCam,
+            const PoseCacheEntry * poseCache = NULL);
     
-    void addFixedObservation(Vector3d & X, Vector2d pt, Transformation<double> & pose,
+    ceres::ResidualBlockId addFixedObservation(Vector3d & X, Vector2d pt, Transformation<double> & pose,
             const ICamera * cam, const Transformation<double> & TbaseCam);       
 //    void addObservationRight(Vector3d & X, double u, double v, Transformation & pose,
 //            const Camera & cam, Transformation & rightCamTransformation);
+    
+    void removeObservation(ceres::ResidualBlockId residualId);
+    
+    //removes the landmark with all its observations
+    void removeLandmark(Vector3d & X);
+    
+    void setPoseConstant(Transformation<double> & pose, bool constant);
+    
+    //brings the problem up to date with the map:
+    //adds the new observations, removes the culled ones and the landmarks
+    //no longer seen from the window, made of the poses j with poseWindow[j],
+    //the other poses which see these landmarks and the first one are held constant
+    //the problem is rebuilt if the map storage has been reallocated
+    //given the covisibility graph of LM, up to date, only the landmarks in the journal
+    //of LM and the ones of the poses entering or leaving the window are visited,
+    //otherwise all of them
+    void update(LandmarkStore & LM, vector<Transformation<double>> & trajectory,
+            const StereoSystem & stereo, const vector<bool> & poseWindow,
+            const CovisibilityGraph * covisibility = NULL);
+    
+    //the window is made of the poses from firstPose on
+    void update(LandmarkStore & LM, vector<Transformation<double>> & trajectory,
+            const StereoSystem & stereo, int firstPose);
             
     void compute();
     
+    //the next solve starts from the default trust region again,
+    //after the map has been corrected from outside, by a loop closure for instance
+    void resetTrustRegion() { trustRegionRadius = 1e4; }
+    
+    //removes everything
+    void clear();
+    
+    int numObservations() const { return problem->NumResidualBlocks(); }
+    
+private:
+    //one residual block of the pose has been removed
+    void removePoseResidual(int poseIdx);
+    
+    //brings the residual blocks of the landmark up to date
+    void updateLandmark(LandmarkStore & LM, LandmarkId id, vector<Transformation<double>> & trajectory,
+            const StereoSystem & stereo, const vector<bool> & poseWindow);
+    
+    //the evaluation callback of the problem, must outlive it
+    PoseCache poseCache;
+    unique_ptr<ceres::Problem> problem;
+    
+    //bookkeeping of update
+    //the residual blocks of each landmark, in the order of its observations
+    vector<vector<ceres::ResidualBlockId>> residualVec;
+    //the pose of each residual block
+    vector<vector<int>> residualPoseVec;
+    //the stamp of each landmark in LM when its residual blocks were added
+    vector<int> residualStampVec;
+    //number of residual blocks of each pose, its cache entries are active if positive
+    vector<int> poseNumResiduals;
+    vector<bool> poseAdded, poseConstant;
+    vector<bool> windowMask;
+    //the window of the last update
+    vector<bool> prevWindow;
+    //the problem is up to date with the journal of LM until changePosition
+    bool synced = false;
+    uint64_t changePosition = 0;
+    //landmarks and poses to check
+    vector<LandmarkId> candidateVec;
+    vector<int> changedPoseVec;
+    //cache entries of each pose, for each camera
+    vector<array<const PoseCacheEntry *, 2>> poseEntryVec;
+    //the problem refers to the map storage
+    const Vector3d * landmarkData = NULL;
+    const Transformation<double> * poseData = NULL;
+    
+    //the next solve starts with the last trust region
+    double trustRegionRadius = 1e4;
+};
+
+//Incremental bundle adjustment, in the spirit of iSAM2 fluid relinearization.
+//The observations are added once and their cost functions are kept.
+//Each update optimizes only the active variables: the ones touched by new
+//observations and the ones whose last update was larger than relinearizeThreshold.
+//Their neighbors enter the problem as constants, the rest of the map is not touched.
+//The estimates are kept in stable storage and copied to the map after each update.
+//The slots of the dropped factors are reused, so that the storage follows the map.
+class IncrementalSmoother
+{
+public:
+    double relinearizeThreshold = 1e-4;  // norm of the update that keeps a variable active
+    int maxNumIterations = 10;
+    
+    IncrementalSmoother(const StereoSystem & stereo) : stereo(stereo) {}
+    
+    //adds the new poses, landmarks and observations, optimizes the active variables
+    //and writes the result back, the first pose is held constant;
+    //the smoother keeps its own estimates: the active ones overwrite the map,
+    //whatever has been changed in it since, unless resync has been called
+    void update(LandmarkStore & LM, vector<Transformation<double>> & trajectory);
+    
+    //the map has been corrected from outside, by a loop closure for instance:
+    //the estimates are read from it again and all the variables become active
+    void resync(const LandmarkStore & LM, const vector<Transformation<double>> & trajectory);
+    
+    //number of variables optimized by the last update
+    int numActivePoses() const { return lastActivePoses; }
+    int numActiveLandmarks() const { return lastActiveLandmarks; }
+    
+    //the landmarks whose positions the last update has written to the map
+    const vector<int> & movedLandmarks() const { return movedLandmarkVec; }
+    
+    //number of observations kept, and of the slots they use, the free ones included
+    int numFactors() const { return factorVec.size() - freeFactorVec.size(); }
+    int numFactorSlots() const { return factorVec.size(); }
+    
 private:
-    ceres::Problem problem;
+    struct Factor
+    {
+        int landmarkIdx, poseIdx;
+        unique_ptr<ceres::CostFunction> costFunction;
+        //last update whose problem the factor is in
+        int lastUsed = -1;
+    };
+    
+    void activateLandmark(int i);
+    void activatePose(int j);
+    
+    //drops the factors of the landmark and frees their slots
+    void dropFactors(int i);
+    
+    const StereoSystem & stereo;
+    
+    //the addresses stay valid when the map grows
+    deque<Vector3d> landmarkVec;
+    deque<Transformation<double>> poseVec;
+    
+    vector<Factor> factorVec;
+    vector<int> freeFactorVec;
+    //indices in factorVec of the factors of each variable
+    vector<vector<int>> landmarkFactors, poseFactors;
+    //number of observations of each landmark already in factorVec,
+    //and its stamp in LM when they were added
+    vector<int> numAdded;
+    vector<int> factorStampVec;
+    vector<bool> landmarkActive, poseActive;
+    vector<int> activeLandmarkVec, activePoseVec;
+    vector<int> movedLandmarkVec;
+    int numUpdates = 0;
+    
+    //the factors are up to date with the journal of LM until changePosition
+    uint64_t changePosition = 0;
+    
+    //update buffers
+    vector<LandmarkId> candidateVec;
+    vector<int> usedFactorVec;
+    vector<Vector3d> landmarkPrev;
+    vector<Transformation<double>> posePrev;
+    
+    //shared pose quantities of each pose, for each camera
+    PoseCache poseCache;
+    vector<array<const PoseCacheEntry *, 2>> poseEntryVec;
+    
+    int lastActivePoses = 0, lastActiveLandmarks = 0;
+};
 
+//the state of one RANSAC worker, independent from the others
+struct RansacWorker
+{
+    mt19937 generator;
+    //inlier bitmasks, 64 points per word
+    vector<uint64_t> mask, bestMask;
+    Transformation<double> bestPose;
+    int bestInliers;
+    //the deadline has stopped the sampling
+    bool timedOut;
 };
 
 class Odometry
@@ -147,10 +353,38 @@ public:
     vector<Vector2d> observationVec;
     vector<Vector3d> cloud;
     vector<bool> inlierMask;
+    //optional, if given the samples are drawn from the best matches first (PROSAC)
+    vector<MatchQuality> qualityVec;
     Transformation<double> TorigBase;
-    const Transformation<double> TbaseCam;
+    Transformation<double> TbaseCam;
     const ICamera & camera;
     
+    //RANSAC parameters
+    int numIterMax = 25;  // worst case, the actual number depends on the inlier ratio
+    double confidence = 0.99;
+    double inlierThreshold = 2;  // reprojection error, pixels
+    
+    //SPRT early bailout: probability that a point agrees with a bad hypothesis
+    //and the likelihood ratio at which a hypothesis is abandoned
+    double sprtDelta = 0.05;
+    double sprtThreshold = 100;
+    
+    //Gauss-Newton refinement of the pose
+    int refineIterMax = 10;
+    double huberThreshold = 0;  // pixels, 0 gives plain least squares
+    double refineTolerance = 1e-12;  // on the squared norm of the update
+    
+    //number of uniform samples after which PROSAC becomes uniform sampling
+    int prosacMaxSamples = 200000;
+    
+    //the result is reproducible for a given seed and number of threads
+    unsigned int seed = 0;
+    ThreadPool * threadPool = NULL;
+    
+    //Ransac and computeTransformation stop there and keep their best result so far
+    //the result is not reproducible anymore when the deadline is reached
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    
     Odometry(const Transformation<double> TorigBase,
             const Transformation<double> TbaseCam,
             const ICamera & camera) 
@@ -161,18 +395,188 @@ public:
             const ICamera * camera) 
             : TorigBase(TorigBase), TbaseCam(TbaseCam), camera(*camera) {}
             
-    void computeTransformation();
-            
-    void Ransac();
+    //refines TorigBase using the inliers
+    //returns false if the deadline has been reached before the convergence
+    bool computeTransformation();
+    
+    //returns false if the deadline has been reached before the required confidence
+    bool Ransac();
+    
+    //preallocates all the buffers for up to maxPoints matches
+    //threadPool and numIterMax must be set before
+    //after that, Ransac and computeTransformation do not allocate
+    void reserve(int maxPoints);
+    
+    //empties the matches and sets the initial guess, keeps the capacity
+    void reset(const Transformation<double> & TorigBaseInit);
+    
+    //also sets the extrinsic, which may have changed since the last frame
+    void reset(const Transformation<double> & TorigBaseInit,
+            const Transformation<double> & TbaseCamInit);
+    
+    //number of hypotheses to reach the confidence for a given number of inliers
+    int requiredIterations(int numInliers) const;
+    
+    //fused transformation, projection and reprojection test for a given base pose
+    //requires the buffers filled by Ransac, mask gets one bit per point
+    //epsilon is the expected inlier ratio of a good hypothesis, 0 disables the SPRT
+    //returns -1 if the hypothesis has been rejected before the end
+    int countInliers(const Transformation<double> & pose, uint64_t * mask,
+            double epsilon = 0) const;
+    
+private:
+    //structure of arrays copies of cloud and observationVec
+    vector<double> cloudX, cloudY, cloudZ, obsU, obsV;
+    //bearing vectors of the observations
+    vector<Vector3d> bearingVec;
+    
+    //ranking of the points and size of the ranked subset to sample from
+    //at each iteration, with a flag when its last point must be in the sample
+    void initSampling();
+    vector<int> orderVec;
+    vector<int> sampleSubsetVec;
+    vector<bool> sampleLastVec;
+    
+    //worker idx runs the hypotheses idx, idx + numWorkers, ...
+    void ransacWorker(int idx);
+    
+    vector<RansacWorker> workerVec;
 };
 
+//predicts the next base pose assuming a constant velocity on SE(3)
+class MotionModel
+{
+public:
+    double damping = 0;  // 0 keeps the last velocity, 1 predicts no motion
+    double minSearchRadius = 10;  // pixels
+    double maxSearchRadius = 100;
+    double searchRadiusGain = 3;  // times the prediction error
+    
+    //mean reprojection error of the inliers at the predicted pose, last frame,
+    //maxSearchRadius after a tracking failure
+    double predictionError = 1e6;
+    
+    Transformation<double> predict(const vector<Transformation<double>> & trajectory) const;
+    
+    //search window for guided matching, negative if the motion is unknown
+    double searchRadius(const vector<Transformation<double>> & trajectory) const;
+};
+
+//tells whether a frame shows the same view as the last processed one
+//a sparse subset of the features is looked for at the same place
+//in the reference frame, with a similar descriptor
+class StationaryDetector
+{
+public:
+    int numSamples = 50;
+    double maxDisplacement = 1;  // pixels
+    double maxDescriptorDist = 0.1;
+    double minStaticRatio = 0.8;  // of the samples that have not moved
+    int maxSkipped = 10;  // consecutive frames, then the frame is processed anyway
+    
+    int numSkipped = 0;
+    
+    //true if the frame can be skipped, counts it as skipped
+    bool isStationary(const vector<Feature> & featureVec);
+    
+    //the frame is processed and becomes the reference
+    void setReference(const vector<Feature> & featureVec);
+    
+    void reserve(int maxFeatures) { refFeatureVec.reserve(maxFeatures); }
+    
+private:
+    vector<Feature> refFeatureVec;
+};
+
+//tells whether a tracked frame should become a keyframe, that is collect
+//observations and enter the bundle adjustment, compared to the last keyframe:
+//enough parallax, too few landmarks still tracked or too many frames since
+class KeyframeSelector
+{
+public:
+    double minParallax = 0.05;  // translation over the mean depth of the tracked landmarks
+    double minRotation = 0.2;  // radians
+    double minTrackedRatio = 0.6;  // of the landmarks tracked at the last keyframe
+    int maxFrames = 30;  // since the last keyframe
+    
+    int numFrames = 0;
+    
+    //counts the frame, meanDepth is the mean distance of the tracked landmarks
+    bool isKeyframe(const Transformation<double> & pose, int numTracked, double meanDepth);
+    
+    void setKeyframe(const Transformation<double> & pose, int numTracked);
+    
+    //the next frame is a keyframe
+    void reset() { hasKeyframe = false; }
+    
+    //moves the last keyframe along with the trajectory, newPose = correction * pose
+    void correct(const Transformation<double> & correction)
+    {
+        keyframePose = correction.compose(keyframePose);
+    }
+    
+private:
+    bool hasKeyframe = false;
+    Transformation<double> keyframePose;
+    int keyframeTracked = 0;
+};
+
+//how far the odometry went within its time budget
+enum OdometryQuality
+{
+    ODOMETRY_FULL,  // every stage has completed
+    ODOMETRY_PARTIAL,  // some stage has been cut by its deadline
+    ODOMETRY_PREDICTED,  // no estimation, the motion model prediction is returned
+    ODOMETRY_OVERFLOW,  // the input exceeds the tracking capacity, the prediction is returned
+    ODOMETRY_STATIONARY  // the view has not changed, the last pose is returned
+};
+
+//the landmarks around a pose, as the tracking sees them,
+//never modified once published, see ConcurrentMapper
+struct MapSnapshot
+{
+    //increases with each publication
+    uint64_t version = 0;
+    //size of the mapped trajectory and its last pose, the center of the snapshot
+    int numPoses = 0;
+    Transformation<double> lastPose;
+    //the same keyframe as it has been tracked, see ConcurrentMapper::loadSnapshot
+    Transformation<double> trackedPose;
+    //per landmark, in the order of their ids, the index holds
+    //the places in these arrays and the positions
+    vector<LandmarkId> idVec;
+    LandmarkStore::DescriptorVec descriptorVec;
+    vector<int> lastSeenVec;
+    SpatialIndex index;
+};
+
+//what the last call to estimateOdometry has done
+struct OdometryReport
+{
+    OdometryQuality quality = ODOMETRY_FULL;
+    //wall time of each stage, seconds
+    double matchTime = 0, ransacTime = 0, refineTime = 0;
+    int numMatches = 0, numInliers = 0;
+    //the frame should collect observations, see KeyframeSelector,
+    //only a frame tracked with some inliers can be one
+    bool keyframe = false;
+    //the inlier matches as pairs (index in featureVec, landmark id), the ids are
+    //the ones of LM, or of its snapshot if mapSnapshot is set, to build KeyframeData;
+    //the matches of the landmarks of tiledMap are apart, with the ids of tiledMap
+    vector<pair<int, LandmarkId>> matchVec, tiledMatchVec;
+    
+    //back to the defaults, the buffers keep their capacity
+    void reset();
+};
 
 class StereoCartography
 {
 public:
     StereoCartography (Transformation<double> & p1, Transformation<double> & p2,
             ICamera & c1, ICamera & c2) 
-            : stereo(p1, p2, c1, c2) {}
+            : stereo(p1, p2, c1, c2),
+              smoother(stereo),
+              odometry(Transformation<double>(), stereo.TbaseCam1, stereo.cam1) {}
 //    virtual ~StereoCartography () { LM.clear(); trajectory.clear(); }
     
     StereoSystem stereo;
@@ -183,17 +587,159 @@ public:
     //performs optimization of all landmark positions wrt the actual path
     void improveTheMap();    
     
+    //improveTheMap updates the incremental smoother instead of a full re-solve
+    bool incrementalMapping = false;
+    
+    //number of most recent keyframes, the poses which observe landmarks,
+    //optimized by improveTheMap together with the landmarks they observe,
+    //older poses are held constant
+    int localWindowSize = 0;  // 0 optimizes the whole trajectory
+    //the poses which share the most landmarks with the last keyframe join the local window
+    int numCovisiblePoses = 0;
+    int minCovisibleWeight = 15;  // shared landmarks
+    
+    //improveTheMap first drops the observations of the redundant keyframes:
+    //the ones whose landmarks are mostly seen from enough other keyframes,
+    //the first pose and the ones of the local window are kept
+    bool keyframeCulling = false;
+    double redundantRatio = 0.9;
+    int minRedundantObservers = 3;  // other keyframes
+    
+    //removes the observations of the redundant keyframes, returns how many
+    //only the keyframes whose landmarks have changed since the last call are judged again
+    int cullKeyframes();
+    
+    //improveTheMap first merges each new landmark into an older one it duplicates:
+    //within fusionRadius, with a descriptor within maxFusionDescriptorDist and last
+    //seen before the new one was first seen, so that the tracking gap has separated them
+    bool landmarkFusion = false;
+    double fusionRadius = 0.5;  // meters
+    double maxFusionDescriptorDist = 0.3;
+    
+    //merges the landmarks added since the last call into their duplicates,
+    //the most similar one for each, returns how many
+    int fuseLandmarks();
+    
+    //corrects the drift once poseIdx2 has been recognized from poseIdx1 as seen with T12:
+    //the pose graph of the consecutive poses, the covisible ones and the loop is optimized,
+    //then every landmark follows the first pose it is seen from;
+    //returns the final cost of the pose graph
+    double closeLoop(int poseIdx1, int poseIdx2, const Transformation<double> & T12,
+            const Matrix6d & information = Matrix6d::Identity());
+    
+    //the constraints are rebuilt by closeLoop, the settings are kept
+    PoseGraph poseGraph;
+    
+    //the alive landmarks within radius of the last pose, after a full index update
+    shared_ptr<MapSnapshot> makeSnapshot(double radius);
+    
+    //commits the observations and writes the map, see writeMap;
+    //MapView reads the file in place or copies it into an empty LM and trajectory
+    bool saveMap(const string & fileName);
+
+    
     Transformation<double> estimateOdometry(const vector<Feature> & featureVec);
+    
+    //capacity of the tracking path
+    int maxFeatures = 4000;  // larger frames fail with ODOMETRY_OVERFLOW
+    int maxActiveLandmarks = 300;  // the most recently seen of the visible ones are matched
+    int maxVisibleLandmarks = 5000;  // the field of view query stops there
+    double maxLandmarkDepth = 50;  // farther landmarks are not matched
+    
+    //preallocates the tracking buffers at their capacity
+    //estimateOdometry does not allocate afterwards
+    //must be called again if threadPool, tiledMap or the odometry settings change
+    void initTracking();
+    
+    //optional, odometry runs on the calling thread otherwise
+    ThreadPool * threadPool = NULL;
+    
+    //seeds the matching window, RANSAC and the refinement
+    MotionModel motionModel;
+    
+    //time budget of estimateOdometry, the deadline of each stage is
+    //the start plus its cumulated share of the budget, so that the time left
+    //by a stage goes to the next ones
+    double timeBudget = 0;  // seconds, 0 disables the deadlines
+    double matchBudgetShare = 0.3;
+    double ransacBudgetShare = 0.5;  // the refinement gets the rest
+    
+    OdometryReport odometryReport;
+    
+    //frames identical to the last processed one reuse its pose
+    //the map should not be updated for them, see odometryReport
+    bool detectStationary = false;
+    StationaryDetector stationaryDetector;
+    
+    //sets odometryReport.keyframe
+    KeyframeSelector keyframeSelector;
 
     //the library of all landmarks
-    //to be replaced in the future with somth smarter than a vector
-    vector<LandMark> LM;
+    LandmarkStore LM;
+    
+    //which poses share landmarks, updated by improveTheMap
+    CovisibilityGraph covisibility;
+    
+    //positions of LM, kept by the mapping side: estimateOdometry only reads it
+    SpatialIndex landmarkIndex;
+    
+    //adds the landmarks created since the last update of landmarkIndex and drops
+    //the removed ones, improveTheMap and initTracking do it as well,
+    //the new ones are not matched by estimateOdometry until then
+    void indexNewLandmarks() { updateLandmarkIndex(false); }
+    
+    //optional, the map seen by estimateOdometry instead of LM and landmarkIndex,
+    //which are then not touched, for the tracking thread of a ConcurrentMapper
+    shared_ptr<const MapSnapshot> mapSnapshot;
+    
+    //optional, a prebuilt map too large for the memory: estimateOdometry also matches
+    //the features against its resident landmarks, whose ids are not the ones of LM;
+    //it must be set before initTracking, and its prefetch window is moved by the caller
+    //with TiledMap::setPose between two frames, on the tracking thread, since setPose
+    //changes the resident tiles and may read them on the spot
+    TiledMap * tiledMap = NULL;
+    int maxTiledLandmarks = 300;  // the nearest of the visible ones are matched
     
     //a chain of camera positions
     //first initialized with the odometry measurements
     vector<Transformation<double>> trajectory;
     //list<LandMark &> activeLM;
 
+private:
+    //a full update checks every landmark, otherwise only the new ones and the ones
+    //in the journal of LM, which does not list the landmarks moved by an optimization
+    void updateLandmarkIndex(bool full);
+    void updateIndexedLandmark(LandmarkId id);
+    //the index is up to date with the journal of LM until indexChangePosition
+    uint64_t indexChangePosition = 0;
+    
+    IncrementalSmoother smoother;
+    MapInitializer initializer;
+    vector<bool> poseWindow;
+    vector<int> covisiblePoseVec;
+    vector<Transformation<double>> trajectoryBeforeLoop;
+    //keyframe culling: the number of keyframes each landmark is seen from
+    //and the keyframes to judge, up to date with the journal of LM until cullChangePosition
+    vector<int> numObserversVec;
+    vector<bool> poseToCheck;
+    vector<int> cullCandidateVec;
+    uint64_t cullChangePosition = 0;
+    vector<bool> poseCulled;
+    //landmarks from this one on have not been checked for duplicates
+    LandmarkId firstUnfused = 0;
+    vector<LandmarkId> fusionCandidateVec;
+    
+    //tracking buffers, reused from a frame to the next one
+    Odometry odometry;
+    //the ids of the matched landmarks, or their places in mapSnapshot
+    vector<LandmarkId> activeIdVec, tiledIdVec;
+    vector<const LandmarkStore::Descriptor *> activeDescriptorVec;
+    vector<Feature> lmFeatureVec;
+    vector<Vector3d> activeCloud, XcamVec;
+    vector<Vector2d> predVec, matchedPredVec;
+    vector<int> matchVec, matchedFeatureVec;
+    vector<MatchQuality> matchQualityVec;
+
 };
 
 #endif
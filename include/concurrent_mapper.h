@@ -0,0 +1,116 @@
+/*
+Mapping thread that publishes snapshots of the map for the tracking
+*/
+
+#ifndef _SPCMAP_CONCURRENT_MAPPER_H_
+#define _SPCMAP_CONCURRENT_MAPPER_H_
+
+//STL
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <cstdint>
+
+//Eigen
+#include <Eigen/Eigen>
+
+#include "cartography.h"
+#include "geometry.h"
+#include "landmark_store.h"
+
+using namespace std;
+using Eigen::Vector3d;
+
+//what the tracking hands over to the mapping for a keyframe
+struct KeyframeData
+{
+    //as tracked, in the frame of the tracking
+    Transformation<double> pose;
+    //landmarks first seen from this keyframe
+    vector<Vector3d> newLandmarkVec;
+    LandmarkStore::DescriptorVec newDescriptorVec;
+    //ids of the snapshot, see OdometryReport::matchVec, or newLandmarkId,
+    //the mapper sets the pose index
+    vector<pair<LandmarkId, Observation>> observationVec;
+
+    //refers to newLandmarkVec[k] in observationVec
+    static LandmarkId newLandmarkId(int k) { return -1 - k; }
+};
+
+// Runs improveTheMap of a StereoCartography on its own thread, so that the
+// tracking never waits for the bundle adjustment. The tracking hands over its
+// keyframes with addKeyframe and reads the map through loadSnapshot, which sets
+// the last snapshot as mapSnapshot of its own StereoCartography.
+// The optimization moves the mapped keyframes away from the tracked poses:
+// a new keyframe is mapped relative to the last one, and loadSnapshot moves the
+// trajectory of the tracking so that its last mapped keyframe lands on the
+// optimized pose. The corrections are undone on the poses handed over,
+// so that a keyframe queued before a correction is not corrected twice.
+// The mapping thread adds the keyframes queued meanwhile to the map, improves it,
+// then publishes a new snapshot by swapping a shared pointer atomically:
+// a published snapshot is never modified, the tracking keeps the one it holds
+// until it loads the next one and the last holder frees it (read-copy-update).
+// Only the mapping thread touches the mapped StereoCartography while it runs;
+// without the thread, addKeyframe does the whole work on the calling thread.
+class ConcurrentMapper
+{
+public:
+    double snapshotRadius = 100;  // around the last keyframe, meters
+
+    ConcurrentMapper(StereoCartography & mapping) : mapping(mapping) {}
+    ~ConcurrentMapper() { stop(); }
+
+    ConcurrentMapper(const ConcurrentMapper &) = delete;
+    ConcurrentMapper & operator = (const ConcurrentMapper &) = delete;
+
+    //starts the mapping thread, stop maps the queued keyframes before it returns
+    void start();
+    void stop();
+
+    //on the tracking thread, like loadSnapshot
+    void addKeyframe(KeyframeData keyframe);
+
+    //the last published snapshot, NULL before the first keyframe is mapped
+    shared_ptr<const MapSnapshot> snapshot() const { return atomic_load(&published); }
+
+    //on the tracking thread, sets the last snapshot as mapSnapshot of tracking and
+    //applies the pose correction it brings to its trajectory and keyframe selector,
+    //false if there is no new snapshot
+    bool loadSnapshot(StereoCartography & tracking);
+
+    //blocks until the queued keyframes are mapped and published
+    void waitForMapping();
+
+private:
+    void mappingLoop();
+
+    //adds the keyframe to the trajectory and its landmarks and observations to LM
+    void integrate(const KeyframeData & keyframe);
+
+    void publish();
+
+    StereoCartography & mapping;
+    shared_ptr<const MapSnapshot> published;
+    //tracking thread only, the sum of the corrections applied to the tracking,
+    //trackedPose = correction * uncorrected pose
+    Transformation<double> correction;
+    //mapping thread only
+    uint64_t version = 0;
+    vector<KeyframeData> batchVec;
+    //the uncorrected pose of the last mapped keyframe
+    bool hasTrackedPose = false;
+    Transformation<double> lastTrackedPose;
+
+    //shared with the mapping thread
+    thread mappingThread;
+    mutex queueMutex;
+    condition_variable queueCondition, mappedCondition;
+    vector<KeyframeData> queueVec;
+    bool running = false;
+    bool busy = false;
+};
+
+#endif
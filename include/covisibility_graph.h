@@ -0,0 +1,81 @@
+/*
+Covisibility of the poses of the trajectory
+*/
+
+#ifndef _SPCMAP_COVISIBILITY_GRAPH_H_
+#define _SPCMAP_COVISIBILITY_GRAPH_H_
+
+//STL
+#include <vector>
+#include <cstdint>
+
+#include "landmark_store.h"
+
+using namespace std;
+
+// An undirected graph over the poses, the weight of an edge is the number
+// of landmarks observed from both poses, the edges of zero weight are dropped.
+// It is maintained incrementally: each landmark keeps the sorted list of the poses
+// it is seen from, a new pose adds one to its edges with them, a culled one
+// subtracts one. Both cameras of a pose count as a single observation.
+// Each pose also lists the landmarks it sees.
+class CovisibilityGraph
+{
+public:
+    struct Neighbour
+    {
+        int poseIdx;
+        int weight;
+    };
+
+    int numPoses() const { return neighbourVec.size(); }
+
+    int weight(int pose1, int pose2) const;
+
+    //unordered
+    const vector<Neighbour> & neighbours(int poseIdx) const;
+
+    //the poses sharing the most landmarks with poseIdx, at most N of them and
+    //at least minWeight landmarks each, the heaviest first, the most recent first
+    //among equal weights
+    void bestNeighbours(int poseIdx, int N, vector<int> & poseVec, int minWeight = 1) const;
+
+    //the landmarks seen from poseIdx, unordered
+    const vector<LandmarkId> & landmarks(int poseIdx) const;
+
+    //the poses the landmark is seen from, increasing
+    const vector<int> & poses(LandmarkId id) const;
+
+    //the landmark is seen from poseIdx, nothing happens if it already was
+    void addObservation(LandmarkId id, int poseIdx);
+
+    //the landmark is no longer seen from poseIdx
+    void removeObservation(LandmarkId id, int poseIdx);
+
+    void removeLandmark(LandmarkId id);
+
+    //brings the graph up to date with the committed observations of LM,
+    //only the landmarks in its journal since the last update are visited
+    void update(const LandmarkStore & LM);
+
+    void clear();
+
+private:
+    void addWeight(int pose1, int pose2, int delta);
+
+    //the poses of the landmark are those of its committed observations
+    void updateLandmark(const LandmarkStore & LM, LandmarkId id);
+
+    vector<vector<Neighbour>> neighbourVec;
+    //poses each landmark is seen from, increasing
+    vector<vector<int>> landmarkPoseVec;
+    //for each of them, the place of the landmark in the list of the pose
+    vector<vector<int>> landmarkSlotVec;
+    vector<vector<LandmarkId>> poseLandmarkVec;
+    //position in the journal of LM read by the last update
+    uint64_t changePosition = 0;
+    vector<int> poseBuffer;
+    mutable vector<Neighbour> candidateBuffer;
+};
+
+#endif
@@ -0,0 +1,196 @@
+/*
+Storage of the landmarks and their observations
+*/
+
+#ifndef _SPCMAP_LANDMARK_STORE_H_
+#define _SPCMAP_LANDMARK_STORE_H_
+
+//STL
+#include <vector>
+#include <cstdint>
+
+//Eigen
+#include <Eigen/Eigen>
+#include <Eigen/StdVector>
+
+#include "vision.h"
+
+using namespace std;
+using Eigen::Matrix;
+using Eigen::Vector2d;
+using Eigen::Vector3d;
+
+struct Observation
+{
+    Observation() : poseIdx(0), cameraId(LEFT) {}
+    
+    Observation(double u, double v, unsigned int poseIdx, CameraID camId)
+        : pt(u, v), poseIdx(poseIdx), cameraId(camId) {}
+
+    Observation(Vector2d pt, unsigned int poseIdx, CameraID camId)
+        : pt(pt), poseIdx(poseIdx), cameraId(camId) {}
+    //observed coordinates
+    Vector2d pt;
+
+    //index of corresponding positions in StereoCartograpy::trajectory
+    unsigned int poseIdx;
+
+    //Either left or right camera
+    CameraID cameraId;
+};
+
+//index of a landmark in the store, never reused
+typedef int LandmarkId;
+
+// The landmarks as a structure of arrays indexed by LandmarkId:
+// positions, descriptors and metadata are separate contiguous arrays,
+// so that a pass over the positions does not stride over the descriptors.
+// A removed landmark leaves a hole, the other ids stay valid.
+// The observations are a flat array sorted by landmark (CSR),
+// the new ones are staged and merged by commitObservations in a single pass,
+// which also drops the ones of the removed landmarks.
+// The observations of a landmark keep their chronological order.
+// A journal lists the landmarks whose committed observations have changed,
+// so that the structures built on the store only visit those.
+class LandmarkStore
+{
+public:
+    typedef Matrix<float, 64, 1> Descriptor;
+    typedef vector<Descriptor, Eigen::aligned_allocator<Descriptor>> DescriptorVec;
+
+    //number of ids, the removed landmarks included
+    int size() const { return positionVec.size(); }
+
+    int numAlive() const { return aliveCount; }
+
+    bool alive(LandmarkId id) const { return aliveVec[id]; }
+
+    LandmarkId add(const Vector3d & X, const Descriptor & d);
+
+    //its observations are dropped by the next commitObservations
+    void remove(LandmarkId id);
+    
+    //stages the observations of src, committed and staged, as observations of dst
+    //and removes src; they must be more recent than the ones of dst
+    void merge(LandmarkId src, LandmarkId dst);
+    
+    //the landmark that id has been merged into, following the chain of merges,
+    //id itself if it has not been merged; it may have been removed since
+    LandmarkId resolve(LandmarkId id) const
+    {
+        while (mergedVec[id] != -1) id = mergedVec[id];
+        return id;
+    }
+
+    void reserve(int numLandmarks, int numObservations);
+
+    void clear();
+
+    Vector3d & position(LandmarkId id) { return positionVec[id]; }
+    const Vector3d & position(LandmarkId id) const { return positionVec[id]; }
+    const Descriptor & descriptor(LandmarkId id) const { return descriptorVec[id]; }
+
+    //the whole arrays, the removed landmarks included
+    vector<Vector3d> & positions() { return positionVec; }
+    const vector<Vector3d> & positions() const { return positionVec; }
+    const DescriptorVec & descriptors() const { return descriptorVec; }
+
+    //last pose that has observed the landmark, -1 if none,
+    //up to date before commitObservations
+    int lastSeen(LandmarkId id) const { return lastSeenVec[id]; }
+
+    //staged until commitObservations, the observations must come in chronological order
+    void addObservation(LandmarkId id, const Observation & observation);
+
+    void commitObservations();
+
+    bool hasPendingObservations() const { return not pendingVec.empty() or numRemoved > 0; }
+
+    //committed observations of a landmark
+    int numObservations(LandmarkId id) const { return offsetVec[id + 1] - offsetVec[id]; }
+    const Observation * observationBegin(LandmarkId id) const
+    {
+        return observationVec.data() + offsetVec[id];
+    }
+    const Observation * observationEnd(LandmarkId id) const
+    {
+        return observationVec.data() + offsetVec[id + 1];
+    }
+
+    //all the committed observations, the ones of id are in [offsets()[id], offsets()[id + 1])
+    const vector<Observation> & observations() const { return observationVec; }
+    const vector<int> & offsets() const { return offsetVec; }
+
+    //removes the observations for which pred(id, observation) is true
+    template<typename Predicate>
+    void removeObservations(const Predicate & pred)
+    {
+        commitObservations();
+        int dst = 0;
+        int begin = 0;
+        for (LandmarkId id = 0; id < size(); id++)
+        {
+            const int end = offsetVec[id + 1];
+            for (int k = begin; k < end; k++)
+            {
+                if (pred(id, observationVec[k])) continue;
+                observationVec[dst++] = observationVec[k];
+            }
+            const int numObs = dst - offsetVec[id];
+            if (numObs < end - begin)
+            {
+                stampVec[id]++;
+                logChange(id);
+            }
+            begin = end;
+            offsetVec[id + 1] = dst;
+            lastSeenVec[id] = numObs > 0 ? observationVec[dst - 1].poseIdx : -1;
+        }
+        observationVec.erase(observationVec.begin() + dst, observationVec.end());
+    }
+
+    //changes each time observations of the landmark are removed, or the landmark itself,
+    //so that a culling followed by new observations is not taken for nothing
+    int stamp(LandmarkId id) const { return stampVec[id]; }
+
+    //journal of the landmarks whose committed observations have changed or which
+    //have been removed, an id may appear several times;
+    //a reader keeps the position it has read up to, the journal holds the positions
+    //from firstChange() to endChange(), a reader left before firstChange() has to
+    //check every landmark
+    uint64_t firstChange() const { return changeBase; }
+    uint64_t endChange() const { return changeBase + changeLog.size(); }
+    LandmarkId changedLandmark(uint64_t position) const { return changeLog[position - changeBase]; }
+
+    //forgets the changes before position
+    void trimChanges(uint64_t position);
+
+private:
+    vector<Vector3d> positionVec;
+    DescriptorVec descriptorVec;
+    vector<bool> aliveVec;
+    vector<int> lastSeenVec;
+    vector<int> stampVec;
+    //dst of the merge that has removed the landmark, -1 if none
+    vector<LandmarkId> mergedVec;
+    int aliveCount = 0;
+    //removed since the last commit
+    int numRemoved = 0;
+
+    //CSR observations
+    vector<int> offsetVec{0};
+    vector<Observation> observationVec;
+
+    //staged observations
+    vector<pair<LandmarkId, Observation>> pendingVec;
+    //merge buffers
+    vector<int> countVec;
+    vector<Observation> mergeVec;
+
+    void logChange(LandmarkId id);
+
+    vector<LandmarkId> changeLog;
+    uint64_t changeBase = 0;
+};
+
+#endif
@@ -0,0 +1,186 @@
+/*
+Binary map file, used in place through a memory mapping
+*/
+
+#ifndef _SPCMAP_MAP_FILE_H_
+#define _SPCMAP_MAP_FILE_H_
+
+//STL
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+//Eigen
+#include <Eigen/Eigen>
+
+#include "geometry.h"
+#include "landmark_store.h"
+#include "vision.h"
+
+using namespace std;
+using Eigen::Vector3d;
+
+// Layout, little-endian, version 1:
+// the header, then the sections, each one starting on a 64-byte boundary
+// and padded with zeros up to the next one:
+//   positions       3 doubles per landmark
+//   descriptors     64 floats per landmark
+//   alive           1 byte per landmark
+//   offsets         int32, numLandmarks + 1, the observations of id are
+//                   in [offsets[id], offsets[id + 1])
+//   observations    MapFileObservation, sorted by landmark, chronological
+//   trajectory      translation and rotation vector, 6 doubles per pose
+//   calibration     MapFileCamera, left then right
+// Each section has the checksum of its padded bytes, the header has its own.
+
+const uint32_t MAP_FILE_VERSION = 1;
+const int MAP_FILE_ALIGNMENT = 64;
+const int MAP_FILE_MAX_PARAMS = 16;
+
+enum MapFileSectionID
+{
+    MAP_POSITIONS,
+    MAP_DESCRIPTORS,
+    MAP_ALIVE,
+    MAP_OFFSETS,
+    MAP_OBSERVATIONS,
+    MAP_TRAJECTORY,
+    MAP_CALIBRATION,
+    MAP_NUM_SECTIONS
+};
+
+struct MapFileSection
+{
+    uint64_t offset;  // from the beginning of the file
+    uint64_t size;  // bytes, without the padding
+    uint64_t checksum;
+};
+
+struct MapFileHeader
+{
+    char magic[8];  // "SPCMAP" and two zeros
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t fileSize;
+    uint64_t numLandmarks, numObservations, numPoses;
+    MapFileSection sections[MAP_NUM_SECTIONS];
+    //of the bytes above
+    uint64_t headerChecksum;
+};
+
+struct MapFileObservation
+{
+    double u, v;
+    uint32_t poseIdx;
+    uint32_t cameraId;
+};
+
+struct MapFileCamera
+{
+    double TbaseCam[6];
+    int32_t width, height;
+    uint32_t numParams;
+    uint32_t reserved;
+    double params[MAP_FILE_MAX_PARAMS];
+};
+
+static_assert(sizeof(MapFileHeader) == 8 + 8 + 8 + 24 + 24 * MAP_NUM_SECTIONS + 8,
+        "the map file header must not be padded");
+static_assert(sizeof(MapFileObservation) == 24, "the observation record must not be padded");
+static_assert(sizeof(MapFileCamera) == 8 * 6 + 16 + 8 * MAP_FILE_MAX_PARAMS,
+        "the camera record must not be padded");
+
+//64-bit FNV-1a over 8-byte little-endian words, size must be a multiple of 8
+uint64_t mapFileChecksum(const void * data, size_t size, uint64_t seed = 0xcbf29ce484222325ULL);
+
+//streams the committed observations of LM, its landmarks, the trajectory and the calibration
+//to fileName through a fixed buffer, the file is written under a temporary name and renamed
+//once complete, and removed on failure; returns false on an I/O error, if the host is not
+//little-endian or if there are too many observations for the 32-bit offsets
+bool writeMap(const string & fileName, const LandmarkStore & LM,
+        const vector<Transformation<double>> & trajectory, const StereoSystem & stereo);
+
+// A read-only view of a map file. open maps the file and checks its header,
+// nothing else is read: the pages are loaded by the system when they are first
+// accessed, so that opening does not depend on the size of the map.
+// The accessors point into the mapping and are valid until close.
+// verify reads the whole file to check the section checksums.
+class MapView
+{
+public:
+    MapView() {}
+    ~MapView() { close(); }
+
+    MapView(const MapView &) = delete;
+    MapView & operator = (const MapView &) = delete;
+
+    //false if the file cannot be mapped or its header is not consistent
+    bool open(const string & fileName);
+
+    bool verify() const;
+
+    void close();
+
+    bool isOpen() const { return base != NULL; }
+
+    int numLandmarks() const { return header().numLandmarks; }
+    int numObservations() const { return header().numObservations; }
+    int numPoses() const { return header().numPoses; }
+
+    bool alive(LandmarkId id) const { return aliveData[id] != 0; }
+
+    Eigen::Map<const Vector3d> position(LandmarkId id) const
+    {
+        return Eigen::Map<const Vector3d>(positionData + 3 * id);
+    }
+
+    Eigen::Map<const LandmarkStore::Descriptor> descriptor(LandmarkId id) const
+    {
+        return Eigen::Map<const LandmarkStore::Descriptor>(descriptorData + 64 * id);
+    }
+
+    int numObservations(LandmarkId id) const { return offsetData[id + 1] - offsetData[id]; }
+    const MapFileObservation * observationBegin(LandmarkId id) const
+    {
+        return observationData + offsetData[id];
+    }
+    const MapFileObservation * observationEnd(LandmarkId id) const
+    {
+        return observationData + offsetData[id + 1];
+    }
+
+    Transformation<double> pose(int poseIdx) const
+    {
+        return Transformation<double>(trajectoryData + 6 * poseIdx);
+    }
+
+    const MapFileCamera & camera(CameraID cameraId) const { return cameraData[cameraId]; }
+
+    Transformation<double> TbaseCam(CameraID cameraId) const
+    {
+        return Transformation<double>(cameraData[cameraId].TbaseCam);
+    }
+
+    //copies the map into an empty store and trajectory, the ids are kept
+    void copyTo(LandmarkStore & LM, vector<Transformation<double>> & trajectory) const;
+
+private:
+    const MapFileHeader & header() const
+    {
+        return *reinterpret_cast<const MapFileHeader *>(base);
+    }
+
+    const uint8_t * base = NULL;
+    size_t mappedSize = 0;
+
+    const double * positionData = NULL;
+    const float * descriptorData = NULL;
+    const uint8_t * aliveData = NULL;
+    const int32_t * offsetData = NULL;
+    const MapFileObservation * observationData = NULL;
+    const double * trajectoryData = NULL;
+    const MapFileCamera * cameraData = NULL;
+};
+
+#endif
@@ -2,6 +2,7 @@
 #define _SPCMAP_MATCHER_H_
 
 #include <iostream>
+#include <chrono>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/nonfree/features2d.hpp>
@@ -12,6 +13,19 @@
 
 using namespace std;
 
+// quality of a match, the smaller the better
+struct MatchQuality
+{
+    double distance;  // descriptor distance
+    double ratio;  // distance over the second best distance
+    
+    // the ratio is the better predictor, the distance breaks ties
+    bool operator < (const MatchQuality & q) const
+    {
+        return ratio < q.ratio or (ratio == q.ratio and distance < q.distance);
+    }
+};
+
 class Matcher
 {
 public:
@@ -25,10 +39,34 @@ public:
     Eigen::MatrixXi binMapL;
     Eigen::MatrixXi binMapR;
 
+    // bearing vectors of all the pixels, they depend only on the intrinsics
+    Eigen::Matrix3Xf rayMapL;
+    Eigen::Matrix3Xf rayMapR;
+    // size and parameters of the cameras the rays have been computed for
+    vector<double> rayKeyL;
+    vector<double> rayKeyR;
+
     void bruteForce(const vector<Feature> & fVec1,
                     const vector<Feature> & fVec2,
                     vector<int> & matches);
 
+    // also reports the quality of every match, undefined for unmatched features
+    void bruteForce(const vector<Feature> & fVec1,
+                    const vector<Feature> & fVec2,
+                    vector<int> & matches,
+                    vector<MatchQuality> & qualities);
+
+    // only the pairs closer than radius in the image are considered
+    // the features of fVec1 left when the deadline is reached stay unmatched
+    // returns false in that case
+    bool guidedMatch(const vector<Feature> & fVec1,
+                     const vector<Feature> & fVec2,
+                     double radius,
+                     vector<int> & matches,
+                     vector<MatchQuality> & qualities,
+                     chrono::steady_clock::time_point deadline =
+                            chrono::steady_clock::time_point::max());
+
     void bruteForceOneToOne(const vector<Feature> & fVec1,
                             const vector<Feature> & fVec2,
                             vector<int> & matches);
@@ -41,8 +79,16 @@ public:
                           const vector<Feature> & fVec2,
                           vector<int> & matches);
 
+    // the rays are recomputed only if the size or the parameters of a camera change
     void initStereoBins(const StereoSystem & stereo);
 
+    // recomputes the bin maps for the current extrinsics using the cached rays
+    // initStereoBins must have been called once
+    void computeStereoBins(const StereoSystem & stereo,
+            Eigen::MatrixXi & mapL, Eigen::MatrixXi & mapR) const;
+
+    static void initRayMap(const ICamera & camera, Eigen::Matrix3Xf & rayMap);
+
 };
 
 #endif
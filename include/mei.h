@@ -93,6 +93,25 @@ public:
         return MeiProjector<double>::compute(params.data(), src.data(), dst.data());
     }
     
+    virtual void projectPointBlock(const double * x, const double * y, const double * z,
+            double * u, double * v, int numPoints) const
+    {
+        const double & alpha = params[0];
+        const double & beta = params[1];
+        const double & fu = params[2];
+        const double & fv = params[3];
+        const double & u0 = params[4];
+        const double & v0 = params[5];
+        
+        for (int i = 0; i < numPoints; i++)
+        {
+            double denom = alpha * sqrt(z[i]*z[i] + beta*(x[i]*x[i] + y[i]*y[i])) +
+                    (1. - alpha) * z[i];
+            u[i] = fu * x[i] / denom + u0;
+            v[i] = fv * y[i] / denom + v0;
+        }
+    }
+    
     virtual bool projectionJacobian(const Vector3d & src, Eigen::Matrix<double, 2, 3> & Jac) const
     {
         const double & alpha = params[0];
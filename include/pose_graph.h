@@ -0,0 +1,80 @@
+/*
+Pose-graph optimization of the trajectory
+*/
+
+#ifndef _SPCMAP_POSE_GRAPH_H_
+#define _SPCMAP_POSE_GRAPH_H_
+
+//STL
+#include <vector>
+
+//Eigen
+#include <Eigen/Eigen>
+
+#include "geometry.h"
+#include "landmark_store.h"
+
+using namespace std;
+
+typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+typedef Eigen::Matrix<double, 6, 1> Vector6d;
+
+//a measurement of the pose of poseIdx2 in the frame of poseIdx1
+struct RelativePoseConstraint
+{
+    int poseIdx1, poseIdx2;
+    Transformation<double> T12;
+    //inverse covariance of the error, translation first
+    Matrix6d information;
+};
+
+// Levenberg-Marquardt over the poses of the trajectory, the landmarks are left out.
+// A pose is updated as R <- R exp(dr), t <- t + R dt, the error of a constraint
+// is the translation and the rotation vector of T12^-1 Ti^-1 Tj.
+// The Jacobians are analytic and the normal equations are solved with
+// a sparse Cholesky factorization, whose pattern is analyzed once per optimize.
+// A first stage with the translation errors weighted down corrects the rotations.
+class PoseGraph
+{
+public:
+    int maxNumIterations = 30;
+    double functionTolerance = 1e-6;  // relative decrease of the cost that stops the iterations
+    double initialLambda = 1e-4;  // damping relative to the diagonal
+    int numRotationIterations = 5;  // of the first stage, 0 skips it
+    double rotationStageWeight = 1e-6;  // of the translation errors in the first stage
+
+    void addConstraint(int poseIdx1, int poseIdx2, const Transformation<double> & T12,
+            const Matrix6d & information = Matrix6d::Identity());
+
+    //the pose is not optimized, the first pose of the constraints if none is set
+    void setPoseFixed(int poseIdx);
+
+    const vector<RelativePoseConstraint> & constraints() const { return constraintVec; }
+
+    //sum of the squared Mahalanobis errors
+    double cost(const vector<Transformation<double>> & trajectory) const;
+
+    //returns the final cost, the poses not involved in any constraint are not touched
+    double optimize(vector<Transformation<double>> & trajectory);
+
+    void clear();
+
+    //error of the constraint and its Jacobians wrt the updates of both poses
+    static void computeError(const RelativePoseConstraint & constraint,
+            const Transformation<double> & pose1, const Transformation<double> & pose2,
+            Vector6d & error, Matrix6d * J1 = NULL, Matrix6d * J2 = NULL);
+
+private:
+    double cost(const vector<Transformation<double>> & trajectory, double translationWeight) const;
+
+    vector<RelativePoseConstraint> constraintVec;
+    vector<int> fixedPoseVec;
+};
+
+//moves each landmark with the first pose it is seen from,
+//so that it keeps its position in the frame of that pose
+void reanchorLandmarks(LandmarkStore & LM,
+        const vector<Transformation<double>> & oldTrajectory,
+        const vector<Transformation<double>> & newTrajectory);
+
+#endif
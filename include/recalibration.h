@@ -0,0 +1,113 @@
+/*
+Online refinement of the stereo extrinsic calibration
+*/
+
+#ifndef _SPCMAP_RECALIBRATION_H_
+#define _SPCMAP_RECALIBRATION_H_
+
+//STL
+#include <vector>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//Eigen
+#include <Eigen/Eigen>
+
+#include "extractor.h"
+#include "geometry.h"
+#include "matcher.h"
+#include "vision.h"
+
+using namespace std;
+using Eigen::Vector2d;
+using Eigen::Vector3d;
+
+// Sampson error of the epipolar constraint on bearing vectors
+// the baseline length is not observable, the translation is parametrized
+// by its direction: dir = {azimuth, elevation}
+struct EpipolarError
+{
+    EpipolarError(const Vector3d & v1, const Vector3d & v2) : v1(v1), v2(v2) {}
+
+    // args : double rot[3], double dir[2]
+    template<typename T>
+    bool operator()(const T * const rot, const T * const dir, T * residual) const
+    {
+        Vector3<T> rotCam1Cam2(rot[0], rot[1], rot[2]);
+        Matrix3<T> R = rotationMatrix<T>(rotCam1Cam2);
+        Vector3<T> t(cos(dir[1]) * cos(dir[0]), sin(dir[1]), cos(dir[1]) * sin(dir[0]));
+        Vector3<T> x1 = v1.template cast<T>();
+        Vector3<T> x2 = R * v2.template cast<T>();
+        // E * v2 and E^T * v1 with E = hat(t) * R
+        Vector3<T> Ex2 = t.cross(x2);
+        Vector3<T> Etx1 = R.transpose() * x1.cross(t);
+        residual[0] = x1.dot(Ex2) / sqrt(Ex2.squaredNorm() + Etx1.squaredNorm());
+        return true;
+    }
+
+    const Vector3d v1, v2;
+};
+
+// Collects stereo matches in a fixed-size reservoir and periodically refines
+// TbaseCam2 in a low-priority background thread.
+// The tracking thread only calls addStereoMatches and update, none of them blocks:
+// matches are dropped when the worker holds the reservoir,
+// and the new calibration is installed at the next frame otherwise
+class OnlineStereoCalibrator
+{
+public:
+    int reservoirSize = 2000;
+    int minMatches = 300;
+    double period = 5;  // seconds between two refinements
+    double maxRotationStep = 0.02;  // larger corrections are considered as failures
+    double lossScale = 1e-3;  // Cauchy loss on the Sampson error
+
+    OnlineStereoCalibrator(const StereoSystem & stereo, unsigned int seed = 0);
+
+    ~OnlineStereoCalibrator();
+
+    void start();
+
+    void stop();
+
+    // matches as returned by Matcher::stereoMatch
+    void addStereoMatches(const vector<Feature> & fVec1,
+            const vector<Feature> & fVec2,
+            const vector<int> & matches);
+
+    // installs the latest refined calibration and the corresponding bin maps
+    // must be called by the tracking thread between two frames
+    // returns true if the calibration has been changed
+    bool update(StereoSystem & stereo, Matcher & matcher);
+
+private:
+    void run();
+
+    // refines the private stereo system using the reservoir content
+    bool refine(const vector<Vector2d> & ptVec1, const vector<Vector2d> & ptVec2);
+
+    // private copy of the rig, only the worker touches it
+    StereoSystem stereo;
+    Matcher binner;
+
+    // reservoir of matched points, protected by reservoirMutex
+    vector<Vector2d> reservoir1, reservoir2;
+    long long numSeen = 0;
+    mt19937 generator;
+    mutex reservoirMutex;
+
+    // the last calibration published by the worker, protected by resultMutex
+    bool resultReady = false;
+    Transformation<double> resultTbaseCam2;
+    Eigen::MatrixXi resultBinMapL, resultBinMapR;
+    mutex resultMutex;
+
+    thread worker;
+    bool stopRequested = false;
+    mutex stopMutex;
+    condition_variable stopCondition;
+};
+
+#endif
@@ -0,0 +1,164 @@
+/*
+Spatial index over the landmark positions
+*/
+
+#ifndef _SPCMAP_SPATIAL_INDEX_H_
+#define _SPCMAP_SPATIAL_INDEX_H_
+
+//STL
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+
+//Eigen
+#include <Eigen/Eigen>
+
+#include "geometry.h"
+#include "landmark_store.h"
+#include "vision.h"
+
+using namespace std;
+using Eigen::Vector3d;
+using Eigen::Vector3i;
+
+// A hash of cubic voxels, each one holds the ids of the landmarks inside it,
+// the voxels are grouped in blocks of 8x8x8 which list their occupied voxels.
+// Insert, move and remove are O(1), the index keeps its own copy of the positions.
+// A query visits the blocks of its bounding box, or the occupied blocks
+// when they are fewer, culls them as a whole, and then checks the occupied voxels
+// and the landmarks of the remaining ones, so that its cost depends on the
+// queried region rather than on the size of the map.
+// The queries do not allocate if idVec has enough capacity.
+class SpatialIndex
+{
+public:
+    explicit SpatialIndex(double voxelSize = 2) : voxelSize(voxelSize) {}
+
+    double getVoxelSize() const { return voxelSize; }
+
+    //ids below size() may be indexed
+    int size() const { return voxelKeyVec.size(); }
+
+    int numVoxels() const { return voxelMap.size(); }
+
+    bool contains(LandmarkId id) const { return id < size() and slotVec[id] != -1; }
+
+    const Vector3d & position(LandmarkId id) const { return positionVec[id]; }
+
+    void insert(LandmarkId id, const Vector3d & X);
+
+    void move(LandmarkId id, const Vector3d & X);
+
+    void remove(LandmarkId id);
+
+    void reserve(int numLandmarks);
+
+    void clear();
+
+    //appends the ids of the landmarks within radius of center
+    void radiusQuery(const Vector3d & center, double radius, vector<LandmarkId> & idVec) const;
+
+    //appends the ids of the landmarks which project into the image of either camera
+    //of the stereo system at the pose TorigBase, no farther than maxDepth from it;
+    //a camera without its image size (width or height <= 1) is assumed to see in
+    //all directions, only the projection itself must succeed;
+    //the query stops when idVec holds maxSize ids, and then returns false
+    bool frustumQuery(const Transformation<double> & TorigBase, const StereoSystem & stereo,
+            double maxDepth, vector<LandmarkId> & idVec,
+            int maxSize = numeric_limits<int>::max()) const;
+
+private:
+    static const int blockBits = 3;
+
+    struct Voxel
+    {
+        vector<LandmarkId> ids;
+        //place in the list of its block
+        int slot;
+    };
+
+    Vector3i cell(const Vector3d & X) const
+    {
+        return Vector3i(floor(X[0] / voxelSize), floor(X[1] / voxelSize), floor(X[2] / voxelSize));
+    }
+
+    static Vector3i blockOfCell(const Vector3i & c)
+    {
+        return Vector3i(c[0] >> blockBits, c[1] >> blockBits, c[2] >> blockBits);
+    }
+
+    //21 bits per coordinate
+    static int64_t key(const Vector3i & c)
+    {
+        const int64_t mask = (1 << 21) - 1;
+        return ((c[0] + (1 << 20)) & mask) << 42 | ((c[1] + (1 << 20)) & mask) << 21 |
+                ((c[2] + (1 << 20)) & mask);
+    }
+
+    static Vector3i cellOfKey(int64_t k)
+    {
+        const int64_t mask = (1 << 21) - 1;
+        return Vector3i(int((k >> 42) & mask) - (1 << 20), int((k >> 21) & mask) - (1 << 20),
+                int(k & mask) - (1 << 20));
+    }
+
+    static bool inBox(const Vector3i & c, const Vector3i & lo, const Vector3i & hi)
+    {
+        return (c.array() >= lo.array()).all() and (c.array() <= hi.array()).all();
+    }
+
+    //calls f(cell, ids) for the occupied voxels between the cells lo and hi
+    //whose block passes blockTest(block)
+    template<typename BlockTest, typename Function>
+    void forEachVoxel(const Vector3i & lo, const Vector3i & hi,
+            const BlockTest & blockTest, const Function & f) const
+    {
+        auto visit = [&](const Vector3i & b, const vector<int64_t> & voxelKeys)
+        {
+            if (not blockTest(b)) return;
+            for (auto k : voxelKeys)
+            {
+                const Vector3i c = cellOfKey(k);
+                if (inBox(c, lo, hi)) f(c, voxelMap.find(k)->second.ids);
+            }
+        };
+        const Vector3i blockLo = blockOfCell(lo), blockHi = blockOfCell(hi);
+        const Vector3d extent = (blockHi - blockLo).cast<double>() + Vector3d::Ones();
+        if (extent.prod() < blockMap.size())
+        {
+            for (int x = blockLo[0]; x <= blockHi[0]; x++)
+            {
+                for (int y = blockLo[1]; y <= blockHi[1]; y++)
+                {
+                    for (int z = blockLo[2]; z <= blockHi[2]; z++)
+                    {
+                        const Vector3i b(x, y, z);
+                        auto block = blockMap.find(key(b));
+                        if (block != blockMap.end()) visit(b, block->second);
+                    }
+                }
+            }
+        }
+        else
+        {
+            for (auto & block : blockMap)
+            {
+                const Vector3i b = cellOfKey(block.first);
+                if (inBox(b, blockLo, blockHi)) visit(b, block.second);
+            }
+        }
+    }
+
+    double voxelSize;
+    unordered_map<int64_t, Voxel> voxelMap;
+    //occupied voxels of each block
+    unordered_map<int64_t, vector<int64_t>> blockMap;
+    //per id, the voxel and the place in it, slot -1 if not indexed
+    vector<int64_t> voxelKeyVec;
+    vector<int> slotVec;
+    vector<Vector3d> positionVec;
+};
+
+#endif
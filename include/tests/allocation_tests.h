@@ -0,0 +1,12 @@
+#ifndef _ALLOCATION_TESTS_H_
+#define _ALLOCATION_TESTS_H_
+
+void testTrackingAllocations();
+
+void testParallelTrackingAllocations();
+
+void testStationaryAllocations();
+
+void testTrackingOverflow();
+
+#endif
@@ -14,10 +14,53 @@ void testVision();
 
 void testMei();
 
+void testEssentialMatrix();
+
+void testRecalibration();
+
 void testOdometry();
 
+void testPoseRefinement();
+
+void testParallelRansac();
+
+void testProsac();
+
+void testMotionModel();
+
+void testOdometryDeadline();
+
+void testStationaryDetector();
+
+void testPoseCache();
+
 void testBundleAdjustment();
 
+void testLandmarkStore();
+
+void testSpatialIndex();
+
+void testCovisibilityGraph();
+
+void testKeyframeSelector();
+
+void testKeyframeCulling();
+
+void testLandmarkFusion();
+void testConcurrentMapping();
+
+void testPoseGraph();
+
+void testMapFile();
+
+void testTiledMap();
+
+void testLocalBundleAdjustment();
+
+void testIncrementalMapping();
+
+void testPersistentMapping();
+
 void testCartography();
 
 #endif
@@ -0,0 +1,103 @@
+/*
+A minimal fork-join thread pool
+*/
+
+#ifndef _SPCMAP_THREAD_POOL_H_
+#define _SPCMAP_THREAD_POOL_H_
+
+//STL
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+// The workers are created once and sleep between two jobs.
+// run(task) calls task(idx) once for every idx in [0, size()),
+// idx = 0 on the calling thread, and returns when all the calls are over.
+// The task is passed by pointer, so run() does not allocate.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int numThreads)
+    {
+        for (int idx = 1; idx < numThreads; idx++)
+        {
+            workers.push_back(thread(&ThreadPool::loop, this, idx));
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lock(poolMutex);
+            stopping = true;
+        }
+        startCondition.notify_all();
+        for (auto & worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    int size() const { return workers.size() + 1; }
+
+    template<typename Task>
+    void run(const Task & task)
+    {
+        {
+            lock_guard<mutex> lock(poolMutex);
+            taskFunction = &invoke<Task>;
+            taskData = &task;
+            numPending = workers.size();
+            generation++;
+        }
+        startCondition.notify_all();
+        task(0);
+        unique_lock<mutex> lock(poolMutex);
+        doneCondition.wait(lock, [this]{ return numPending == 0; });
+    }
+
+private:
+    template<typename Task>
+    static void invoke(const void * task, int idx)
+    {
+        (*static_cast<const Task *>(task))(idx);
+    }
+
+    void loop(int idx)
+    {
+        unsigned long long lastGeneration = 0;
+        while (true)
+        {
+            void (*function)(const void *, int);
+            const void * data;
+            {
+                unique_lock<mutex> lock(poolMutex);
+                startCondition.wait(lock, [&]{ return stopping or generation != lastGeneration; });
+                if (stopping) return;
+                lastGeneration = generation;
+                function = taskFunction;
+                data = taskData;
+            }
+            function(data, idx);
+            {
+                lock_guard<mutex> lock(poolMutex);
+                numPending--;
+            }
+            doneCondition.notify_one();
+        }
+    }
+
+    vector<thread> workers;
+    mutex poolMutex;
+    condition_variable startCondition, doneCondition;
+    void (*taskFunction)(const void *, int) = NULL;
+    const void * taskData = NULL;
+    unsigned long long generation = 0;
+    int numPending = 0;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,159 @@
+/*
+Out-of-core map split into spatial tiles
+*/
+
+#ifndef _SPCMAP_TILED_MAP_H_
+#define _SPCMAP_TILED_MAP_H_
+
+//STL
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+//Eigen
+#include <Eigen/Eigen>
+
+#include "geometry.h"
+#include "landmark_store.h"
+#include "spatial_index.h"
+#include "vision.h"
+
+using namespace std;
+using Eigen::Vector3d;
+using Eigen::Vector3i;
+
+// The landmarks of a prebuilt map, written as one file per cubic tile
+// with an index of the tiles, and read back around the current position.
+// Only the resident tiles are in memory, each one with its own spatial index,
+// the queries have the interface of SpatialIndex and only see them.
+// setPose requests the tiles within prefetchRadius, the nearest first,
+// and evicts the least recently wanted ones so that the resident and the
+// requested tiles fit in memoryBudget; the requested tiles are read by
+// the prefetch thread if it runs, on the spot otherwise.
+// The loaded tiles become resident at the next setPose, so that the resident
+// set only changes on the thread that calls setPose and the queries, like
+// the references they give, do not need a lock in between.
+class TiledMap
+{
+public:
+    size_t memoryBudget = 256 << 20;  // bytes, see tileBytes
+    double prefetchRadius = 100;  // from the position to the tile, meters
+    double voxelSize = 2;  // of the spatial index of a tile
+
+    TiledMap() {}
+    ~TiledMap() { stop(); }
+
+    TiledMap(const TiledMap &) = delete;
+    TiledMap & operator = (const TiledMap &) = delete;
+
+    //writes the alive landmarks of LM into directory, created if needed,
+    //with their ids; returns false on an I/O error
+    static bool write(const string & directory, const LandmarkStore & LM, double tileSize);
+
+    //reads the index of the tiles, no tile is resident afterwards
+    bool open(const string & directory);
+
+    //starts and stops the prefetch thread
+    void start();
+    void stop();
+
+    //makes the loaded tiles resident and requests the ones around position
+    void setPose(const Vector3d & position);
+
+    //blocks until the requested tiles are loaded and makes them resident
+    void waitForPrefetch();
+
+    double getTileSize() const { return tileSize; }
+    int numTiles() const { return tileInfoMap.size(); }
+    int numResidentTiles() const { return residentVec.size(); }
+    int numResidentLandmarks() const { return residentIdMap.size(); }
+
+    //estimated memory of the resident and the requested tiles
+    size_t memoryUsage() const { return memoryUsed; }
+
+    //estimated memory of a resident tile
+    static size_t tileBytes(int numLandmarks);
+
+    bool contains(LandmarkId id) const { return residentIdMap.count(id) > 0; }
+
+    //the landmark must be resident, the reference is valid until the next setPose
+    const Vector3d & position(LandmarkId id) const;
+    const LandmarkStore::Descriptor & descriptor(LandmarkId id) const;
+
+    //appends the ids of the resident landmarks, see SpatialIndex
+    void radiusQuery(const Vector3d & center, double radius, vector<LandmarkId> & idVec) const;
+
+    bool frustumQuery(const Transformation<double> & TorigBase, const StereoSystem & stereo,
+            double maxDepth, vector<LandmarkId> & idVec,
+            int maxSize = numeric_limits<int>::max()) const;
+
+private:
+    enum TileState {TILE_ABSENT, TILE_REQUESTED, TILE_RESIDENT, TILE_FAILED};
+
+    struct TileInfo
+    {
+        int numLandmarks;
+        TileState state;
+        //setPose call that last wanted the tile
+        uint64_t lastWanted;
+    };
+
+    struct Tile
+    {
+        Tile(double voxelSize) : index(voxelSize) {}
+
+        int64_t key;
+        Vector3i cell;
+        //global ids, the spatial index uses the places in this array
+        vector<LandmarkId> idVec;
+        LandmarkStore::DescriptorVec descriptorVec;
+        SpatialIndex index;
+    };
+
+    //file of the tile in directory
+    static string tileName(int64_t key);
+
+    //reads a tile file, NULL on failure; called from the prefetch thread
+    unique_ptr<Tile> loadTile(int64_t key) const;
+
+    void makeResident(int64_t key, unique_ptr<Tile> tile);
+
+    void evict(int64_t key);
+
+    //moves the tiles loaded by the prefetch thread to the resident set
+    void collectLoaded();
+
+    void prefetchLoop();
+
+    //distance from X to the box of the tile
+    double tileDistance(const Vector3d & X, const Vector3i & cell) const;
+
+    string directory;
+    double tileSize = 0;
+    unordered_map<int64_t, TileInfo> tileInfoMap;
+
+    vector<unique_ptr<Tile>> residentVec;
+    //tile and place of each resident landmark
+    unordered_map<LandmarkId, pair<const Tile *, int>> residentIdMap;
+    size_t memoryUsed = 0;
+    int numRequested = 0;
+    uint64_t numSetPose = 0;
+    vector<pair<double, int64_t>> wantedVec;
+    mutable vector<LandmarkId> localIdVec;
+
+    //shared with the prefetch thread
+    thread prefetchThread;
+    mutex prefetchMutex;
+    condition_variable requestCondition, loadedCondition;
+    deque<int64_t> requestQueue;
+    vector<pair<int64_t, unique_ptr<Tile>>> loadedVec;
+    bool running = false;
+};
+
+#endif
@@ -9,6 +9,7 @@ Stereo vision definition.
 //STL
 #include <vector>
 #include <algorithm>
+#include <random>
 
 //Eigen
 #include <Eigen/Eigen>
@@ -30,8 +31,8 @@ public:
             vector<Eigen::Vector3d> & dst) const;
 
     //TODO make smart constructor with calibration data passed
-    StereoSystem(Transformation<double> & p1, Transformation<double> & p2,
-            ICamera & c1, ICamera & c2)
+    StereoSystem(const Transformation<double> & p1, const Transformation<double> & p2,
+            const ICamera & c1, const ICamera & c2)
             : TbaseCam1(p1), TbaseCam2(p2), cam1(c1.clone()), cam2(c2.clone()) {}
 
     ~StereoSystem();
@@ -46,8 +47,56 @@ public:
     ICamera * cam1, * cam2;
 };
 
-void computeEssentialMatrix(const vector<Eigen::Vector3d> & xVec1,
+// RANSAC-wrapped 8-point estimation of the essential matrix on bearing vectors
+// the convention is xVec1[i]^T * E * xVec2[i] = 0 with E = hat(t) * R,
+// where (t, R) is the pose of the second camera in the frame of the first one
+class EssentialMatrixEstimator
+{
+public:
+    double threshold = 2e-5;  // Sampson error on unit bearing vectors, ~ squared angle
+    double confidence = 0.999;
+    int numIterMax = 200;
+    int minInliers = 15;
+
+    EssentialMatrixEstimator(unsigned int seed = 0) : generator(seed) {}
+
+    // T12 gets a unit-norm translation, the scale is not observable
+    bool compute(const vector<Eigen::Vector3d> & xVec1,
+            const vector<Eigen::Vector3d> & xVec2,
+            Eigen::Matrix3d & E, vector<bool> & inlierMask,
+            Transformation<double> & T12);
+
+    // picks the solution which puts the inliers in front of both cameras
+    static bool decompose(const Eigen::Matrix3d & E,
+            const vector<Eigen::Vector3d> & xVec1,
+            const vector<Eigen::Vector3d> & xVec2,
+            const vector<bool> & inlierMask,
+            Transformation<double> & T12);
+
+private:
+    // least-squares solution for the selected points, projected onto
+    // the essential manifold
+    void solve(const int * idxs, int numPoints, Eigen::Matrix3d & E) const;
+
+    int countInliers(const Eigen::Matrix3d & E);
+
+    mt19937 generator;
+
+    // structure of arrays, one row per coordinate, so that scoring vectorizes
+    Eigen::Array<double, 3, Eigen::Dynamic, Eigen::RowMajor> X1, X2;
+    Eigen::Array<double, 3, Eigen::Dynamic, Eigen::RowMajor> EX2, EtX1;
+    Eigen::Array<double, 1, Eigen::Dynamic> errVec;
+    vector<int> idxVec;
+};
+
+// closed-form P3P solver (Kneip et al. 2011) on bearing vectors
+// solutions are the poses of the camera in the frame of XVec, up to 4
+int solveP3P(const Eigen::Vector3d * fVec, const Eigen::Vector3d * XVec,
+        Transformation<double> * solutions);
+
+bool computeEssentialMatrix(const vector<Eigen::Vector3d> & xVec1,
         const vector<Eigen::Vector3d> & xVec2,
-        Eigen::Matrix3d & E);
+        Eigen::Matrix3d & E, vector<bool> & inlierMask,
+        Transformation<double> & T12);
 
 #endif
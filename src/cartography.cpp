@@ -2,6 +2,10 @@
 
 //STL
 #include <vector>
+#include <bitset>
+#include <algorithm>
+#include <chrono>
+#include <limits>
 
 //Eigen
 #include <Eigen/Eigen>
@@ -18,9 +22,6 @@
 using namespace ceres;
 using Eigen::Matrix;
 
-typedef Eigen::Matrix<double, 6, 6> Matrix6d;
-typedef Eigen::Matrix<double, 6, 1> Vector6d;
-
 using Eigen::Matrix3d;
 using Eigen::Vector3d;
 using Eigen::Vector2d;
@@ -36,6 +37,23 @@ inline double sinc(const double x)
     return std::sin(x)/x;
 }
 
+//maps the rotation vector increments onto the rotation increments
+inline Matrix3d computeLxiInv(const Vector3d & rot)
+{
+    double theta = rot.norm();
+    if ( theta != 0)
+    {
+        Matrix3d uhat = hat<double>(rot / theta);
+        return Matrix3d::Identity() + 
+            theta/2*sinc(theta/2)*uhat + 
+            (1 - sinc(theta))*uhat*uhat;
+    }
+    else
+    {
+        return Matrix3d::Identity();
+    }
+}
+
 OdometryError::OdometryError(const Vector3d X, const Vector2d pt,
         const Transformation<double> & TbaseCam,
         const ICamera & camera)
@@ -46,8 +64,8 @@ OdometryError::OdometryError(const Vector3d X, const Vector2d pt,
             
 ReprojectionErrorStereo::ReprojectionErrorStereo(const Vector2d pt,
         const Transformation<double> & TbaseCam,
-        const ICamera * camera) 
-        : u(pt[0]), v(pt[1]), camera(camera) 
+        const ICamera * camera, const PoseCacheEntry * poseCache) 
+        : u(pt[0]), v(pt[1]), camera(camera), poseCache(poseCache)
 {
     TbaseCam.toRotTransInv(RcamBase, PcamBase);
 }
@@ -117,20 +135,7 @@ bool OdometryError::Evaluate(double const* const* args,
         
         
         // dp / dxi
-        Eigen::Matrix<double, 3, 3> LxiInv;
-
-        double theta = rotOrigBase.norm();
-        if ( theta != 0)
-        {
-            Matrix3d uhat = hat<double>(rotOrigBase / theta);
-            LxiInv = Matrix3d::Identity() + 
-                theta/2*sinc(theta/2)*uhat + 
-                (1 - sinc(theta))*uhat*uhat;
-        }
-        else
-        {
-            LxiInv = Matrix3d::Identity();
-        }
+        Matrix3d LxiInv = computeLxiInv(rotOrigBase);
 
         Eigen::Matrix<double, 2, 3, RowMajor> dpdxi1 = -J * Rco;
         Eigen::Matrix<double, 2, 3, RowMajor>  dpdxi2; // = (Eigen::Matrix<double, 2, 3, RowMajor> *) jac[2];
@@ -148,11 +153,22 @@ bool ReprojectionErrorStereo::Evaluate(double const* const* args,
                     double** jac) const
 {
     Vector3d rot(args[2]);
-    Matrix3d RbaseOrig = rotationMatrix<double>(-rot);
+    Matrix3d RcoLocal;
+    if (poseCache == NULL)
+    {
+        RcoLocal = RcamBase * rotationMatrix<double>(-rot);
+    }
+    else
+    {
+        //args point into the state of the solver, not into the user block the cache reads,
+        //which the solver refreshes before PrepareForEvaluation: only the values match
+        assert(poseCache->rotCached == rot);
+    }
+    const Matrix3d & Rco = poseCache == NULL ? RcoLocal : poseCache->Rco;
     Vector3d Pob(args[1]);    
     Vector3d X(args[0]);
     
-    X = RcamBase * (RbaseOrig * (X - Pob)) + PcamBase;
+    X = Rco * (X - Pob) + PcamBase;
     Vector2d point;
     camera->projectPoint(X, point);
     residuals[0] = point[0] - u;
@@ -164,31 +180,21 @@ bool ReprojectionErrorStereo::Evaluate(double const* const* args,
         Eigen::Matrix<double, 2, 3> J;
         camera->projectionJacobian(X, J);
         
-        Matrix3d Rco = RcamBase * RbaseOrig;
-        
         // dp / dX
         Eigen::Matrix<double, 2, 3, RowMajor> dpdX = J * Rco;
         copy(dpdX.data(), dpdX.data() + 6, jac[0]);
         
         // dp / dxi
-        Eigen::Matrix<double, 3, 3> LxiInv;
-
-        double theta = rot.norm();
-        if ( theta != 0)
+        Matrix3d RcoLxiInvLocal;
+        if (poseCache == NULL)
         {
-            Matrix3d uhat = hat<double>(rot / theta);
-            LxiInv = Matrix3d::Identity() + 
-                theta/2*sinc(theta/2)*uhat + 
-                (1 - sinc(theta))*uhat*uhat;
-        }
-        else
-        {
-            LxiInv = Matrix3d::Identity();
+            RcoLxiInvLocal = Rco * computeLxiInv(rot);
         }
+        const Matrix3d & RcoLxiInv = poseCache == NULL ? RcoLxiInvLocal : poseCache->RcoLxiInv;
 
         Eigen::Matrix<double, 2, 3, RowMajor>  dpdxi2; // = (Eigen::Matrix<double, 2, 3, RowMajor> *) jac[2];
         dpdX *= -1;
-        dpdxi2 = J*hat(X)*Rco*LxiInv;
+        dpdxi2 = J*hat(X)*RcoLxiInv;
         copy(dpdX.data(), dpdX.data() + 6, jac[1]);
         copy(dpdxi2.data(), dpdxi2.data() + 6, jac[2]);
     }
@@ -196,31 +202,303 @@ bool ReprojectionErrorStereo::Evaluate(double const* const* args,
     return true;
 }
 
-void MapInitializer::addFixedObservation(Vector3d & X, Vector2d pt, Transformation<double> & pose,
+void PoseCacheEntry::compute()
+{
+    rotCached = Vector3d(rot);
+    Rco = RcamBase * rotationMatrix<double>(-rotCached);
+    RcoLxiInv = Rco * computeLxiInv(rotCached);
+}
+
+const PoseCacheEntry * PoseCache::addPose(const double * rot,
+        const Transformation<double> & TbaseCam)
+{
+    Vector3d PcamBase;
+    entryVec.emplace_back();
+    PoseCacheEntry & entry = entryVec.back();
+    entry.rot = rot;
+    TbaseCam.toRotTransInv(entry.RcamBase, PcamBase);
+    entry.compute();
+    return &entry;
+}
+
+void PoseCache::activate(const PoseCacheEntry * entry)
+{
+    //the entries belong to the cache
+    PoseCacheEntry * activeEntry = const_cast<PoseCacheEntry *>(entry);
+    if (activeEntry->activeIdx >= 0) return;
+    activeEntry->activeIdx = activeVec.size();
+    activeVec.push_back(activeEntry);
+    if (Vector3d(entry->rot) != entry->rotCached) activeEntry->compute();
+}
+
+void PoseCache::deactivate(const PoseCacheEntry * entry)
+{
+    PoseCacheEntry * activeEntry = const_cast<PoseCacheEntry *>(entry);
+    if (activeEntry->activeIdx < 0) return;
+    activeVec[activeEntry->activeIdx] = activeVec.back();
+    activeVec[activeEntry->activeIdx]->activeIdx = activeEntry->activeIdx;
+    activeVec.pop_back();
+    activeEntry->activeIdx = -1;
+}
+
+void PoseCache::deactivateAll()
+{
+    for (auto entry : activeVec) entry->activeIdx = -1;
+    activeVec.clear();
+}
+
+void PoseCache::PrepareForEvaluation(bool evaluateJacobians, bool newEvaluationPoint)
+{
+    if (not newEvaluationPoint) return;
+    for (auto entry : activeVec)
+    {
+        if (Vector3d(entry->rot) != entry->rotCached) entry->compute();
+    }
+}
+
+MapInitializer::MapInitializer()
+{
+    clear();
+}
+
+void MapInitializer::clear()
+{
+    Problem::Options problemOptions;
+    problemOptions.enable_fast_removal = true;
+    problemOptions.evaluation_callback = &poseCache;
+    //the old cost functions refer to the cache entries
+    problem.reset(new Problem(problemOptions));
+    poseCache.clear();
+    poseEntryVec.clear();
+    residualVec.clear();
+    residualPoseVec.clear();
+    residualStampVec.clear();
+    poseNumResiduals.clear();
+    poseAdded.clear();
+    poseConstant.clear();
+    prevWindow.clear();
+    synced = false;
+    landmarkData = NULL;
+    poseData = NULL;
+}
+
+ResidualBlockId MapInitializer::addFixedObservation(Vector3d & X, Vector2d pt, Transformation<double> & pose,
         const ICamera * cam, const Transformation<double> & TbaseCam)
 {
     CostFunction * costFunc = new ReprojectionErrorFixed(pt, pose, TbaseCam, cam);
-    problem.AddResidualBlock(costFunc, NULL, X.data());
+    return problem->AddResidualBlock(costFunc, NULL, X.data());
 }
 
-void MapInitializer::addObservation(Vector3d & X, Vector2d pt, Transformation<double> & pose,
-        const ICamera * cam, const Transformation<double> & TbaseCam)
+ResidualBlockId MapInitializer::addObservation(Vector3d & X, Vector2d pt, Transformation<double> & pose,
+        const ICamera * cam, const Transformation<double> & TbaseCam,
+        const PoseCacheEntry * poseCache)
+{
+    CostFunction * costFunc = new ReprojectionErrorStereo(pt, TbaseCam, cam, poseCache);
+    return problem->AddResidualBlock(costFunc, NULL, X.data(), pose.transData(), pose.rotData());
+}
+
+void MapInitializer::removeObservation(ResidualBlockId residualId)
+{
+    problem->RemoveResidualBlock(residualId);
+}
+
+void MapInitializer::removeLandmark(Vector3d & X)
+{
+    problem->RemoveParameterBlock(X.data());
+}
+
+void MapInitializer::removePoseResidual(int poseIdx)
 {
-    CostFunction * costFunc = new ReprojectionErrorStereo(pt, TbaseCam, cam);
-    problem.AddResidualBlock(costFunc, NULL, X.data(), pose.transData(), pose.rotData());
+    if (--poseNumResiduals[poseIdx] > 0) return;
+    poseCache.deactivate(poseEntryVec[poseIdx][LEFT]);
+    poseCache.deactivate(poseEntryVec[poseIdx][RIGHT]);
+}
+
+void MapInitializer::setPoseConstant(Transformation<double> & pose, bool constant)
+{
+    if (constant)
+    {
+        problem->SetParameterBlockConstant(pose.transData());
+        problem->SetParameterBlockConstant(pose.rotData());
+    }
+    else
+    {
+        problem->SetParameterBlockVariable(pose.transData());
+        problem->SetParameterBlockVariable(pose.rotData());
+    }
+}
+
+void MapInitializer::update(LandmarkStore & LM, vector<Transformation<double>> & trajectory,
+        const StereoSystem & stereo, int firstPose)
+{
+    windowMask.assign(trajectory.size(), false);
+    fill(windowMask.begin() + min(max(firstPose, 0), int(trajectory.size())), windowMask.end(), true);
+    update(LM, trajectory, stereo, windowMask);
+}
+
+void MapInitializer::updateLandmark(LandmarkStore & LM, LandmarkId id,
+        vector<Transformation<double>> & trajectory, const StereoSystem & stereo,
+        const vector<bool> & poseWindow)
+{
+    Vector3d & X = LM.position(id);
+    vector<ResidualBlockId> & residuals = residualVec[id];
+    vector<int> & residualPoses = residualPoseVec[id];
+    const int numObservations = LM.numObservations(id);
+    bool inWindow = false;
+    if (LM.alive(id))
+    {
+        for (auto obs = LM.observationBegin(id); obs != LM.observationEnd(id); ++obs)
+        {
+            if (obs->poseIdx < poseWindow.size() and poseWindow[obs->poseIdx])
+            {
+                inWindow = true;
+                break;
+            }
+        }
+    }
+    
+    //some observations have been culled, the landmark has been removed
+    //or it has left the window
+    if (not residuals.empty() and (not inWindow or LM.stamp(id) != residualStampVec[id]))
+    {
+        removeLandmark(X);
+        residuals.clear();
+        for (int xiIdx : residualPoses) removePoseResidual(xiIdx);
+        residualPoses.clear();
+    }
+    if (not inWindow) return;
+    
+    residualStampVec[id] = LM.stamp(id);
+    const Observation * observations = LM.observationBegin(id);
+    for (unsigned int k = residuals.size(); k < numObservations; k++)
+    {
+        const Observation & observation = observations[k];
+        const int xiIdx = observation.poseIdx;
+        if (observation.cameraId == LEFT)
+        {
+            residuals.push_back(addObservation(X, observation.pt,
+                    trajectory[xiIdx], stereo.cam1, stereo.TbaseCam1,
+                    poseEntryVec[xiIdx][LEFT]));
+        }
+        else
+        {
+            residuals.push_back(addObservation(X, observation.pt,
+                    trajectory[xiIdx], stereo.cam2, stereo.TbaseCam2,
+                    poseEntryVec[xiIdx][RIGHT]));
+        }
+        residualPoses.push_back(xiIdx);
+        if (poseNumResiduals[xiIdx]++ == 0)
+        {
+            poseCache.activate(poseEntryVec[xiIdx][LEFT]);
+            poseCache.activate(poseEntryVec[xiIdx][RIGHT]);
+        }
+        if (not poseAdded[xiIdx])
+        {
+            poseAdded[xiIdx] = true;
+            changedPoseVec.push_back(xiIdx);
+        }
+    }
+}
+
+void MapInitializer::update(LandmarkStore & LM, vector<Transformation<double>> & trajectory,
+        const StereoSystem & stereo, const vector<bool> & poseWindow,
+        const CovisibilityGraph * covisibility)
+{
+    LM.commitObservations();
+    
+    //the parameter blocks would be dangling
+    if (LM.positions().data() != landmarkData or trajectory.data() != poseData or 
+            LM.size() < residualVec.size())
+    {
+        clear();
+        landmarkData = LM.positions().data();
+        poseData = trajectory.data();
+    }
+    residualVec.resize(LM.size());
+    residualPoseVec.resize(LM.size());
+    residualStampVec.resize(LM.size());
+    poseNumResiduals.resize(trajectory.size(), 0);
+    poseAdded.resize(trajectory.size(), false);
+    poseConstant.resize(trajectory.size(), false);
+    for (unsigned int j = poseEntryVec.size(); j < trajectory.size(); j++)
+    {
+        poseEntryVec.push_back({poseCache.addPose(trajectory[j].rotData(), stereo.TbaseCam1),
+                poseCache.addPose(trajectory[j].rotData(), stereo.TbaseCam2)});
+    }
+    
+    changedPoseVec.clear();
+    if (covisibility != NULL and synced and changePosition >= LM.firstChange())
+    {
+        //the landmarks whose observations have changed
+        candidateVec.clear();
+        for (uint64_t position = changePosition; position < LM.endChange(); position++)
+        {
+            candidateVec.push_back(LM.changedLandmark(position));
+        }
+        //and the ones of the poses which have entered or left the window
+        const int numPoses = max(prevWindow.size(), poseWindow.size());
+        for (int j = 0; j < numPoses; j++)
+        {
+            const bool inWindow = j < poseWindow.size() and poseWindow[j];
+            const bool wasInWindow = j < prevWindow.size() and prevWindow[j];
+            if (inWindow == wasInWindow) continue;
+            const vector<LandmarkId> & landmarks = covisibility->landmarks(j);
+            candidateVec.insert(candidateVec.end(), landmarks.begin(), landmarks.end());
+            if (j < trajectory.size()) changedPoseVec.push_back(j);
+        }
+        sort(candidateVec.begin(), candidateVec.end());
+        candidateVec.erase(unique(candidateVec.begin(), candidateVec.end()), candidateVec.end());
+        for (auto id : candidateVec)
+        {
+            if (id < LM.size()) updateLandmark(LM, id, trajectory, stereo, poseWindow);
+        }
+    }
+    else
+    {
+        for (LandmarkId id = 0; id < LM.size(); id++)
+        {
+            updateLandmark(LM, id, trajectory, stereo, poseWindow);
+        }
+        for (unsigned int j = 0; j < trajectory.size(); j++)
+        {
+            changedPoseVec.push_back(j);
+        }
+    }
+    synced = true;
+    changePosition = LM.endChange();
+    prevWindow = poseWindow;
+    
+    //the poses which have been added or whose window flag has changed
+    for (auto j : changedPoseVec)
+    {
+        if (not poseAdded[j]) continue;
+        const bool constant = j == 0 or j >= poseWindow.size() or not poseWindow[j];
+        if (constant != poseConstant[j])
+        {
+            setPoseConstant(trajectory[j], constant);
+            poseConstant[j] = constant;
+        }
+    }
 }
 
 void MapInitializer::compute()
 {
     Solver::Options options;
     options.linear_solver_type = ceres::DENSE_SCHUR;
+    options.initial_trust_region_radius = trustRegionRadius;
 //    options.function_tolerance = 1e-3;
 //    options.gradient_tolerance = 1e-4;
 //    options.parameter_tolerance = 1e-4;
 //    options.minimizer_progress_to_stdout = true;
     Solver::Summary summary;
-    Solve(options, &problem, &summary);
+    Solve(options, problem.get(), &summary);
 //    cout << summary.FullReport() << endl;
+    
+    //not more optimistic than the default, not stuck with a collapsed region either
+    if (not summary.iterations.empty())
+    {
+        trustRegionRadius = max(1., min(1e4, summary.iterations.back().trust_region_radius));
+    }
 }
 
 void StereoCartography::projectPointCloud(const vector<Vector3d> & src,
@@ -233,178 +511,1225 @@ void StereoCartography::projectPointCloud(const vector<Vector3d> & src,
     stereo.projectPointCloud(Xb, dst1, dst2);
 }
 
+void IncrementalSmoother::activateLandmark(int i)
+{
+    if (landmarkActive[i]) return;
+    landmarkActive[i] = true;
+    activeLandmarkVec.push_back(i);
+}
+
+void IncrementalSmoother::activatePose(int j)
+{
+    if (poseActive[j]) return;
+    poseActive[j] = true;
+    activePoseVec.push_back(j);
+}
+
+void IncrementalSmoother::dropFactors(int i)
+{
+    for (int f : landmarkFactors[i])
+    {
+        Factor & factor = factorVec[f];
+        vector<int> & factors = poseFactors[factor.poseIdx];
+        *find(factors.begin(), factors.end(), f) = factors.back();
+        factors.pop_back();
+        factor.costFunction.reset();
+        freeFactorVec.push_back(f);
+    }
+    landmarkFactors[i].clear();
+}
+
+void IncrementalSmoother::update(LandmarkStore & LM,
+        vector<Transformation<double>> & trajectory)
+{
+    LM.commitObservations();
+    numUpdates++;
+    movedLandmarkVec.clear();
+    
+    //new variables
+    for (unsigned int j = poseVec.size(); j < trajectory.size(); j++)
+    {
+        poseVec.push_back(trajectory[j]);
+        poseFactors.emplace_back();
+        poseActive.push_back(false);
+        activatePose(j);
+        poseEntryVec.push_back({poseCache.addPose(poseVec.back().rotData(), stereo.TbaseCam1),
+                poseCache.addPose(poseVec.back().rotData(), stereo.TbaseCam2)});
+    }
+    for (LandmarkId i = landmarkVec.size(); i < LM.size(); i++)
+    {
+        landmarkVec.push_back(LM.position(i));
+        landmarkFactors.emplace_back();
+        numAdded.push_back(0);
+        factorStampVec.push_back(LM.stamp(i));
+        landmarkActive.push_back(false);
+        activateLandmark(i);
+    }
+    
+    //the landmarks whose observations have changed, all of them
+    //if the journal of LM has been trimmed since the last update
+    candidateVec.clear();
+    if (changePosition >= LM.firstChange())
+    {
+        for (uint64_t position = changePosition; position < LM.endChange(); position++)
+        {
+            candidateVec.push_back(LM.changedLandmark(position));
+        }
+        sort(candidateVec.begin(), candidateVec.end());
+        candidateVec.erase(unique(candidateVec.begin(), candidateVec.end()), candidateVec.end());
+    }
+    else
+    {
+        for (LandmarkId i = 0; i < LM.size(); i++)
+        {
+            candidateVec.push_back(i);
+        }
+    }
+    changePosition = LM.endChange();
+    
+    //new observations activate both their variables
+    for (auto i : candidateVec)
+    {
+        const int numObservations = LM.numObservations(i);
+        //removed landmark or culled observations, the factors are dropped
+        if (LM.stamp(i) != factorStampVec[i])
+        {
+            factorStampVec[i] = LM.stamp(i);
+            dropFactors(i);
+            numAdded[i] = 0;
+            if (LM.alive(i)) activateLandmark(i);
+        }
+        
+        const Observation * observations = LM.observationBegin(i);
+        for (unsigned int k = numAdded[i]; k < numObservations; k++)
+        {
+            const Observation & observation = observations[k];
+            int f = factorVec.size();
+            if (freeFactorVec.empty())
+            {
+                factorVec.emplace_back();
+            }
+            else
+            {
+                f = freeFactorVec.back();
+                freeFactorVec.pop_back();
+            }
+            Factor & factor = factorVec[f];
+            factor.landmarkIdx = i;
+            factor.poseIdx = observation.poseIdx;
+            if (observation.cameraId == LEFT)
+            {
+                factor.costFunction.reset(new ReprojectionErrorStereo(observation.pt,
+                        stereo.TbaseCam1, stereo.cam1, poseEntryVec[factor.poseIdx][LEFT]));
+            }
+            else
+            {
+                factor.costFunction.reset(new ReprojectionErrorStereo(observation.pt,
+                        stereo.TbaseCam2, stereo.cam2, poseEntryVec[factor.poseIdx][RIGHT]));
+            }
+            landmarkFactors[i].push_back(f);
+            poseFactors[observation.poseIdx].push_back(f);
+            activateLandmark(i);
+            activatePose(observation.poseIdx);
+        }
+        numAdded[i] = numObservations;
+    }
+    
+    //the removed landmarks are no longer optimized
+    activeLandmarkVec.erase(remove_if(activeLandmarkVec.begin(), activeLandmarkVec.end(),
+            [this, &LM](int i) {
+        if (LM.alive(i)) return false;
+        landmarkActive[i] = false;
+        return true;
+    }), activeLandmarkVec.end());
+    
+    //the factors of the active variables, the cost functions belong to the smoother
+    Problem::Options problemOptions;
+    problemOptions.cost_function_ownership = DO_NOT_TAKE_OWNERSHIP;
+    problemOptions.evaluation_callback = &poseCache;
+    Problem problem(problemOptions);
+    usedFactorVec.clear();
+    poseCache.deactivateAll();
+    auto addFactor = [&](int f)
+    {
+        Factor & factor = factorVec[f];
+        if (factor.lastUsed == numUpdates) return;
+        factor.lastUsed = numUpdates;
+        usedFactorVec.push_back(f);
+        poseCache.activate(poseEntryVec[factor.poseIdx][LEFT]);
+        poseCache.activate(poseEntryVec[factor.poseIdx][RIGHT]);
+        Transformation<double> & pose = poseVec[factor.poseIdx];
+        problem.AddResidualBlock(factor.costFunction.get(), NULL,
+                landmarkVec[factor.landmarkIdx].data(), pose.transData(), pose.rotData());
+    };
+    for (int j : activePoseVec)
+    {
+        for (int f : poseFactors[j]) addFactor(f);
+    }
+    for (int i : activeLandmarkVec)
+    {
+        for (int f : landmarkFactors[i]) addFactor(f);
+    }
+    lastActivePoses = activePoseVec.size();
+    lastActiveLandmarks = activeLandmarkVec.size();
+    if (usedFactorVec.empty())
+    {
+        for (int j : activePoseVec) poseActive[j] = false;
+        for (int i : activeLandmarkVec) landmarkActive[i] = false;
+        activePoseVec.clear();
+        activeLandmarkVec.clear();
+        return;
+    }
+    
+    //the neighbors are fixed
+    for (int f : usedFactorVec)
+    {
+        const int i = factorVec[f].landmarkIdx;
+        const int j = factorVec[f].poseIdx;
+        if (not landmarkActive[i])
+        {
+            problem.SetParameterBlockConstant(landmarkVec[i].data());
+        }
+        if (not poseActive[j] or j == 0)
+        {
+            problem.SetParameterBlockConstant(poseVec[j].transData());
+            problem.SetParameterBlockConstant(poseVec[j].rotData());
+        }
+    }
+    
+    landmarkPrev.clear();
+    posePrev.clear();
+    for (int i : activeLandmarkVec) landmarkPrev.push_back(landmarkVec[i]);
+    for (int j : activePoseVec) posePrev.push_back(poseVec[j]);
+    
+    Solver::Options options;
+    options.linear_solver_type = ceres::SPARSE_SCHUR;
+    options.max_num_iterations = maxNumIterations;
+    Solver::Summary summary;
+    Solve(options, &problem, &summary);
+    
+    //only the variables that have moved enough stay active
+    int numActive = 0;
+    for (unsigned int k = 0; k < activeLandmarkVec.size(); k++)
+    {
+        const int i = activeLandmarkVec[k];
+        landmarkActive[i] = (landmarkVec[i] - landmarkPrev[k]).norm() > relinearizeThreshold;
+        LM.position(i) = landmarkVec[i];
+        movedLandmarkVec.push_back(i);
+        if (landmarkActive[i]) activeLandmarkVec[numActive++] = i;
+    }
+    activeLandmarkVec.resize(numActive);
+    numActive = 0;
+    for (unsigned int k = 0; k < activePoseVec.size(); k++)
+    {
+        const int j = activePoseVec[k];
+        const double delta = (poseVec[j].trans() - posePrev[k].trans()).norm() + 
+                (poseVec[j].rot() - posePrev[k].rot()).norm();
+        poseActive[j] = delta > relinearizeThreshold;
+        trajectory[j] = poseVec[j];
+        if (poseActive[j]) activePoseVec[numActive++] = j;
+    }
+    activePoseVec.resize(numActive);
+}
+
+void IncrementalSmoother::resync(const LandmarkStore & LM,
+        const vector<Transformation<double>> & trajectory)
+{
+    for (unsigned int i = 0; i < landmarkVec.size(); i++)
+    {
+        landmarkVec[i] = LM.position(i);
+        if (LM.alive(i)) activateLandmark(i);
+    }
+    for (unsigned int j = 0; j < poseVec.size(); j++)
+    {
+        poseVec[j] = trajectory[j];
+        activatePose(j);
+    }
+}
+
 void StereoCartography::improveTheMap()
 {   
+    LM.commitObservations();
+    if (landmarkFusion) fuseLandmarks();
+    if (keyframeCulling) cullKeyframes();
+    covisibility.update(LM);
+    
+    if (incrementalMapping)
+    {
+        smoother.update(LM, trajectory);
+        updateLandmarkIndex(false);
+        for (int i : smoother.movedLandmarks())
+        {
+            if (landmarkIndex.contains(i)) landmarkIndex.move(i, LM.position(i));
+        }
+        //the unused back end checks every landmark if it is switched on
+        LM.trimChanges(LM.endChange());
+        return;
+    }
+    
     //BUNDLE ADJUSTMENT
-    MapInitializer initializer;
-    for (auto & landmark : LM)
+    //only the poses of the window and the landmarks they observe are optimized:
+    //the last localWindowSize keyframes, the poses which observe landmarks,
+    //and the best covisible ones of the last keyframe
+    const int numPoses = trajectory.size();
+    poseWindow.assign(numPoses, localWindowSize <= 0);
+    if (localWindowSize > 0)
     {
-        for (auto & observation : landmark.observations)
+        int lastKeyframe = -1;
+        int numKeyframes = 0;
+        for (int j = numPoses - 1; j >= 0 and numKeyframes < localWindowSize; j--)
+        {
+            if (covisibility.landmarks(j).empty()) continue;
+            poseWindow[j] = true;
+            if (lastKeyframe == -1) lastKeyframe = j;
+            numKeyframes++;
+        }
+        if (numCovisiblePoses > 0 and lastKeyframe != -1)
         {
-            int xiIdx = observation.poseIdx;
-            if (xiIdx == 0)
+            covisibility.bestNeighbours(lastKeyframe, numCovisiblePoses,
+                    covisiblePoseVec, minCovisibleWeight);
+            for (auto poseIdx : covisiblePoseVec)
             {
-                if (observation.cameraId == LEFT)
-                {
-                    initializer.addFixedObservation(landmark.X, observation.pt,
-                            trajectory[xiIdx], stereo.cam1, stereo.TbaseCam1);
-                }
-                else
-                {
-                    initializer.addFixedObservation(landmark.X, observation.pt,
-                            trajectory[xiIdx], stereo.cam2, stereo.TbaseCam2);
-                }
+                if (poseIdx < numPoses) poseWindow[poseIdx] = true;
             }
-            else if (observation.cameraId == LEFT)
+        }
+    }
+    initializer.update(LM, trajectory, stereo, poseWindow, &covisibility);
+    initializer.compute();
+    //the optimized landmarks are the ones seen from the window
+    updateLandmarkIndex(localWindowSize <= 0);
+    if (localWindowSize > 0)
+    {
+        for (int j = 0; j < numPoses; j++)
+        {
+            if (not poseWindow[j]) continue;
+            for (auto id : covisibility.landmarks(j))
             {
-                initializer.addObservation(landmark.X, observation.pt,
-                        trajectory[xiIdx], stereo.cam1, stereo.TbaseCam1);
+                if (landmarkIndex.contains(id)) landmarkIndex.move(id, LM.position(id));
             }
-            else
+        }
+    }
+    LM.trimChanges(LM.endChange());
+}
+
+double StereoCartography::closeLoop(int poseIdx1, int poseIdx2,
+        const Transformation<double> & T12, const Matrix6d & information)
+{
+    LM.commitObservations();
+    covisibility.update(LM);
+    
+    //the current relative poses are the measurements, the loop contradicts them
+    const int numPoses = trajectory.size();
+    poseGraph.clear();
+    poseGraph.setPoseFixed(0);
+    for (int j = 1; j < numPoses; j++)
+    {
+        poseGraph.addConstraint(j - 1, j, trajectory[j - 1].inverseCompose(trajectory[j]));
+    }
+    for (int j = 0; j < numPoses; j++)
+    {
+        for (auto & neighbour : covisibility.neighbours(j))
+        {
+            if (neighbour.poseIdx <= j + 1 or neighbour.poseIdx >= numPoses) continue;
+            if (neighbour.weight < minCovisibleWeight) continue;
+            poseGraph.addConstraint(j, neighbour.poseIdx,
+                    trajectory[j].inverseCompose(trajectory[neighbour.poseIdx]));
+        }
+    }
+    poseGraph.addConstraint(poseIdx1, poseIdx2, T12, information);
+    
+    trajectoryBeforeLoop = trajectory;
+    const double cost = poseGraph.optimize(trajectory);
+    reanchorLandmarks(LM, trajectoryBeforeLoop, trajectory);
+    if (incrementalMapping) smoother.resync(LM, trajectory);
+    //the last trust region fitted the map before the correction
+    initializer.resetTrustRegion();
+    updateLandmarkIndex(true);
+    return cost;
+}
+
+shared_ptr<MapSnapshot> StereoCartography::makeSnapshot(double radius)
+{
+    LM.commitObservations();
+    updateLandmarkIndex(false);
+    shared_ptr<MapSnapshot> snapshot = make_shared<MapSnapshot>();
+    snapshot->numPoses = trajectory.size();
+    if (not trajectory.empty()) snapshot->lastPose = trajectory.back();
+    vector<LandmarkId> idVec;
+    landmarkIndex.radiusQuery(snapshot->lastPose.trans(), radius, idVec);
+    sort(idVec.begin(), idVec.end());
+    snapshot->idVec.reserve(idVec.size());
+    snapshot->descriptorVec.reserve(idVec.size());
+    snapshot->lastSeenVec.reserve(idVec.size());
+    snapshot->index.reserve(idVec.size());
+    for (auto id : idVec)
+    {
+        snapshot->index.insert(snapshot->idVec.size(), LM.position(id));
+        snapshot->idVec.push_back(id);
+        snapshot->descriptorVec.push_back(LM.descriptor(id));
+        snapshot->lastSeenVec.push_back(LM.lastSeen(id));
+    }
+    return snapshot;
+}
+
+bool StereoCartography::saveMap(const string & fileName)
+{
+    LM.commitObservations();
+    return writeMap(fileName, LM, trajectory, stereo);
+}
+
+int StereoCartography::fuseLandmarks()
+{
+    LM.commitObservations();
+    if (firstUnfused > LM.size()) firstUnfused = 0;
+    updateLandmarkIndex(false);
+    int numFused = 0;
+    for (LandmarkId id = firstUnfused; id < LM.size(); id++)
+    {
+        if (not LM.alive(id) or LM.numObservations(id) == 0) continue;
+        const int firstSeen = LM.observationBegin(id)->poseIdx;
+        fusionCandidateVec.clear();
+        landmarkIndex.radiusQuery(LM.position(id), fusionRadius, fusionCandidateVec);
+        LandmarkId best = -1;
+        double bestDist = maxFusionDescriptorDist;
+        for (auto candidate : fusionCandidateVec)
+        {
+            //the observations of id are appended to the ones of the candidate
+            if (candidate == id or not LM.alive(candidate)) continue;
+            if (LM.numObservations(candidate) == 0 or LM.lastSeen(candidate) >= firstSeen) continue;
+            const double dist = (LM.descriptor(candidate) - LM.descriptor(id)).norm();
+            if (dist <= bestDist)
             {
-                initializer.addObservation(landmark.X, observation.pt,
-                        trajectory[xiIdx], stereo.cam2, stereo.TbaseCam2);
+                bestDist = dist;
+                best = candidate;
             }
         }
+        if (best == -1) continue;
+        LM.merge(id, best);
+        landmarkIndex.remove(id);
+        numFused++;
     }
-    initializer.compute();
+    firstUnfused = LM.size();
+    LM.commitObservations();
+    return numFused;
+}
 
+int StereoCartography::cullKeyframes()
+{
+    LM.commitObservations();
+    const int numPoses = trajectory.size();
+    poseToCheck.resize(numPoses, false);
+    auto check = [this, numPoses](int poseIdx)
+    {
+        if (poseIdx >= numPoses or poseToCheck[poseIdx]) return;
+        poseToCheck[poseIdx] = true;
+        cullCandidateVec.push_back(poseIdx);
+    };
+    
+    //the journal has been trimmed since the last call
+    const bool full = cullChangePosition < LM.firstChange() or int(numObserversVec.size()) > LM.size();
+    if (not full)
+    {
+        //the keyframes which have lost a landmark, before the graph forgets them
+        for (uint64_t position = cullChangePosition; position < LM.endChange(); position++)
+        {
+            for (auto poseIdx : covisibility.poses(LM.changedLandmark(position))) check(poseIdx);
+        }
+    }
+    covisibility.update(LM);
+    
+    //number of keyframes each landmark is seen from,
+    //the ones which see a changed landmark are judged again
+    numObserversVec.resize(LM.size(), 0);
+    if (full)
+    {
+        for (LandmarkId id = 0; id < LM.size(); id++)
+        {
+            numObserversVec[id] = covisibility.poses(id).size();
+        }
+        for (int j = 0; j < numPoses; j++)
+        {
+            if (not covisibility.landmarks(j).empty()) check(j);
+        }
+    }
+    else
+    {
+        for (uint64_t position = cullChangePosition; position < LM.endChange(); position++)
+        {
+            const LandmarkId id = LM.changedLandmark(position);
+            const vector<int> & poses = covisibility.poses(id);
+            numObserversVec[id] = poses.size();
+            for (auto poseIdx : poses) check(poseIdx);
+        }
+    }
+    cullChangePosition = LM.endChange();
+    
+    //the last max(localWindowSize, 1) keyframes are kept, and judged later
+    int lastCandidate = numPoses;
+    for (int numKept = 0; lastCandidate > 0 and numKept < max(localWindowSize, 1); )
+    {
+        lastCandidate--;
+        if (not covisibility.landmarks(lastCandidate).empty()) numKept++;
+    }
+    
+    //the oldest first, a culled keyframe no longer counts as an observer
+    sort(cullCandidateVec.begin(), cullCandidateVec.end());
+    int numCulled = 0;
+    int numLeft = 0;
+    for (auto j : cullCandidateVec)
+    {
+        if (j >= numPoses) continue;
+        if (j >= lastCandidate)
+        {
+            cullCandidateVec[numLeft++] = j;
+            continue;
+        }
+        poseToCheck[j] = false;
+        const vector<LandmarkId> & landmarks = covisibility.landmarks(j);
+        if (j == 0 or landmarks.empty()) continue;
+        int numRedundant = 0;
+        for (auto id : landmarks)
+        {
+            if (numObserversVec[id] - 1 >= minRedundantObservers) numRedundant++;
+        }
+        if (numRedundant < redundantRatio * landmarks.size()) continue;
+        if (numCulled++ == 0) poseCulled.assign(numPoses, false);
+        poseCulled[j] = true;
+        for (auto id : landmarks)
+        {
+            numObserversVec[id]--;
+        }
+    }
+    cullCandidateVec.resize(numLeft);
+    
+    if (numCulled > 0)
+    {
+        LM.removeObservations([this](LandmarkId id, const Observation & observation)
+        {
+            return observation.poseIdx < poseCulled.size() and poseCulled[observation.poseIdx];
+        });
+        //the observer counts already account for the culled keyframes
+        cullChangePosition = LM.endChange();
+    }
+    return numCulled;
+}
+
+void StereoCartography::updateLandmarkIndex(bool full)
+{
+    if (landmarkIndex.size() > LM.size()) landmarkIndex.clear();
+    //the journal has been trimmed since the last update
+    if (indexChangePosition < LM.firstChange()) full = true;
+    const int first = full ? 0 : landmarkIndex.size();
+    if (not full)
+    {
+        for (uint64_t position = indexChangePosition; position < LM.endChange(); position++)
+        {
+            const LandmarkId id = LM.changedLandmark(position);
+            if (id < first) updateIndexedLandmark(id);
+        }
+    }
+    for (LandmarkId id = first; id < LM.size(); id++)
+    {
+        updateIndexedLandmark(id);
+    }
+    indexChangePosition = LM.endChange();
+}
+
+void StereoCartography::updateIndexedLandmark(LandmarkId id)
+{
+    if (not LM.alive(id)) landmarkIndex.remove(id);
+    else if (landmarkIndex.contains(id)) landmarkIndex.move(id, LM.position(id));
+    else landmarkIndex.insert(id, LM.position(id));
 }
 
-void Odometry::computeTransformation()
+bool Odometry::computeTransformation()
 {
     assert(observationVec.size() == cloud.size());
     assert(observationVec.size() == inlierMask.size());
-    Problem problem;
-    for (unsigned int i = 0; i < cloud.size(); i++)
+    
+    //Gauss-Newton on the 6 pose parameters, same residuals and Jacobians as OdometryError
+    Matrix3d RcamBase;
+    Vector3d PcamBase;
+    TbaseCam.toRotTransInv(RcamBase, PcamBase);
+    
+    //the last evaluated pose, the step taken from it has not been checked yet
+    Transformation<double> prevPose = TorigBase;
+    double prevCost = -1;
+    for (int iteration = 0; iteration < refineIterMax; iteration++)
     {
+        if (chrono::steady_clock::now() > deadline)
+        {
+            TorigBase = prevPose;
+            return false;
+        }
+        
+        const Vector3d & PorigBase = TorigBase.trans();
+        const Vector3d & rotOrigBase = TorigBase.rot();
+        //everything that depends on the pose only
+        Matrix3d Rco = RcamBase * rotationMatrix<double>(-rotOrigBase);
+        Matrix3d RcoLxiInv = Rco * computeLxiInv(rotOrigBase);
+        
+        Matrix6d H = Matrix6d::Zero();
+        Vector6d g = Vector6d::Zero();
+        double cost = 0;
+        for (unsigned int i = 0; i < cloud.size(); i++)
+        {
+            if (not inlierMask[i]) continue;
+            Vector3d Xtr = Rco * (cloud[i] - PorigBase) + PcamBase;
+            Vector2d point;
+            if (not camera.projectPoint(Xtr, point)) continue;
+            Vector2d res = point - observationVec[i];
+            
+            Eigen::Matrix<double, 2, 3> J;
+            camera.projectionJacobian(Xtr, J);
+            Eigen::Matrix<double, 2, 6> Jxi;
+            Jxi.leftCols<3>() = -J * Rco;
+            Jxi.rightCols<3>() = J * hat(Xtr) * RcoLxiInv;
+            
+            //Huber weight
+            double resNorm = res.norm();
+            double weight = 1;
+            if (huberThreshold > 0 and resNorm > huberThreshold)
+            {
+                weight = huberThreshold / resNorm;
+                cost += huberThreshold * (2 * resNorm - huberThreshold);
+            }
+            else
+            {
+                cost += resNorm * resNorm;
+            }
+            H.noalias() += weight * Jxi.transpose() * Jxi;
+            g.noalias() += weight * Jxi.transpose() * res;
+        }
+        
+        //the previous step made things worse
+        if (prevCost >= 0 and cost > prevCost)
+        {
+            TorigBase = prevPose;
+            return true;
+        }
+        prevCost = cost;
+        prevPose = TorigBase;
         
-        if (not inlierMask[i]) continue;
-        CostFunction * costFunc = new OdometryError(cloud[i],
-                                        observationVec[i], TbaseCam, camera);
-        problem.AddResidualBlock(costFunc, NULL,
-                    TorigBase.transData(), TorigBase.rotData());
+        Vector6d delta = H.ldlt().solve(-g);
+        if (delta != delta) return true;
+        TorigBase.trans() += delta.head<3>();
+        TorigBase.rot() += delta.tail<3>();
+        if (delta.squaredNorm() < refineTolerance) return true;
     }
+    TorigBase = prevPose;
+    return true;
+}
+
+int Odometry::countInliers(const Transformation<double> & pose,
+        uint64_t * mask, double epsilon) const
+{
+    const int numPoints = cloudX.size();
+    Matrix3d R;
+    Vector3d P;
+    pose.compose(TbaseCam).toRotTransInv(R, P);
     
-    Solver::Options options;
-    options.linear_solver_type = ceres::DENSE_SCHUR;
-    Solver::Summary summary;
-    Solve(options, &problem, &summary);
+    //SPRT, the log-likelihood ratio of a bad against a good hypothesis
+    const bool sprt = epsilon > sprtDelta;
+    const double logLambdaInlier = log(sprtDelta / epsilon);
+    const double logLambdaOutlier = log((1 - sprtDelta) / (1 - epsilon));
+    const double logThreshold = log(sprtThreshold);
+    double logLambda = 0;
+    
+    const double threshSq = inlierThreshold * inlierThreshold;
+    const int blockSize = 64;
+    double xc[blockSize], yc[blockSize], zc[blockSize], u[blockSize], v[blockSize];
+    int count = 0;
+    //one mask word per block, the temporaries stay in L1
+    for (int start = 0; start < numPoints; start += blockSize)
+    {
+        const int n = min(blockSize, numPoints - start);
+        const double * x = cloudX.data() + start;
+        const double * y = cloudY.data() + start;
+        const double * z = cloudZ.data() + start;
+        for (int i = 0; i < n; i++)
+        {
+            xc[i] = R(0, 0)*x[i] + R(0, 1)*y[i] + R(0, 2)*z[i] + P(0);
+            yc[i] = R(1, 0)*x[i] + R(1, 1)*y[i] + R(1, 2)*z[i] + P(1);
+            zc[i] = R(2, 0)*x[i] + R(2, 1)*y[i] + R(2, 2)*z[i] + P(2);
+        }
+        camera.projectPointBlock(xc, yc, zc, u, v, n);
+        
+        const double * uObs = obsU.data() + start;
+        const double * vObs = obsV.data() + start;
+        uint64_t word = 0;
+        for (int i = 0; i < n; i++)
+        {
+            double du = u[i] - uObs[i];
+            double dv = v[i] - vObs[i];
+            word |= uint64_t(du*du + dv*dv < threshSq) << i;
+        }
+        mask[start / blockSize] = word;
+        
+        const int blockInliers = bitset<64>(word).count();
+        count += blockInliers;
+        if (sprt)
+        {
+            logLambda += blockInliers * logLambdaInlier + (n - blockInliers) * logLambdaOutlier;
+            if (logLambda > logThreshold) return -1;
+        }
+    }
+    return count;
 }
         
-void Odometry::Ransac()
+void Odometry::reserve(int maxPoints)
 {
-    assert(observationVec.size() == cloud.size());
-    int numPoints = observationVec.size();
+    observationVec.reserve(maxPoints);
+    cloud.reserve(maxPoints);
+    inlierMask.reserve(maxPoints);
+    qualityVec.reserve(maxPoints);
+    cloudX.reserve(maxPoints);
+    cloudY.reserve(maxPoints);
+    cloudZ.reserve(maxPoints);
+    obsU.reserve(maxPoints);
+    obsV.reserve(maxPoints);
+    bearingVec.reserve(maxPoints);
+    orderVec.reserve(maxPoints);
+    sampleSubsetVec.reserve(numIterMax);
+    sampleLastVec.reserve(numIterMax);
     
-    inlierMask.resize(numPoints);
+    const int numWorkers = threadPool == NULL ? 1 : threadPool->size();
+    const int numWords = (maxPoints + 63) / 64;
+    workerVec.resize(numWorkers);
+    for (auto & worker : workerVec)
+    {
+        worker.mask.reserve(numWords);
+        worker.bestMask.reserve(numWords);
+    }
+}
+
+void Odometry::reset(const Transformation<double> & TorigBaseInit)
+{
+    TorigBase = TorigBaseInit;
+    observationVec.clear();
+    cloud.clear();
+    inlierMask.clear();
+    qualityVec.clear();
+}
+
+void Odometry::reset(const Transformation<double> & TorigBaseInit,
+        const Transformation<double> & TbaseCamInit)
+{
+    reset(TorigBaseInit);
+    TbaseCam = TbaseCamInit;
+}
+
+int Odometry::requiredIterations(int numInliers) const
+{
+    //number of iterations to reach the required confidence
+    if (numInliers == 0) return numIterMax;
+    double inlierRatio = double(numInliers) / observationVec.size();
+    double logOutlier = log(1. - pow(inlierRatio, 3));
+    if (logOutlier < 0)
+    {
+        //clamped before the conversion, the count overflows int for a low inlier ratio
+        return int(min(double(numIterMax), ceil(log(1. - confidence) / logOutlier)));
+    }
+    return 0;
+}
+
+void Odometry::initSampling()
+{
+    const int numPoints = observationVec.size();
+    const int m = 3;
+    orderVec.resize(numPoints);
+    sampleSubsetVec.resize(numIterMax);
+    sampleLastVec.resize(numIterMax);
+    for (int i = 0; i < numPoints; i++)
+    {
+        orderVec[i] = i;
+    }
     
-    const int numIterMax = 25;
-    const Transformation<double> initialPose = TorigBase;
-    int bestInliers = 0;
-    //TODO add a termination criterion
-    for (unsigned int iteration = 0; iteration < numIterMax; iteration++)
-    {
-        Transformation<double> pose = initialPose;
-        int maxIdx = observationVec.size();
-        //choose three points at random
-	    int idx1m = rand() % maxIdx;
-	    int idx2m, idx3m;
-	    do 
-	    {
-		    idx2m = rand() % maxIdx;
-	    } while (idx2m == idx1m);
-	
-	    do 
-	    {
-		    idx3m = rand() % maxIdx;
-	    } while (idx3m == idx1m or idx3m == idx2m);
-        
+    //uniform sampling without quality information
+    if (qualityVec.size() != numPoints)
+    {
+        fill(sampleSubsetVec.begin(), sampleSubsetVec.end(), numPoints);
+        fill(sampleLastVec.begin(), sampleLastVec.end(), false);
+        return;
+    }
+    
+    sort(orderVec.begin(), orderVec.end(), [this](int a, int b) 
+    {
+        return qualityVec[a] < qualityVec[b] or 
+                (not (qualityVec[b] < qualityVec[a]) and a < b);
+    });
+    
+    //PROSAC growth function, the subset size depends only on the iteration
+    //Tn is the expected number of samples from the n best points
+    //among prosacMaxSamples uniform ones, TnPrime its integer counterpart
+    double Tn = prosacMaxSamples;
+    for (int i = 0; i < m; i++)
+    {
+        Tn *= double(m - i) / (numPoints - i);
+    }
+    int n = m;
+    int TnPrime = 1;
+    for (int t = 1; t <= numIterMax; t++)
+    {
+        if (t > TnPrime and n < numPoints)
+        {
+            double Tnext = Tn * (n + 1) / (n + 1 - m);
+            TnPrime += max(1, int(ceil(Tnext - Tn)));
+            Tn = Tnext;
+            n++;
+        }
+        sampleSubsetVec[t - 1] = n;
+        sampleLastVec[t - 1] = t <= TnPrime;
+    }
+}
+
+void Odometry::ransacWorker(int idx)
+{
+    RansacWorker & worker = workerVec[idx];
+    const int numWorkers = workerVec.size();
+    const int numPoints = observationVec.size();
+    
+    //P3P gives TorigCam, the base pose is TorigCam * TcamBase
+    const Transformation<double> TcamBase = TbaseCam.inverseCompose(Transformation<double>());
+    
+    //only the local state is used, so that the result does not depend on timing
+    int numIter = requiredIterations(worker.bestInliers);
+    worker.timedOut = false;
+    for (int iteration = idx; iteration < numIter; iteration += numWorkers)
+    {
+        if (chrono::steady_clock::now() > deadline)
+        {
+            worker.timedOut = true;
+            break;
+        }
         
-        //solve an optimization problem 
+        //choose three points at random among the best ranked ones
+        //the last one of the subset is forced when it has just been added
+        const int subsetSize = sampleSubsetVec[iteration];
+        const bool forceLast = sampleLastVec[iteration];
+        uniform_int_distribution<int> distrib(0, subsetSize - (forceLast ? 2 : 1));
+        int idx1m = distrib(worker.generator);
+        int idx2m, idx3m;
+        do 
+        {
+            idx2m = distrib(worker.generator);
+        } while (idx2m == idx1m);
         
-        Problem problem;
-        for (auto i : {idx1m, idx2m, idx3m})
+        if (forceLast)
         {
-            CostFunction * costFunc = new OdometryError(cloud[i],
-                                        observationVec[i], TbaseCam, camera);
-            problem.AddResidualBlock(costFunc, NULL,
-                        pose.transData(), pose.rotData());
+            idx3m = subsetSize - 1;
         }
+        else
+        {
+            do 
+            {
+                idx3m = distrib(worker.generator);
+            } while (idx3m == idx1m or idx3m == idx2m);
+        }
+        idx1m = orderVec[idx1m];
+        idx2m = orderVec[idx2m];
+        idx3m = orderVec[idx3m];
         
-        Solver::Options options;
-        options.linear_solver_type = ceres::DENSE_SCHUR;
-        Solver::Summary summary;
-        options.max_num_iterations = 5;
-        Solve(options, &problem, &summary);
-            
-        //count inliers
-        vector<Vector3d> XcamVec(numPoints);
-        Transformation<double> TorigCam = pose.compose(TbaseCam);
-        TorigCam.inverseTransform(cloud, XcamVec);
-        vector<Vector2d> projVec(numPoints);
-        camera.projectPointCloud(XcamVec, projVec);
-        vector<bool> currentInlierMask(numPoints, false);
+        //solve the minimal problem
+        const Vector3d fVec[3]{bearingVec[idx1m], bearingVec[idx2m], bearingVec[idx3m]};
+        const Vector3d XVec[3]{cloud[idx1m], cloud[idx2m], cloud[idx3m]};
+        Transformation<double> TorigCamVec[4];
+        int numSolutions = solveP3P(fVec, XVec, TorigCamVec);
         
-        int countInliers = 0;
-        for (unsigned int i = 0; i < numPoints; i++)
-        {   
-            Vector2d err = observationVec[i] - projVec[i];
-            if (err.norm() < 2)
+        //score each candidate directly
+        for (int k = 0; k < numSolutions; k++)
+        {
+            Transformation<double> pose = TorigCamVec[k].compose(TcamBase);
+            //the best inlier ratio so far is a lower bound for a good hypothesis
+            int countHyp = countInliers(pose, worker.mask.data(),
+                    double(worker.bestInliers) / numPoints);
+            //keep the best hypothesis
+            if (countHyp > worker.bestInliers)
             {
-                currentInlierMask[i] = true;
-                countInliers++;
+                swap(worker.mask, worker.bestMask);
+                worker.bestInliers = countHyp;
+                worker.bestPose = pose;
+                
+                numIter = requiredIterations(countHyp);
             }
         }
-        //keep the best hypothesis
-        if (countInliers > bestInliers)
+    }
+}
+        
+bool Odometry::Ransac()
+{
+    assert(observationVec.size() == cloud.size());
+    int numPoints = observationVec.size();
+    
+    inlierMask.resize(numPoints);
+    if (numPoints < 3) return true;
+    
+    //bearing vectors handle any projection model
+    camera.reconstructPointCloud(observationVec, bearingVec);
+    
+    cloudX.resize(numPoints);
+    cloudY.resize(numPoints);
+    cloudZ.resize(numPoints);
+    obsU.resize(numPoints);
+    obsV.resize(numPoints);
+    for (int i = 0; i < numPoints; i++)
+    {
+        cloudX[i] = cloud[i][0];
+        cloudY[i] = cloud[i][1];
+        cloudZ[i] = cloud[i][2];
+        obsU[i] = observationVec[i][0];
+        obsV[i] = observationVec[i][1];
+    }
+    
+    initSampling();
+    
+    //each worker has its own seeded generator
+    //and starts from the initial guess as its first hypothesis
+    const int numWorkers = threadPool == NULL ? 1 : threadPool->size();
+    const int numWords = (numPoints + 63) / 64;
+    workerVec.resize(numWorkers);
+    workerVec[0].mask.resize(numWords);
+    workerVec[0].bestMask.resize(numWords);
+    const int priorInliers = max(0, countInliers(TorigBase, workerVec[0].bestMask.data()));
+    for (int idx = 0; idx < numWorkers; idx++)
+    {
+        workerVec[idx].generator.seed(seed + idx);
+        workerVec[idx].bestInliers = priorInliers;
+        workerVec[idx].bestPose = TorigBase;
+        workerVec[idx].mask.resize(numWords);
+        workerVec[idx].bestMask = workerVec[0].bestMask;
+    }
+    
+    auto task = [this](int idx) { ransacWorker(idx); };
+    if (threadPool == NULL) task(0);
+    else threadPool->run(task);
+    
+    //deterministic reduction, ties go to the lowest worker index
+    const RansacWorker * best = NULL;
+    bool complete = true;
+    for (auto & worker : workerVec)
+    {
+        complete = complete and not worker.timedOut;
+        if (worker.bestInliers > (best == NULL ? 0 : best->bestInliers))
+        {
+            best = &worker;
+        }
+    }
+    if (best == NULL) return complete;
+    TorigBase = best->bestPose;
+    for (int i = 0; i < numPoints; i++)
+    {
+        inlierMask[i] = (best->bestMask[i / 64] >> (i % 64)) & 1;
+    }
+    return complete;
+}
+
+Transformation<double> MotionModel::predict(
+        const vector<Transformation<double>> & trajectory) const
+{
+    const int numPoses = trajectory.size();
+    if (numPoses < 2) return trajectory.back();
+    
+    //the last displacement in the base frame, scaled down by the damping
+    Transformation<double> delta = trajectory[numPoses - 2].inverseCompose(trajectory.back());
+    delta.trans() *= 1 - damping;
+    delta.rot() *= 1 - damping;
+    return trajectory.back().compose(delta);
+}
+
+double MotionModel::searchRadius(const vector<Transformation<double>> & trajectory) const
+{
+    if (trajectory.size() < 2) return -1;
+    return max(minSearchRadius, min(maxSearchRadius, searchRadiusGain * predictionError));
+}
+
+bool StationaryDetector::isStationary(const vector<Feature> & featureVec)
+{
+    const int numFeatures = featureVec.size();
+    if (refFeatureVec.empty() or numFeatures == 0 or numSkipped >= maxSkipped) return false;
+    
+    //evenly spread samples, each one is compared to the whole reference frame
+    const int step = max(1, numFeatures / numSamples);
+    const double maxDisplacementSq = maxDisplacement * maxDisplacement;
+    int numTested = 0, numStatic = 0;
+    for (int i = 0; i < numFeatures; i += step)
+    {
+        numTested++;
+        for (auto & ref : refFeatureVec)
         {
-            //TODO copy in a bettegit lor way
-            inlierMask = currentInlierMask;
-            bestInliers = countInliers;
-            TorigBase = pose;
-        }        
+            if ((ref.pt - featureVec[i].pt).squaredNorm() > maxDisplacementSq) continue;
+            if ((ref.desc - featureVec[i].desc).norm() > maxDescriptorDist) continue;
+            numStatic++;
+            break;
+        }
     }
+    if (numStatic < minStaticRatio * numTested) return false;
+    numSkipped++;
+    return true;
+}
+
+void StationaryDetector::setReference(const vector<Feature> & featureVec)
+{
+    refFeatureVec = featureVec;
+    numSkipped = 0;
+}
+
+bool KeyframeSelector::isKeyframe(const Transformation<double> & pose, int numTracked,
+        double meanDepth)
+{
+    numFrames++;
+    if (not hasKeyframe or numFrames >= maxFrames) return true;
+    if (numTracked < minTrackedRatio * keyframeTracked) return true;
+    Transformation<double> delta = keyframePose.inverseCompose(pose);
+    if (delta.rot().norm() > minRotation) return true;
+    return meanDepth > 0 and delta.trans().norm() > minParallax * meanDepth;
+}
+
+void KeyframeSelector::setKeyframe(const Transformation<double> & pose, int numTracked)
+{
+    hasKeyframe = true;
+    keyframePose = pose;
+    keyframeTracked = numTracked;
+    numFrames = 0;
+}
+
+void OdometryReport::reset()
+{
+    quality = ODOMETRY_FULL;
+    matchTime = ransacTime = refineTime = 0;
+    numMatches = numInliers = 0;
+    keyframe = false;
+    matchVec.clear();
+    tiledMatchVec.clear();
+}
+
+void StereoCartography::initTracking()
+{
+    odometry.threadPool = threadPool;
+    odometry.reserve(maxFeatures);
+    stationaryDetector.reserve(maxFeatures);
+    updateLandmarkIndex(true);
+    const int maxLandmarks = maxActiveLandmarks + (tiledMap != NULL ? maxTiledLandmarks : 0);
+    activeIdVec.reserve(maxVisibleLandmarks);
+    tiledIdVec.reserve(tiledMap != NULL ? maxVisibleLandmarks : 0);
+    activeDescriptorVec.reserve(maxLandmarks);
+    lmFeatureVec.reserve(maxLandmarks);
+    activeCloud.reserve(maxLandmarks);
+    XcamVec.reserve(maxLandmarks);
+    predVec.reserve(maxLandmarks);
+    matchedPredVec.reserve(maxFeatures);
+    matchedFeatureVec.reserve(maxFeatures);
+    matchVec.reserve(maxFeatures);
+    odometryReport.matchVec.reserve(maxFeatures);
+    odometryReport.tiledMatchVec.reserve(tiledMap != NULL ? maxFeatures : 0);
+    matchQualityVec.reserve(maxFeatures);
 }
 
 Transformation<double> StereoCartography::estimateOdometry(const vector<Feature> & featureVec)
 {
+    typedef chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    Clock::time_point matchDeadline = Clock::time_point::max();
+    Clock::time_point ransacDeadline = Clock::time_point::max();
+    Clock::time_point refineDeadline = Clock::time_point::max();
+    if (timeBudget > 0)
+    {
+        auto budget = [&](double share) {
+            return start + chrono::duration_cast<Clock::duration>(
+                    chrono::duration<double>(share * timeBudget));
+        };
+        matchDeadline = budget(matchBudgetShare);
+        ransacDeadline = budget(matchBudgetShare + ransacBudgetShare);
+        refineDeadline = budget(1);
+    }
+    auto elapsed = [](Clock::time_point from) {
+        return chrono::duration<double>(Clock::now() - from).count();
+    };
+    odometryReport.reset();
+    
+    //Prediction
+    Transformation<double> Tpred = motionModel.predict(trajectory);
+    
+    if (featureVec.size() > maxFeatures)
+    {
+        odometryReport.quality = ODOMETRY_OVERFLOW;
+        return Tpred;
+    }
+    
+    if (detectStationary)
+    {
+        if (not trajectory.empty() and stationaryDetector.isStationary(featureVec))
+        {
+            odometryReport.quality = ODOMETRY_STATIONARY;
+            odometryReport.matchTime = elapsed(start);
+            return trajectory.back();
+        }
+        stationaryDetector.setReference(featureVec);
+    }
+    
     //Matching
     
-    int numLandmarks = LM.size();
-    int numActive = min(300, numLandmarks);
-    vector<Feature> lmFeatureVec;
-//    cout << "ca va" << endl;
-    for (unsigned int i = numLandmarks - numActive; i < numLandmarks; i++)
+    //the landmarks in the predicted field of view, the most recently seen ones
+    //if there are too many, the removed ones leave the index with improveTheMap
+    //the query is bounded by the capacity reserved by initTracking
+    activeIdVec.clear();
+    activeCloud.clear();
+    activeDescriptorVec.clear();
+    lmFeatureVec.clear();
+    //held until the end, activeDescriptorVec points into it
+    const shared_ptr<const MapSnapshot> snapshot = mapSnapshot;
+    if (snapshot != NULL)
+    {
+        //the places of the landmarks in the snapshot
+        snapshot->index.frustumQuery(Tpred, stereo, maxLandmarkDepth, activeIdVec,
+                maxVisibleLandmarks);
+        const vector<int> & lastSeen = snapshot->lastSeenVec;
+        const vector<LandmarkId> & ids = snapshot->idVec;
+        if (activeIdVec.size() > maxActiveLandmarks)
+        {
+            nth_element(activeIdVec.begin(), activeIdVec.begin() + maxActiveLandmarks,
+                    activeIdVec.end(), [&lastSeen, &ids](int a, int b) {
+                return lastSeen[a] > lastSeen[b] or (lastSeen[a] == lastSeen[b] and ids[a] > ids[b]);
+            });
+            activeIdVec.resize(maxActiveLandmarks);
+        }
+        for (auto place : activeIdVec)
+        {
+            activeCloud.push_back(snapshot->index.position(place));
+            activeDescriptorVec.push_back(&snapshot->descriptorVec[place]);
+        }
+    }
+    else
+    {
+        landmarkIndex.frustumQuery(Tpred, stereo, maxLandmarkDepth, activeIdVec,
+                maxVisibleLandmarks);
+        activeIdVec.erase(remove_if(activeIdVec.begin(), activeIdVec.end(),
+                [this](LandmarkId id) { return not LM.alive(id); }), activeIdVec.end());
+        if (activeIdVec.size() > maxActiveLandmarks)
+        {
+            nth_element(activeIdVec.begin(), activeIdVec.begin() + maxActiveLandmarks,
+                    activeIdVec.end(), [this](LandmarkId a, LandmarkId b) {
+                return LM.lastSeen(a) > LM.lastSeen(b) or (LM.lastSeen(a) == LM.lastSeen(b) and a > b);
+            });
+            activeIdVec.resize(maxActiveLandmarks);
+        }
+        for (auto id : activeIdVec)
+        {
+            activeCloud.push_back(LM.position(id));
+            activeDescriptorVec.push_back(&LM.descriptor(id));
+        }
+    }
+    
+    //the visible landmarks of the prebuilt map, the nearest ones if there are too many
+    if (tiledMap != NULL)
+    {
+        //tiledMap must be set before initTracking
+        assert(tiledIdVec.capacity() >= size_t(maxVisibleLandmarks));
+        tiledIdVec.clear();
+        tiledMap->frustumQuery(Tpred, stereo, maxLandmarkDepth, tiledIdVec, maxVisibleLandmarks);
+        if (tiledIdVec.size() > maxTiledLandmarks)
+        {
+            const Vector3d center = Tpred.trans();
+            nth_element(tiledIdVec.begin(), tiledIdVec.begin() + maxTiledLandmarks,
+                    tiledIdVec.end(), [this, &center](LandmarkId a, LandmarkId b) {
+                return (tiledMap->position(a) - center).squaredNorm() <
+                        (tiledMap->position(b) - center).squaredNorm();
+            });
+            tiledIdVec.resize(maxTiledLandmarks);
+        }
+        for (auto id : tiledIdVec)
+        {
+            activeCloud.push_back(tiledMap->position(id));
+            activeDescriptorVec.push_back(&tiledMap->descriptor(id));
+        }
+    }
+    const int numActive = activeCloud.size();
+    //where the landmarks are expected to be observed
+    Tpred.compose(stereo.TbaseCam1).inverseTransform(activeCloud, XcamVec);
+    stereo.cam1->projectPointCloud(XcamVec, predVec);
+    for (unsigned int i = 0; i < numActive; i++)
     {
-        lmFeatureVec.push_back(Feature(Vector2d(0, 0), LM[i].d));
+        lmFeatureVec.push_back(Feature(predVec[i], *activeDescriptorVec[i]));
     }
-//    cout << "ca va" << endl;       
+    
     Matcher matcher;    
-    vector<int> matchVec;    
-    matcher.bruteForce(featureVec, lmFeatureVec, matchVec);
+    double radius = motionModel.searchRadius(trajectory);
+    if (radius <= 0) radius = numeric_limits<double>::infinity();
+    bool complete = matcher.guidedMatch(featureVec, lmFeatureVec, radius,
+            matchVec, matchQualityVec, matchDeadline);
     
-    Odometry odometry(trajectory.back(), stereo.TbaseCam1, stereo.cam1);
-//    cout << "ca va" << endl;
+    odometry.reset(Tpred, stereo.TbaseCam1);
+    odometry.threadPool = threadPool;
+    matchedPredVec.clear();
+    matchedFeatureVec.clear();
     for (unsigned int i = 0; i < featureVec.size(); i++)
     {
         const int match = matchVec[i];
         if (match == -1) continue;
         odometry.observationVec.push_back(featureVec[i].pt);
-        odometry.cloud.push_back(LM[numLandmarks  - numActive + match].X);
+        odometry.cloud.push_back(activeCloud[match]);
+        odometry.qualityVec.push_back(matchQualityVec[i]);
+        matchedPredVec.push_back(predVec[match]);
+        matchedFeatureVec.push_back(i);
     }
-//    cout << "cloud : " << odometry.cloud.size() << endl;
+    odometryReport.numMatches = odometry.cloud.size();
+    odometryReport.matchTime = elapsed(start);
+    
+    //nothing to estimate the motion from, the next frame is searched in the widest window
+    if (odometry.cloud.size() < 3 or Clock::now() > ransacDeadline)
+    {
+        motionModel.predictionError = motionModel.maxSearchRadius;
+        odometryReport.quality = ODOMETRY_PREDICTED;
+        return Tpred;
+    }
+    
     //RANSAC
-    odometry.Ransac();
-//    cout << odometry.TorigBase << endl;
+    Clock::time_point stageStart = Clock::now();
+    odometry.deadline = ransacDeadline;
+    complete = odometry.Ransac() and complete;
+    odometryReport.ransacTime = elapsed(stageStart);
+    
     //Final transformation computation
-    odometry.computeTransformation();
-//    cout << odometry.TorigBase << endl;
+    stageStart = Clock::now();
+    odometry.deadline = refineDeadline;
+    complete = odometry.computeTransformation() and complete;
+    odometryReport.refineTime = elapsed(stageStart);
+    odometryReport.quality = complete ? ODOMETRY_FULL : ODOMETRY_PARTIAL;
+    
+    //the prediction error on the inliers sets the next search window
+    //the active landmarks of LM or of the snapshot come before the ones of tiledMap
+    const int numLocal = activeIdVec.size();
+    double errorSum = 0, depthSum = 0;
+    int numInliers = 0;
+    for (unsigned int i = 0; i < matchedPredVec.size(); i++)
+    {
+        if (not odometry.inlierMask[i]) continue;
+        errorSum += (matchedPredVec[i] - odometry.observationVec[i]).norm();
+        depthSum += (odometry.cloud[i] - odometry.TorigBase.trans()).norm();
+        numInliers++;
+        const int feature = matchedFeatureVec[i];
+        const int active = matchVec[feature];
+        if (active >= numLocal)
+        {
+            odometryReport.tiledMatchVec.emplace_back(feature, tiledIdVec[active - numLocal]);
+        }
+        else
+        {
+            const LandmarkId id = activeIdVec[active];
+            odometryReport.matchVec.emplace_back(feature,
+                    snapshot != NULL ? snapshot->idVec[id] : id);
+        }
+    }
+    motionModel.predictionError = numInliers > 0 ? errorSum / numInliers :
+            motionModel.maxSearchRadius;
+    odometryReport.numInliers = numInliers;
+    
+    //a pose estimated from no inliers is not worth a keyframe
+    if (numInliers > 0 and keyframeSelector.isKeyframe(odometry.TorigBase, numInliers,
+            depthSum / numInliers))
+    {
+        keyframeSelector.setKeyframe(odometry.TorigBase, numInliers);
+        odometryReport.keyframe = true;
+    }
     return odometry.TorigBase;
 }
-
-
-
-
-
-
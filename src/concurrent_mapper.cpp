@@ -0,0 +1,138 @@
+//STL
+#include <vector>
+#include <memory>
+#include <utility>
+
+#include "concurrent_mapper.h"
+
+void ConcurrentMapper::start()
+{
+    if (running) return;
+    running = true;
+    mappingThread = thread(&ConcurrentMapper::mappingLoop, this);
+}
+
+void ConcurrentMapper::stop()
+{
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (not running) return;
+        running = false;
+    }
+    queueCondition.notify_all();
+    mappingThread.join();
+}
+
+void ConcurrentMapper::addKeyframe(KeyframeData keyframe)
+{
+    keyframe.pose = correction.inverseCompose(keyframe.pose);
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (running)
+        {
+            queueVec.push_back(move(keyframe));
+            queueCondition.notify_one();
+            return;
+        }
+    }
+    integrate(keyframe);
+    mapping.improveTheMap();
+    publish();
+}
+
+bool ConcurrentMapper::loadSnapshot(StereoCartography & tracking)
+{
+    shared_ptr<const MapSnapshot> latest = snapshot();
+    if (latest == NULL or latest == tracking.mapSnapshot) return false;
+    tracking.mapSnapshot = latest;
+    //brings the last mapped keyframe from its uncorrected pose onto the optimized one
+    const Transformation<double> identity;
+    const Transformation<double> newCorrection = latest->lastPose.compose(
+            latest->trackedPose.inverseCompose(identity));
+    //what is left to apply on top of the corrections already applied
+    const Transformation<double> delta = newCorrection.compose(correction.inverseCompose(identity));
+    for (auto & pose : tracking.trajectory)
+    {
+        pose = delta.compose(pose);
+    }
+    tracking.keyframeSelector.correct(delta);
+    correction = newCorrection;
+    return true;
+}
+
+void ConcurrentMapper::waitForMapping()
+{
+    unique_lock<mutex> lock(queueMutex);
+    mappedCondition.wait(lock, [this] { return queueVec.empty() and not busy; });
+}
+
+void ConcurrentMapper::mappingLoop()
+{
+    unique_lock<mutex> lock(queueMutex);
+    while (true)
+    {
+        queueCondition.wait(lock, [this] { return not running or not queueVec.empty(); });
+        //once stopped, the loop goes on until the queue is empty
+        if (queueVec.empty()) break;
+        swap(queueVec, batchVec);
+        busy = true;
+        lock.unlock();
+
+        //the keyframes queued during the last improvement are mapped together
+        for (auto & keyframe : batchVec)
+        {
+            integrate(keyframe);
+        }
+        batchVec.clear();
+        mapping.improveTheMap();
+        publish();
+
+        lock.lock();
+        busy = false;
+        mappedCondition.notify_all();
+    }
+}
+
+void ConcurrentMapper::integrate(const KeyframeData & keyframe)
+{
+    LandmarkStore & LM = mapping.LM;
+    const int poseIdx = mapping.trajectory.size();
+    //the motion since the last keyframe is applied to its mapped pose,
+    //which the optimization may have moved
+    if (hasTrackedPose)
+    {
+        mapping.trajectory.push_back(mapping.trajectory.back().compose(
+                lastTrackedPose.inverseCompose(keyframe.pose)));
+    }
+    else
+    {
+        mapping.trajectory.push_back(keyframe.pose);
+    }
+    hasTrackedPose = true;
+    lastTrackedPose = keyframe.pose;
+    const LandmarkId firstNew = LM.size();
+    for (unsigned int k = 0; k < keyframe.newLandmarkVec.size(); k++)
+    {
+        LM.add(keyframe.newLandmarkVec[k], keyframe.newDescriptorVec[k]);
+    }
+    for (auto & entry : keyframe.observationVec)
+    {
+        LandmarkId id = entry.first < 0 ? firstNew - 1 - entry.first : entry.first;
+        if (id >= LM.size()) continue;
+        //the landmark may have been fused into another one since the snapshot,
+        //or removed, then its observations are dropped
+        id = LM.resolve(id);
+        if (not LM.alive(id)) continue;
+        Observation observation = entry.second;
+        observation.poseIdx = poseIdx;
+        LM.addObservation(id, observation);
+    }
+}
+
+void ConcurrentMapper::publish()
+{
+    shared_ptr<MapSnapshot> snapshot = mapping.makeSnapshot(snapshotRadius);
+    snapshot->version = ++version;
+    snapshot->trackedPose = lastTrackedPose;
+    atomic_store(&published, shared_ptr<const MapSnapshot>(move(snapshot)));
+}
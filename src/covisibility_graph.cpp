@@ -0,0 +1,212 @@
+//STL
+#include <vector>
+#include <algorithm>
+
+#include "covisibility_graph.h"
+
+int CovisibilityGraph::weight(int pose1, int pose2) const
+{
+    if (pose1 >= numPoses()) return 0;
+    for (auto & neighbour : neighbourVec[pose1])
+    {
+        if (neighbour.poseIdx == pose2) return neighbour.weight;
+    }
+    return 0;
+}
+
+const vector<CovisibilityGraph::Neighbour> & CovisibilityGraph::neighbours(int poseIdx) const
+{
+    static const vector<Neighbour> empty;
+    if (poseIdx >= numPoses()) return empty;
+    return neighbourVec[poseIdx];
+}
+
+const vector<LandmarkId> & CovisibilityGraph::landmarks(int poseIdx) const
+{
+    static const vector<LandmarkId> empty;
+    if (poseIdx >= numPoses()) return empty;
+    return poseLandmarkVec[poseIdx];
+}
+
+const vector<int> & CovisibilityGraph::poses(LandmarkId id) const
+{
+    static const vector<int> empty;
+    if (id >= int(landmarkPoseVec.size())) return empty;
+    return landmarkPoseVec[id];
+}
+
+void CovisibilityGraph::bestNeighbours(int poseIdx, int N, vector<int> & poseVec,
+        int minWeight) const
+{
+    poseVec.clear();
+    vector<Neighbour> & candidateVec = candidateBuffer;
+    candidateVec.clear();
+    for (auto & neighbour : neighbours(poseIdx))
+    {
+        if (neighbour.weight >= minWeight) candidateVec.push_back(neighbour);
+    }
+    const int numBest = min(N, int(candidateVec.size()));
+    partial_sort(candidateVec.begin(), candidateVec.begin() + numBest, candidateVec.end(),
+            [](const Neighbour & a, const Neighbour & b) {
+        return a.weight > b.weight or (a.weight == b.weight and a.poseIdx > b.poseIdx);
+    });
+    for (int k = 0; k < numBest; k++)
+    {
+        poseVec.push_back(candidateVec[k].poseIdx);
+    }
+}
+
+void CovisibilityGraph::addWeight(int pose1, int pose2, int delta)
+{
+    if (max(pose1, pose2) >= numPoses())
+    {
+        neighbourVec.resize(max(pose1, pose2) + 1);
+        poseLandmarkVec.resize(neighbourVec.size());
+    }
+    for (int k = 0; k < 2; k++)
+    {
+        vector<Neighbour> & neighbours = neighbourVec[pose1];
+        auto edge = find_if(neighbours.begin(), neighbours.end(),
+                [pose2](const Neighbour & neighbour) { return neighbour.poseIdx == pose2; });
+        if (edge == neighbours.end())
+        {
+            neighbours.push_back({pose2, delta});
+        }
+        else if ((edge->weight += delta) == 0)
+        {
+            *edge = neighbours.back();
+            neighbours.pop_back();
+        }
+        swap(pose1, pose2);
+    }
+}
+
+void CovisibilityGraph::addObservation(LandmarkId id, int poseIdx)
+{
+    if (id >= int(landmarkPoseVec.size()))
+    {
+        landmarkPoseVec.resize(id + 1);
+        landmarkSlotVec.resize(id + 1);
+    }
+    vector<int> & poses = landmarkPoseVec[id];
+    auto place = lower_bound(poses.begin(), poses.end(), poseIdx);
+    if (place != poses.end() and *place == poseIdx) return;
+    for (auto otherPose : poses)
+    {
+        addWeight(poseIdx, otherPose, 1);
+    }
+    if (poseIdx >= numPoses())
+    {
+        neighbourVec.resize(poseIdx + 1);
+        poseLandmarkVec.resize(poseIdx + 1);
+    }
+    vector<int> & slots = landmarkSlotVec[id];
+    slots.insert(slots.begin() + (place - poses.begin()), poseLandmarkVec[poseIdx].size());
+    poses.insert(place, poseIdx);
+    poseLandmarkVec[poseIdx].push_back(id);
+}
+
+void CovisibilityGraph::removeObservation(LandmarkId id, int poseIdx)
+{
+    if (id >= int(landmarkPoseVec.size())) return;
+    vector<int> & poses = landmarkPoseVec[id];
+    auto place = lower_bound(poses.begin(), poses.end(), poseIdx);
+    if (place == poses.end() or *place != poseIdx) return;
+    vector<int> & slots = landmarkSlotVec[id];
+    const int k = place - poses.begin();
+    
+    //the last landmark of the pose takes the place of this one
+    vector<LandmarkId> & poseLandmarks = poseLandmarkVec[poseIdx];
+    const int slot = slots[k];
+    const LandmarkId moved = poseLandmarks.back();
+    poseLandmarks[slot] = moved;
+    poseLandmarks.pop_back();
+    if (moved != id)
+    {
+        const vector<int> & movedPoses = landmarkPoseVec[moved];
+        const int movedK = lower_bound(movedPoses.begin(), movedPoses.end(), poseIdx) -
+                movedPoses.begin();
+        landmarkSlotVec[moved][movedK] = slot;
+    }
+    
+    poses.erase(place);
+    slots.erase(slots.begin() + k);
+    for (auto otherPose : poses)
+    {
+        addWeight(poseIdx, otherPose, -1);
+    }
+}
+
+void CovisibilityGraph::removeLandmark(LandmarkId id)
+{
+    if (id >= int(landmarkPoseVec.size())) return;
+    vector<int> & poses = landmarkPoseVec[id];
+    while (not poses.empty())
+    {
+        removeObservation(id, poses.back());
+    }
+}
+
+void CovisibilityGraph::updateLandmark(const LandmarkStore & LM, LandmarkId id)
+{
+    vector<int> & poses = landmarkPoseVec[id];
+    if (not LM.alive(id))
+    {
+        removeLandmark(id);
+        return;
+    }
+
+    //the poses which see it now
+    poseBuffer.clear();
+    for (auto obs = LM.observationBegin(id); obs != LM.observationEnd(id); ++obs)
+    {
+        poseBuffer.push_back(obs->poseIdx);
+    }
+    sort(poseBuffer.begin(), poseBuffer.end());
+    poseBuffer.erase(unique(poseBuffer.begin(), poseBuffer.end()), poseBuffer.end());
+
+    //the culled ones first
+    for (int k = poses.size() - 1; k >= 0; k--)
+    {
+        if (not binary_search(poseBuffer.begin(), poseBuffer.end(), poses[k]))
+        {
+            removeObservation(id, poses[k]);
+        }
+    }
+    for (auto poseIdx : poseBuffer)
+    {
+        addObservation(id, poseIdx);
+    }
+}
+
+void CovisibilityGraph::update(const LandmarkStore & LM)
+{
+    if (LM.size() < int(landmarkPoseVec.size())) clear();
+    landmarkPoseVec.resize(LM.size());
+    landmarkSlotVec.resize(LM.size());
+    if (changePosition < LM.firstChange())
+    {
+        //the journal has been trimmed since the last update
+        for (LandmarkId id = 0; id < LM.size(); id++)
+        {
+            updateLandmark(LM, id);
+        }
+    }
+    else
+    {
+        for (uint64_t position = changePosition; position < LM.endChange(); position++)
+        {
+            updateLandmark(LM, LM.changedLandmark(position));
+        }
+    }
+    changePosition = LM.endChange();
+}
+
+void CovisibilityGraph::clear()
+{
+    neighbourVec.clear();
+    landmarkPoseVec.clear();
+    landmarkSlotVec.clear();
+    poseLandmarkVec.clear();
+    changePosition = 0;
+}
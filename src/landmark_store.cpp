@@ -0,0 +1,147 @@
+//STL
+#include <vector>
+#include <algorithm>
+
+//Eigen
+#include <Eigen/Eigen>
+
+#include "landmark_store.h"
+
+LandmarkId LandmarkStore::add(const Vector3d & X, const Descriptor & d)
+{
+    positionVec.push_back(X);
+    descriptorVec.push_back(d);
+    aliveVec.push_back(true);
+    lastSeenVec.push_back(-1);
+    stampVec.push_back(0);
+    mergedVec.push_back(-1);
+    offsetVec.push_back(offsetVec.back());
+    aliveCount++;
+    return positionVec.size() - 1;
+}
+
+void LandmarkStore::remove(LandmarkId id)
+{
+    if (not aliveVec[id]) return;
+    aliveVec[id] = false;
+    aliveCount--;
+    numRemoved++;
+    lastSeenVec[id] = -1;
+    stampVec[id]++;
+    logChange(id);
+}
+
+void LandmarkStore::merge(LandmarkId src, LandmarkId dst)
+{
+    if (src == dst or not aliveVec[src] or not aliveVec[dst]) return;
+    const int numPending = pendingVec.size();
+    for (auto obs = observationBegin(src); obs != observationEnd(src); ++obs)
+    {
+        addObservation(dst, *obs);
+    }
+    //the staged ones come after, the ones staged for src are dropped with it
+    for (int k = 0; k < numPending; k++)
+    {
+        if (pendingVec[k].first != src) continue;
+        const Observation observation = pendingVec[k].second;
+        addObservation(dst, observation);
+    }
+    remove(src);
+    mergedVec[src] = dst;
+}
+
+void LandmarkStore::reserve(int numLandmarks, int numObservations)
+{
+    positionVec.reserve(numLandmarks);
+    descriptorVec.reserve(numLandmarks);
+    aliveVec.reserve(numLandmarks);
+    lastSeenVec.reserve(numLandmarks);
+    stampVec.reserve(numLandmarks);
+    mergedVec.reserve(numLandmarks);
+    offsetVec.reserve(numLandmarks + 1);
+    countVec.reserve(numLandmarks + 1);
+    observationVec.reserve(numObservations);
+    mergeVec.reserve(numObservations);
+}
+
+void LandmarkStore::clear()
+{
+    positionVec.clear();
+    descriptorVec.clear();
+    aliveVec.clear();
+    lastSeenVec.clear();
+    stampVec.clear();
+    mergedVec.clear();
+    aliveCount = 0;
+    numRemoved = 0;
+    offsetVec.assign(1, 0);
+    observationVec.clear();
+    pendingVec.clear();
+    trimChanges(endChange());
+}
+
+void LandmarkStore::addObservation(LandmarkId id, const Observation & observation)
+{
+    if (not aliveVec[id]) return;
+    pendingVec.emplace_back(id, observation);
+    lastSeenVec[id] = max(lastSeenVec[id], int(observation.poseIdx));
+}
+
+void LandmarkStore::commitObservations()
+{
+    if (not hasPendingObservations()) return;
+
+    //counting sort of the staged observations, stable so that the order is kept
+    const int numLandmarks = size();
+    countVec.assign(numLandmarks + 1, 0);
+    for (auto & pending : pendingVec)
+    {
+        if (aliveVec[pending.first]) countVec[pending.first + 1]++;
+    }
+
+    //the old observations are moved to their new place,
+    //countVec[id + 1] becomes the position of the first staged one of id
+    mergeVec.resize(observationVec.size() + pendingVec.size());
+    int dst = 0;
+    for (LandmarkId id = 0; id < numLandmarks; id++)
+    {
+        const int begin = offsetVec[id];
+        const int end = offsetVec[id + 1];
+        offsetVec[id] = dst;
+        if (not aliveVec[id]) continue;
+        dst = copy(observationVec.begin() + begin, observationVec.begin() + end,
+                mergeVec.begin() + dst) - mergeVec.begin();
+        const int numPending = countVec[id + 1];
+        countVec[id + 1] = dst;
+        dst += numPending;
+    }
+    offsetVec[numLandmarks] = dst;
+    LandmarkId lastLogged = -1;
+    for (auto & pending : pendingVec)
+    {
+        if (not aliveVec[pending.first]) continue;
+        mergeVec[countVec[pending.first + 1]++] = pending.second;
+        //the observations of a landmark usually come together
+        if (pending.first != lastLogged) logChange(pending.first);
+        lastLogged = pending.first;
+    }
+    mergeVec.resize(dst);
+    observationVec.swap(mergeVec);
+    pendingVec.clear();
+    numRemoved = 0;
+}
+
+void LandmarkStore::logChange(LandmarkId id)
+{
+    //past this length, checking every landmark is cheaper than reading the journal
+    if (changeLog.size() > 4 * positionVec.size() + 1024) trimChanges(endChange());
+    changeLog.push_back(id);
+}
+
+void LandmarkStore::trimChanges(uint64_t position)
+{
+    if (position <= changeBase) return;
+    const int numTrimmed = min(position, endChange()) - changeBase;
+    changeLog.erase(changeLog.begin(), changeLog.begin() + numTrimmed);
+    changeBase += numTrimmed;
+}
@@ -0,0 +1,349 @@
+//STL
+#include <vector>
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <cstddef>
+#include <cstdint>
+
+//POSIX
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "map_file.h"
+
+namespace
+{
+
+const char MAP_FILE_MAGIC[8] = {'S', 'P', 'C', 'M', 'A', 'P', 0, 0};
+
+bool littleEndian()
+{
+    const uint16_t one = 1;
+    return *reinterpret_cast<const uint8_t *>(&one) == 1;
+}
+
+uint64_t paddedSize(uint64_t size)
+{
+    return (size + MAP_FILE_ALIGNMENT - 1) / MAP_FILE_ALIGNMENT * MAP_FILE_ALIGNMENT;
+}
+
+//writes the sections one after the other through a fixed buffer,
+//the checksum of a section is computed as it is flushed
+class SectionWriter
+{
+public:
+    SectionWriter(ofstream & file, uint64_t position)
+        : position(position), file(file), buffer(bufferSize) {}
+
+    void begin(MapFileSection & newSection)
+    {
+        section = &newSection;
+        section->offset = position;
+        section->size = 0;
+        hash = mapFileChecksum(NULL, 0);
+    }
+
+    void write(const void * data, size_t size)
+    {
+        const uint8_t * src = reinterpret_cast<const uint8_t *>(data);
+        section->size += size;
+        while (size > 0)
+        {
+            const size_t chunk = min(size, bufferSize - numBuffered);
+            memcpy(buffer.data() + numBuffered, src, chunk);
+            numBuffered += chunk;
+            src += chunk;
+            size -= chunk;
+            if (numBuffered == bufferSize) flush();
+        }
+    }
+
+    //pads the section to the alignment, the next one starts there
+    void end()
+    {
+        const size_t numPadding = paddedSize(section->size) - section->size;
+        fill(buffer.begin() + numBuffered, buffer.begin() + numBuffered + numPadding, 0);
+        numBuffered += numPadding;
+        flush();
+        section->checksum = hash;
+    }
+
+    //position of the next section
+    uint64_t position;
+
+private:
+    //a multiple of the alignment
+    static const size_t bufferSize = 1 << 20;
+
+    void flush()
+    {
+        hash = mapFileChecksum(buffer.data(), numBuffered, hash);
+        file.write(reinterpret_cast<const char *>(buffer.data()), numBuffered);
+        position += numBuffered;
+        numBuffered = 0;
+    }
+
+    ofstream & file;
+    vector<uint8_t> buffer;
+    size_t numBuffered = 0;
+    uint64_t hash;
+    MapFileSection * section = NULL;
+};
+
+void writePose(SectionWriter & writer, const Transformation<double> & pose)
+{
+    writer.write(pose.trans().data(), 3 * sizeof(double));
+    writer.write(pose.rot().data(), 3 * sizeof(double));
+}
+
+void fillCamera(MapFileCamera & record, const ICamera & camera,
+        const Transformation<double> & TbaseCam)
+{
+    memset(&record, 0, sizeof(record));
+    copy(TbaseCam.trans().data(), TbaseCam.trans().data() + 3, record.TbaseCam);
+    copy(TbaseCam.rot().data(), TbaseCam.rot().data() + 3, record.TbaseCam + 3);
+    record.width = camera.width;
+    record.height = camera.height;
+    record.numParams = min(int(camera.params.size()), MAP_FILE_MAX_PARAMS);
+    copy(camera.params.begin(), camera.params.begin() + record.numParams, record.params);
+}
+
+}
+
+uint64_t mapFileChecksum(const void * data, size_t size, uint64_t seed)
+{
+    const uint64_t prime = 0x100000001b3ULL;
+    const uint8_t * bytes = reinterpret_cast<const uint8_t *>(data);
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * prime;
+    }
+    return hash;
+}
+
+bool writeMap(const string & fileName, const LandmarkStore & LM,
+        const vector<Transformation<double>> & trajectory, const StereoSystem & stereo)
+{
+    if (not littleEndian()) return false;
+    //the offsets are stored on 32 bits
+    if (LM.observations().size() > size_t(INT32_MAX)) return false;
+    const string tmpName = fileName + ".tmp";
+    ofstream file(tmpName, ios::binary | ios::trunc);
+    if (not file)
+    {
+        remove(tmpName.c_str());
+        return false;
+    }
+
+    MapFileHeader header;
+    memset(&header, 0, sizeof(header));
+    copy(MAP_FILE_MAGIC, MAP_FILE_MAGIC + 8, header.magic);
+    header.version = MAP_FILE_VERSION;
+    header.headerSize = sizeof(MapFileHeader);
+    header.numLandmarks = LM.size();
+    header.numObservations = LM.observations().size();
+    header.numPoses = trajectory.size();
+
+    //the header is written last, once the sections are known
+    const vector<char> headerSpace(paddedSize(sizeof(MapFileHeader)), 0);
+    file.write(headerSpace.data(), headerSpace.size());
+
+    SectionWriter writer(file, headerSpace.size());
+
+    writer.begin(header.sections[MAP_POSITIONS]);
+    writer.write(LM.positions().data(), LM.size() * 3 * sizeof(double));
+    writer.end();
+
+    writer.begin(header.sections[MAP_DESCRIPTORS]);
+    writer.write(LM.descriptors().data(), LM.size() * sizeof(LandmarkStore::Descriptor));
+    writer.end();
+
+    writer.begin(header.sections[MAP_ALIVE]);
+    for (LandmarkId id = 0; id < LM.size(); id++)
+    {
+        const uint8_t alive = LM.alive(id);
+        writer.write(&alive, 1);
+    }
+    writer.end();
+
+    writer.begin(header.sections[MAP_OFFSETS]);
+    for (auto offset : LM.offsets())
+    {
+        const int32_t offset32 = offset;
+        writer.write(&offset32, sizeof(offset32));
+    }
+    writer.end();
+
+    writer.begin(header.sections[MAP_OBSERVATIONS]);
+    for (auto & observation : LM.observations())
+    {
+        const MapFileObservation record{observation.pt[0], observation.pt[1],
+                observation.poseIdx, uint32_t(observation.cameraId)};
+        writer.write(&record, sizeof(record));
+    }
+    writer.end();
+
+    writer.begin(header.sections[MAP_TRAJECTORY]);
+    for (auto & pose : trajectory)
+    {
+        writePose(writer, pose);
+    }
+    writer.end();
+
+    MapFileCamera cameras[2];
+    fillCamera(cameras[LEFT], *stereo.cam1, stereo.TbaseCam1);
+    fillCamera(cameras[RIGHT], *stereo.cam2, stereo.TbaseCam2);
+    writer.begin(header.sections[MAP_CALIBRATION]);
+    writer.write(cameras, sizeof(cameras));
+    writer.end();
+
+    header.fileSize = writer.position;
+    header.headerChecksum = mapFileChecksum(&header, offsetof(MapFileHeader, headerChecksum));
+    file.seekp(0);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.close();
+    //no partial file is left behind
+    if (not file or rename(tmpName.c_str(), fileName.c_str()) != 0)
+    {
+        remove(tmpName.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool MapView::open(const string & fileName)
+{
+    close();
+    if (not littleEndian()) return false;
+    const int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    struct stat status;
+    if (fstat(fd, &status) != 0 or size_t(status.st_size) < sizeof(MapFileHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+    void * mapping = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    //the mapping keeps the file open
+    ::close(fd);
+    if (mapping == MAP_FAILED) return false;
+    base = reinterpret_cast<const uint8_t *>(mapping);
+    mappedSize = status.st_size;
+
+    //only the header and the ends of the offsets are read
+    const MapFileHeader & h = header();
+    bool valid = equal(MAP_FILE_MAGIC, MAP_FILE_MAGIC + 8, h.magic) and
+            h.version == MAP_FILE_VERSION and h.headerSize == sizeof(MapFileHeader) and
+            h.headerChecksum == mapFileChecksum(&h, offsetof(MapFileHeader, headerChecksum)) and
+            h.fileSize == mappedSize and h.numLandmarks < INT32_MAX and
+            h.numObservations < INT32_MAX and h.numPoses < INT32_MAX;
+    const uint64_t expectedSize[MAP_NUM_SECTIONS] = {
+        h.numLandmarks * 3 * sizeof(double),
+        h.numLandmarks * sizeof(LandmarkStore::Descriptor),
+        h.numLandmarks,
+        (h.numLandmarks + 1) * sizeof(int32_t),
+        h.numObservations * sizeof(MapFileObservation),
+        h.numPoses * 6 * sizeof(double),
+        2 * sizeof(MapFileCamera)
+    };
+    for (int s = 0; valid and s < MAP_NUM_SECTIONS; s++)
+    {
+        const MapFileSection & section = h.sections[s];
+        valid = section.size == expectedSize[s] and section.offset % MAP_FILE_ALIGNMENT == 0 and
+                section.offset >= sizeof(MapFileHeader) and
+                section.offset + paddedSize(section.size) <= mappedSize;
+    }
+    if (not valid)
+    {
+        close();
+        return false;
+    }
+
+    positionData = reinterpret_cast<const double *>(base + h.sections[MAP_POSITIONS].offset);
+    descriptorData = reinterpret_cast<const float *>(base + h.sections[MAP_DESCRIPTORS].offset);
+    aliveData = base + h.sections[MAP_ALIVE].offset;
+    offsetData = reinterpret_cast<const int32_t *>(base + h.sections[MAP_OFFSETS].offset);
+    observationData = reinterpret_cast<const MapFileObservation *>(
+            base + h.sections[MAP_OBSERVATIONS].offset);
+    trajectoryData = reinterpret_cast<const double *>(base + h.sections[MAP_TRAJECTORY].offset);
+    cameraData = reinterpret_cast<const MapFileCamera *>(base + h.sections[MAP_CALIBRATION].offset);
+
+    if (offsetData[0] != 0 or offsetData[h.numLandmarks] != int32_t(h.numObservations) or
+            cameraData[LEFT].numParams > MAP_FILE_MAX_PARAMS or
+            cameraData[RIGHT].numParams > MAP_FILE_MAX_PARAMS)
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool MapView::verify() const
+{
+    if (not isOpen()) return false;
+    for (auto & section : header().sections)
+    {
+        if (mapFileChecksum(base + section.offset, paddedSize(section.size)) != section.checksum)
+        {
+            return false;
+        }
+    }
+    //the observations must be in the order of the landmarks
+    for (LandmarkId id = 0; id < numLandmarks(); id++)
+    {
+        if (offsetData[id + 1] < offsetData[id]) return false;
+    }
+    return true;
+}
+
+void MapView::close()
+{
+    if (base != NULL) munmap(const_cast<uint8_t *>(base), mappedSize);
+    base = NULL;
+    mappedSize = 0;
+    positionData = NULL;
+    descriptorData = NULL;
+    aliveData = NULL;
+    offsetData = NULL;
+    observationData = NULL;
+    trajectoryData = NULL;
+    cameraData = NULL;
+}
+
+void MapView::copyTo(LandmarkStore & LM, vector<Transformation<double>> & trajectory) const
+{
+    LM.clear();
+    LM.reserve(numLandmarks(), numObservations());
+    for (LandmarkId id = 0; id < numLandmarks(); id++)
+    {
+        LM.add(position(id), descriptor(id));
+    }
+    //the removed landmarks keep their ids and get no observation
+    for (LandmarkId id = 0; id < numLandmarks(); id++)
+    {
+        if (not alive(id)) LM.remove(id);
+    }
+    for (LandmarkId id = 0; id < numLandmarks(); id++)
+    {
+        for (auto record = observationBegin(id); record != observationEnd(id); ++record)
+        {
+            LM.addObservation(id, Observation(record->u, record->v, record->poseIdx,
+                    CameraID(record->cameraId)));
+        }
+    }
+    LM.commitObservations();
+
+    trajectory.resize(numPoses());
+    for (int j = 0; j < numPoses(); j++)
+    {
+        trajectory[j] = pose(j);
+    }
+}
@@ -1,5 +1,6 @@
 
 #include <iostream>
+#include <limits>
 #include <Eigen/Eigen>
 
 #include "matcher.h"
@@ -13,35 +14,84 @@ using Eigen::Matrix3d;
 using Eigen::Vector3d;
 using Eigen::Vector2d;
 
+namespace
+{
+
+// what the rays of a camera depend on
+vector<double> rayMapKey(const ICamera & camera)
+{
+    vector<double> key(camera.params);
+    key.push_back(camera.width);
+    key.push_back(camera.height);
+    return key;
+}
+
+}
+
 void Matcher::bruteForce(const vector<Feature> & fVec1,
                          const vector<Feature> & fVec2,
                          vector<int> & matches)
 {
+    vector<MatchQuality> qualities;
+    bruteForce(fVec1, fVec2, matches, qualities);
+}
+
+void Matcher::bruteForce(const vector<Feature> & fVec1,
+                         const vector<Feature> & fVec2,
+                         vector<int> & matches,
+                         vector<MatchQuality> & qualities)
+{
+    guidedMatch(fVec1, fVec2, numeric_limits<double>::infinity(), matches, qualities);
+}
+
+bool Matcher::guidedMatch(const vector<Feature> & fVec1,
+                          const vector<Feature> & fVec2,
+                          double radius,
+                          vector<int> & matches,
+                          vector<MatchQuality> & qualities,
+                          chrono::steady_clock::time_point deadline)
+{
 
     const int N1 = fVec1.size();
     const int N2 = fVec2.size();
+    const double radiusSq = radius * radius;
 
-    matches.resize(N1);
+    matches.assign(N1, -1);
+    qualities.resize(N1);
 
     for (int i = 0; i < N1; i++)
     {
-        matches[i] = -1;
+        // the clock is read once per row, a row is much longer than that
+        if (chrono::steady_clock::now() > deadline) return false;
         int tempMatch = -1;
         double bestDist = 1000000;
+        double secondDist = 1000000;
+        int numCandidates = 0;
 
         for (int j = 0; j < N2 ; j++)
         {
+            if ((fVec1[i].pt - fVec2[j].pt).squaredNorm() > radiusSq) continue;
+            numCandidates++;
+
             double dist = (fVec1[i].desc - fVec2[j].desc).norm();
 
             if (dist < bestDist)
             {
+                secondDist = bestDist;
                 bestDist = dist;
                 tempMatch = j;
             }
+            else if (dist < secondDist)
+            {
+                secondDist = dist;
+            }
         }
         if (bestDist < bfDistTh)
         {
             matches[i] = tempMatch;
+            qualities[i].distance = bestDist;
+            // a single candidate tells nothing about the distinctiveness
+            qualities[i].ratio = numCandidates > 1 and secondDist > 0 ? bestDist / secondDist : 1;
         }
     }
 
@@ -49,6 +99,7 @@ void Matcher::bruteForce(const vector<Feature> & fVec1,
     {
         cout << " i=" << i << " bestDists[i]=" << bestDists[i] << endl;
     }*/
+    return true;
 
 }
 
@@ -75,26 +126,45 @@ void Matcher::bruteForceOneToOne(const vector<Feature> & fVec1,
 
 void Matcher::initStereoBins(const StereoSystem & stereo)
 {
+    // the rays depend only on the intrinsics, they are computed once per camera
+    vector<double> key = rayMapKey(*stereo.cam1);
+    if (key != rayKeyL)
+    {
+        initRayMap(*stereo.cam1, rayMapL);
+        rayKeyL = key;
+    }
+    key = rayMapKey(*stereo.cam2);
+    if (key != rayKeyR)
+    {
+        initRayMap(*stereo.cam2, rayMapR);
+        rayKeyR = key;
+    }
+    computeStereoBins(stereo, binMapL, binMapR);
+}
 
-    const bool debug = false;
-
-    const double pi = std::atan(1)*4;
-
-/*
-    // theta: rotation angle for R -> L (R reference frame)
-    double theta = 2*std::acos(qR(3));
-
-    // uR: rotation versor for R -> L (R reference frame)
-    Eigen::Vector3d uR(qR(0)/std::sin(theta/2), qR(1)/std::sin(theta/2), qR(2)/std::sin(theta/2));
+void Matcher::initRayMap(const ICamera & camera, Eigen::Matrix3Xf & rayMap)
+{
+    rayMap.resize(3, camera.height * camera.width);
+    Eigen::Vector2d p;
+    Eigen::Vector3d v;
+    for (int i = 0; i < camera.height; i++)
+    {
+        for (int j = 0; j < camera.width; j++)
+        {
+            p << j, i;
+            camera.reconstructPoint(p, v);
+            rayMap.col(i * camera.width + j) = v.cast<float>();
+        }
+    }
+}
 
-    // u: rotation vector for R -> L (R reference frame)
-    Eigen::Vector3d u = uR*theta;
+void Matcher::computeStereoBins(const StereoSystem & stereo,
+        Eigen::MatrixXi & mapL, Eigen::MatrixXi & mapR) const
+{
 
-     // 2R1
+    const bool debug = false;
 
-    // R: rotation matrix R -> L
-    R = stereo.pose1.rotationMatrix()
-    //fromVtoR(u, R);*/
+    const double pi = std::atan(1)*4;
 
     Matrix3d R, RSigma, RPhi, RTot;
 
@@ -116,21 +186,18 @@ void Matcher::initStereoBins(const StereoSystem & stereo)
 
     RTot = RSigma*RPhi;
 
-    Eigen::Vector2d p;
-    Eigen::Vector3d v;
+    const Eigen::Matrix3f RTotL = RTot.cast<float>();
+    const Eigen::Matrix3f RTotR = (RTot * R).cast<float>();
 
-    binMapL.resize(stereo.cam1->height, stereo.cam1->width);
-    binMapR.resize(stereo.cam2->height, stereo.cam2->width);
+    mapL.resize(stereo.cam1->height, stereo.cam1->width);
+    mapR.resize(stereo.cam2->height, stereo.cam2->width);
 
     // compute bin map for left camera
     for (int i=0; i<stereo.cam1->height; i++)
     {
         for (int j=0; j<stereo.cam1->width; j++)
         {
-            p << j, i;
-            stereo.cam1->reconstructPoint(p, v);
-            Eigen::Vector3d v2;
-            v2 = RTot * v;
+            Eigen::Vector3f v2 = RTotL * rayMapL.col(i * stereo.cam1->width + j);
 
             double alfa = std::atan2(v2(1), v2(2))*180/pi;
 
@@ -138,7 +205,7 @@ void Matcher::initStereoBins(const StereoSystem & stereo)
             if (debug) { bin = alfa/binDelta; }
             else { bin = std::floor(alfa/binDelta); }
 
-            binMapL(i,j) = bin;
+            mapL(i,j) = bin;
         }
     }
 
@@ -147,10 +214,7 @@ void Matcher::initStereoBins(const StereoSystem & stereo)
     {
         for (int j=0; j<stereo.cam2->width; j++)
         {
-            p << j, i;
-            stereo.cam2->reconstructPoint(p, v);
-            Eigen::Vector3d v2;
-            v2 = RTot * R * v;
+            Eigen::Vector3f v2 = RTotR * rayMapR.col(i * stereo.cam2->width + j);
 
             double alfa = std::atan2(v2(1), v2(2))*180/pi;
 
@@ -158,7 +222,7 @@ void Matcher::initStereoBins(const StereoSystem & stereo)
             if (debug) { bin = alfa/binDelta; }
             else { bin = std::floor(alfa/binDelta); }
 
-            binMapR(i,j) = bin;
+            mapR(i,j) = bin;
         }
     }
 
@@ -170,8 +234,6 @@ void Matcher::initStereoBins(const StereoSystem & stereo)
         cout << endl << "RPhi:" << endl << RPhi << endl;
         cout << endl << "RSigma:" << endl << RSigma << endl;
         cout << endl << "RTot:" << endl << RTot << endl;
-        //cout << "binMapL(center)= " << binMapL(stereo.cam1->u0, stereo.cam1->v0) << endl;
-        //cout << "binMapR(center)= " << binMapR(stereo.cam2->u0, stereo.cam2->v0) << endl;
     }
 }
 
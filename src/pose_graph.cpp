@@ -0,0 +1,335 @@
+//STL
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <array>
+
+//Eigen
+#include <Eigen/Eigen>
+#include <Eigen/Sparse>
+
+#include "geometry.h"
+#include "pose_graph.h"
+
+using Eigen::Matrix3d;
+using Eigen::Vector3d;
+
+typedef Eigen::SparseMatrix<double> SparseMatrixd;
+typedef Eigen::Triplet<double> Tripletd;
+
+namespace
+{
+
+//inverse of the right Jacobian of SO(3)
+Matrix3d rightJacobianInverse(const Vector3d & phi)
+{
+    const double th = phi.norm();
+    const Matrix3d Phi = hat(phi);
+    if (th < 1e-5) return Matrix3d::Identity() + 0.5 * Phi;
+    const double k = 1. / (th * th) - (1. + cos(th)) / (2. * th * sin(th));
+    return Matrix3d::Identity() + 0.5 * Phi + k * Phi * Phi;
+}
+
+}
+
+void PoseGraph::addConstraint(int poseIdx1, int poseIdx2, const Transformation<double> & T12,
+        const Matrix6d & information)
+{
+    constraintVec.push_back({poseIdx1, poseIdx2, T12, information});
+}
+
+void PoseGraph::setPoseFixed(int poseIdx)
+{
+    fixedPoseVec.push_back(poseIdx);
+}
+
+void PoseGraph::clear()
+{
+    constraintVec.clear();
+    fixedPoseVec.clear();
+}
+
+void PoseGraph::computeError(const RelativePoseConstraint & constraint,
+        const Transformation<double> & pose1, const Transformation<double> & pose2,
+        Vector6d & error, Matrix6d * J1, Matrix6d * J2)
+{
+    //the pose of 2 in the frame of 1, compared with the measurement
+    const Transformation<double> T12 = pose1.inverseCompose(pose2);
+    const Transformation<double> E = constraint.T12.inverseCompose(T12);
+    error << E.trans(), E.rot();
+    if (J1 == NULL and J2 == NULL) return;
+
+    const Matrix3d RmT = constraint.T12.rotMat().transpose();
+    const Matrix3d R12 = T12.rotMat();
+    const Matrix3d JrInv = rightJacobianInverse(E.rot());
+    if (J1 != NULL)
+    {
+        J1->setZero();
+        J1->topLeftCorner<3, 3>() = -RmT;
+        J1->topRightCorner<3, 3>() = RmT * hat(T12.trans());
+        J1->bottomRightCorner<3, 3>() = -JrInv * R12.transpose();
+    }
+    if (J2 != NULL)
+    {
+        J2->setZero();
+        J2->topLeftCorner<3, 3>() = RmT * R12;
+        J2->bottomRightCorner<3, 3>() = JrInv;
+    }
+}
+
+double PoseGraph::cost(const vector<Transformation<double>> & trajectory) const
+{
+    return cost(trajectory, 1);
+}
+
+double PoseGraph::cost(const vector<Transformation<double>> & trajectory,
+        double translationWeight) const
+{
+    double sum = 0;
+    Vector6d error;
+    for (auto & constraint : constraintVec)
+    {
+        computeError(constraint, trajectory[constraint.poseIdx1],
+                trajectory[constraint.poseIdx2], error);
+        error.head<3>() *= sqrt(translationWeight);
+        sum += error.dot(constraint.information * error);
+    }
+    return sum;
+}
+
+double PoseGraph::optimize(vector<Transformation<double>> & trajectory)
+{
+    if (constraintVec.empty()) return 0;
+
+    //the variables are the poses of the constraints that are not fixed
+    vector<int> varIdx(trajectory.size(), -1);
+    for (auto & constraint : constraintVec)
+    {
+        varIdx[constraint.poseIdx1] = 0;
+        varIdx[constraint.poseIdx2] = 0;
+    }
+    if (fixedPoseVec.empty())
+    {
+        varIdx[constraintVec.front().poseIdx1] = -1;
+    }
+    for (auto poseIdx : fixedPoseVec)
+    {
+        varIdx[poseIdx] = -1;
+    }
+    vector<int> poseOfVar;
+    for (unsigned int j = 0; j < trajectory.size(); j++)
+    {
+        if (varIdx[j] == -1) continue;
+        varIdx[j] = poseOfVar.size();
+        poseOfVar.push_back(j);
+    }
+    const int N = 6 * poseOfVar.size();
+    if (N == 0) return cost(trajectory);
+
+    //the pattern of the lower triangle is built once, with the whole diagonal,
+    //then each 6x6 block column is accumulated at its place in the values
+    SparseMatrixd H(N, N);
+    {
+        vector<Tripletd> tripletVec;
+        tripletVec.reserve(21 * (3 * constraintVec.size() + poseOfVar.size()));
+        auto addBlock = [&](int row, int col)
+        {
+            for (int c = 0; c < 6; c++)
+            {
+                for (int r = 0; r < 6; r++)
+                {
+                    if (6 * row + r >= 6 * col + c) tripletVec.emplace_back(6 * row + r, 6 * col + c, 0.);
+                }
+            }
+        };
+        for (unsigned int v = 0; v < poseOfVar.size(); v++)
+        {
+            addBlock(v, v);
+        }
+        for (auto & constraint : constraintVec)
+        {
+            const int idx1 = varIdx[constraint.poseIdx1], idx2 = varIdx[constraint.poseIdx2];
+            if (idx1 == -1 or idx2 == -1 or idx1 == idx2) continue;
+            addBlock(max(idx1, idx2), min(idx1, idx2));
+        }
+        H.setFromTriplets(tripletVec.begin(), tripletVec.end());
+        H.makeCompressed();
+    }
+    double * values = H.valuePtr();
+    //position of the value (row, col) of the lower triangle
+    auto offset = [&](int row, int col)
+    {
+        const int * begin = H.innerIndexPtr() + H.outerIndexPtr()[col];
+        const int * end = H.innerIndexPtr() + H.outerIndexPtr()[col + 1];
+        return int(lower_bound(begin, end, row) - H.innerIndexPtr());
+    };
+    vector<int> diagonalOffset(N);
+    for (int i = 0; i < N; i++)
+    {
+        diagonalOffset[i] = offset(i, i);
+    }
+    //for each constraint and each block (k, l) with k >= l, the offsets of its 6 columns
+    vector<array<int, 18>> blockOffsetVec(constraintVec.size());
+    for (unsigned int n = 0; n < constraintVec.size(); n++)
+    {
+        const int idx[2] = {varIdx[constraintVec[n].poseIdx1], varIdx[constraintVec[n].poseIdx2]};
+        int block = 0;
+        for (int k = 0; k < 2; k++)
+        {
+            for (int l = 0; l <= k; l++, block++)
+            {
+                for (int c = 0; c < 6; c++)
+                {
+                    int & off = blockOffsetVec[n][6 * block + c];
+                    const int row = max(idx[k], idx[l]), col = min(idx[k], idx[l]);
+                    off = (idx[k] == -1 or idx[l] == -1) ? -1 : offset(6 * row, 6 * col + c);
+                }
+            }
+        }
+    }
+
+    Eigen::VectorXd b(N), diagonal(N), dx(N);
+    Eigen::SimplicialLDLT<SparseMatrixd> solver;
+    solver.analyzePattern(H);
+    //the poses before the step, which is undone if the cost increases
+    vector<Transformation<double>> previousVec(poseOfVar.size());
+
+    //Levenberg-Marquardt with Nielsen's damping update,
+    //the translation errors are scaled by translationWeight
+    auto solve = [&](double translationWeight, int numIterations)
+    {
+        const double scale = sqrt(translationWeight);
+        double lambda = initialLambda;
+        double nu = 2;
+        double currentCost = cost(trajectory, translationWeight);
+        for (int iteration = 0; iteration < numIterations; iteration++)
+        {
+            //normal equations H dx = -b, the blocks are J_k^T W J_l
+            fill(values, values + H.nonZeros(), 0.);
+            b.setZero();
+            Vector6d error;
+            Matrix6d J[2];
+            for (unsigned int n = 0; n < constraintVec.size(); n++)
+            {
+                const RelativePoseConstraint & constraint = constraintVec[n];
+                computeError(constraint, trajectory[constraint.poseIdx1],
+                        trajectory[constraint.poseIdx2], error, J, J + 1);
+                error.head<3>() *= scale;
+                J[0].topRows<3>() *= scale;
+                J[1].topRows<3>() *= scale;
+                const int idx[2] = {varIdx[constraint.poseIdx1], varIdx[constraint.poseIdx2]};
+                int block = 0;
+                for (int k = 0; k < 2; k++)
+                {
+                    const Matrix6d JtW = J[k].transpose() * constraint.information;
+                    if (idx[k] != -1) b.segment<6>(6 * idx[k]) += JtW * error;
+                    for (int l = 0; l <= k; l++, block++)
+                    {
+                        if (idx[k] == -1 or idx[l] == -1) continue;
+                        //the block of the lower triangle
+                        const Matrix6d product = (idx[k] >= idx[l]) ? Matrix6d(JtW * J[l]) :
+                                Matrix6d((JtW * J[l]).transpose());
+                        const bool diagonalBlock = idx[k] == idx[l];
+                        for (int c = 0; c < 6; c++)
+                        {
+                            double * column = values + blockOffsetVec[n][6 * block + c];
+                            for (int r = diagonalBlock ? c : 0; r < 6; r++)
+                            {
+                                column[diagonalBlock ? r - c : r] += product(r, c);
+                            }
+                        }
+                        //the symmetric block of a pose constrained with itself
+                        if (diagonalBlock and k != l)
+                        {
+                            for (int c = 0; c < 6; c++)
+                            {
+                                double * column = values + blockOffsetVec[n][6 * block + c];
+                                for (int r = c; r < 6; r++)
+                                {
+                                    column[r - c] += product(c, r);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+            for (int i = 0; i < N; i++)
+            {
+                diagonal[i] = max(values[diagonalOffset[i]], 1e-9);
+            }
+
+            //the step is retried with a larger damping until the cost decreases
+            bool accepted = false;
+            while (not accepted and lambda < 1e10)
+            {
+                for (int i = 0; i < N; i++)
+                {
+                    values[diagonalOffset[i]] = diagonal[i] * (1 + lambda);
+                }
+                solver.factorize(H);
+                if (solver.info() != Eigen::Success)
+                {
+                    lambda *= nu;
+                    nu *= 2;
+                    continue;
+                }
+                dx = solver.solve(-b);
+
+                for (unsigned int v = 0; v < poseOfVar.size(); v++)
+                {
+                    const Vector3d dt = dx.segment<3>(6 * v);
+                    const Vector3d dr = dx.segment<3>(6 * v + 3);
+                    Transformation<double> & pose = trajectory[poseOfVar[v]];
+                    previousVec[v] = pose;
+                    pose = pose.compose(Transformation<double>(dt, dr));
+                }
+                const double candidateCost = cost(trajectory, translationWeight);
+                //decrease predicted by the linear model
+                const double predicted = -dx.dot(b) + lambda * dx.dot(diagonal.cwiseProduct(dx));
+                if (candidateCost < currentCost)
+                {
+                    accepted = true;
+                    const double decrease = currentCost - candidateCost;
+                    currentCost = candidateCost;
+                    const double rho = decrease / max(predicted, 1e-300);
+                    lambda *= max(1. / 3, 1 - pow(2 * min(rho, 1.) - 1, 3));
+                    nu = 2;
+                    if (decrease <= functionTolerance * (currentCost + decrease)) return currentCost;
+                }
+                else
+                {
+                    for (unsigned int v = 0; v < poseOfVar.size(); v++)
+                    {
+                        trajectory[poseOfVar[v]] = previousVec[v];
+                    }
+                    lambda *= nu;
+                    nu *= 2;
+                }
+            }
+            if (not accepted) break;
+        }
+        return currentCost;
+    };
+
+    //the rotations first, so that the translations are then linearized
+    //around consistent orientations, the lever arms of a loop make it far from linear
+    if (numRotationIterations > 0) solve(rotationStageWeight, numRotationIterations);
+    return solve(1, maxNumIterations);
+}
+
+void reanchorLandmarks(LandmarkStore & LM,
+        const vector<Transformation<double>> & oldTrajectory,
+        const vector<Transformation<double>> & newTrajectory)
+{
+    for (LandmarkId id = 0; id < LM.size(); id++)
+    {
+        if (not LM.alive(id) or LM.numObservations(id) == 0) continue;
+        const int anchor = LM.observationBegin(id)->poseIdx;
+        if (anchor >= int(oldTrajectory.size()) or anchor >= int(newTrajectory.size())) continue;
+        const Transformation<double> & oldPose = oldTrajectory[anchor];
+        const Transformation<double> & newPose = newTrajectory[anchor];
+        Vector3d & X = LM.position(id);
+        const Vector3d Xanchor = oldPose.rotMat().transpose() * (X - oldPose.trans());
+        X = newPose.rotMat() * Xanchor + newPose.trans();
+    }
+}
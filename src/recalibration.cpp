@@ -0,0 +1,173 @@
+//STL
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//Eigen
+#include <Eigen/Eigen>
+
+//Ceres
+#include <ceres/ceres.h>
+
+#include "geometry.h"
+#include "matcher.h"
+#include "vision.h"
+#include "recalibration.h"
+
+using namespace ceres;
+
+OnlineStereoCalibrator::OnlineStereoCalibrator(const StereoSystem & stereo, unsigned int seed)
+        : stereo(stereo.TbaseCam1, stereo.TbaseCam2, *stereo.cam1, *stereo.cam2),
+          generator(seed) {}
+
+OnlineStereoCalibrator::~OnlineStereoCalibrator()
+{
+    stop();
+}
+
+void OnlineStereoCalibrator::start()
+{
+    if (worker.joinable()) return;
+    reservoir1.reserve(reservoirSize);
+    reservoir2.reserve(reservoirSize);
+    stopRequested = false;
+    worker = thread(&OnlineStereoCalibrator::run, this);
+}
+
+void OnlineStereoCalibrator::stop()
+{
+    if (not worker.joinable()) return;
+    {
+        lock_guard<mutex> lock(stopMutex);
+        stopRequested = true;
+    }
+    stopCondition.notify_one();
+    worker.join();
+}
+
+void OnlineStereoCalibrator::addStereoMatches(const vector<Feature> & fVec1,
+        const vector<Feature> & fVec2,
+        const vector<int> & matches)
+{
+    unique_lock<mutex> lock(reservoirMutex, try_to_lock);
+    if (not lock.owns_lock()) return;
+
+    // bounding the counter keeps replacing old samples so that the drift is tracked
+    const long long maxSeen = 10 * (long long)reservoirSize;
+    for (unsigned int i = 0; i < matches.size(); i++)
+    {
+        if (matches[i] == -1) continue;
+        numSeen = min(numSeen + 1, maxSeen);
+        if (reservoir1.size() < reservoirSize)
+        {
+            reservoir1.push_back(fVec1[i].pt);
+            reservoir2.push_back(fVec2[matches[i]].pt);
+        }
+        else
+        {
+            uniform_int_distribution<long long> distrib(0, numSeen - 1);
+            long long j = distrib(generator);
+            if (j < reservoirSize)
+            {
+                reservoir1[j] = fVec1[i].pt;
+                reservoir2[j] = fVec2[matches[i]].pt;
+            }
+        }
+    }
+}
+
+bool OnlineStereoCalibrator::update(StereoSystem & stereo, Matcher & matcher)
+{
+    unique_lock<mutex> lock(resultMutex, try_to_lock);
+    if (not lock.owns_lock() or not resultReady) return false;
+    stereo.TbaseCam2 = resultTbaseCam2;
+    matcher.binMapL.swap(resultBinMapL);
+    matcher.binMapR.swap(resultBinMapR);
+    resultReady = false;
+    return true;
+}
+
+void OnlineStereoCalibrator::run()
+{
+#ifdef __linux__
+    // runs only when the cores are idle
+    sched_param param;
+    param.sched_priority = 0;
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+    // computes the rays once, afterwards only the bins are recomputed
+    binner.initStereoBins(stereo);
+
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(stopMutex);
+            stopCondition.wait_for(lock, chrono::duration<double>(period),
+                    [this]{ return stopRequested; });
+            if (stopRequested) return;
+        }
+
+        vector<Vector2d> ptVec1, ptVec2;
+        {
+            lock_guard<mutex> lock(reservoirMutex);
+            if (reservoir1.size() < minMatches) continue;
+            ptVec1 = reservoir1;
+            ptVec2 = reservoir2;
+        }
+
+        if (not refine(ptVec1, ptVec2)) continue;
+
+        Eigen::MatrixXi mapL, mapR;
+        binner.computeStereoBins(stereo, mapL, mapR);
+
+        lock_guard<mutex> lock(resultMutex);
+        resultTbaseCam2 = stereo.TbaseCam2;
+        resultBinMapL.swap(mapL);
+        resultBinMapR.swap(mapR);
+        resultReady = true;
+    }
+}
+
+bool OnlineStereoCalibrator::refine(const vector<Vector2d> & ptVec1,
+        const vector<Vector2d> & ptVec2)
+{
+    vector<Vector3d> vVec1, vVec2;
+    stereo.cam1->reconstructPointCloud(ptVec1, vVec1);
+    stereo.cam2->reconstructPointCloud(ptVec2, vVec2);
+
+    Transformation<double> Tcam1cam2 = stereo.TbaseCam1.inverseCompose(stereo.TbaseCam2);
+    const double baseline = Tcam1cam2.trans().norm();
+    Vector3d rot = Tcam1cam2.rot();
+    Vector3d t = Tcam1cam2.trans() / baseline;
+    double dir[2]{atan2(t(2), t(0)), asin(t(1))};
+
+    // the same loss is shared by all the residuals
+    CauchyLoss loss(lossScale);
+    Problem::Options problemOptions;
+    problemOptions.loss_function_ownership = DO_NOT_TAKE_OWNERSHIP;
+    Problem problem(problemOptions);
+    for (unsigned int i = 0; i < vVec1.size(); i++)
+    {
+        CostFunction * costFunc = new AutoDiffCostFunction<EpipolarError, 1, 3, 2>(
+                new EpipolarError(vVec1[i].normalized(), vVec2[i].normalized()));
+        problem.AddResidualBlock(costFunc, &loss, rot.data(), dir);
+    }
+
+    Solver::Options options;
+    options.linear_solver_type = ceres::DENSE_QR;
+    options.max_num_iterations = 50;
+    Solver::Summary summary;
+    Solve(options, &problem, &summary);
+
+    if (not summary.IsSolutionUsable()) return false;
+    if ((rot - Tcam1cam2.rot()).norm() > maxRotationStep) return false;
+
+    t << cos(dir[1]) * cos(dir[0]), sin(dir[1]), cos(dir[1]) * sin(dir[0]);
+    stereo.TbaseCam2 = stereo.TbaseCam1.compose(Transformation<double>(t * baseline, rot));
+    return true;
+}
@@ -0,0 +1,228 @@
+//STL
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+//Eigen
+#include <Eigen/Eigen>
+
+#include "spatial_index.h"
+
+using Eigen::Matrix3d;
+using Eigen::Vector2d;
+
+void SpatialIndex::insert(LandmarkId id, const Vector3d & X)
+{
+    if (id >= size())
+    {
+        voxelKeyVec.resize(id + 1);
+        slotVec.resize(id + 1, -1);
+        positionVec.resize(id + 1);
+    }
+    if (slotVec[id] != -1) remove(id);
+    const Vector3i c = cell(X);
+    const int64_t k = key(c);
+    auto voxel = voxelMap.find(k);
+    if (voxel == voxelMap.end())
+    {
+        vector<int64_t> & voxelKeys = blockMap[key(blockOfCell(c))];
+        voxel = voxelMap.emplace(k, Voxel()).first;
+        voxel->second.slot = voxelKeys.size();
+        voxelKeys.push_back(k);
+    }
+    vector<LandmarkId> & ids = voxel->second.ids;
+    voxelKeyVec[id] = k;
+    slotVec[id] = ids.size();
+    positionVec[id] = X;
+    ids.push_back(id);
+}
+
+void SpatialIndex::move(LandmarkId id, const Vector3d & X)
+{
+    if (key(cell(X)) == voxelKeyVec[id])
+    {
+        positionVec[id] = X;
+    }
+    else
+    {
+        insert(id, X);
+    }
+}
+
+void SpatialIndex::remove(LandmarkId id)
+{
+    if (not contains(id)) return;
+    const int64_t k = voxelKeyVec[id];
+    auto voxel = voxelMap.find(k);
+    vector<LandmarkId> & ids = voxel->second.ids;
+    //the last one takes the place of id
+    const LandmarkId last = ids.back();
+    ids[slotVec[id]] = last;
+    slotVec[last] = slotVec[id];
+    ids.pop_back();
+    slotVec[id] = -1;
+    if (not ids.empty()) return;
+    
+    //the same for the voxel in its block
+    auto block = blockMap.find(key(blockOfCell(cellOfKey(k))));
+    vector<int64_t> & voxelKeys = block->second;
+    const int64_t lastKey = voxelKeys.back();
+    voxelKeys[voxel->second.slot] = lastKey;
+    voxelMap[lastKey].slot = voxel->second.slot;
+    voxelKeys.pop_back();
+    voxelMap.erase(voxel);
+    if (voxelKeys.empty()) blockMap.erase(block);
+}
+
+void SpatialIndex::reserve(int numLandmarks)
+{
+    voxelKeyVec.reserve(numLandmarks);
+    slotVec.reserve(numLandmarks);
+    positionVec.reserve(numLandmarks);
+}
+
+void SpatialIndex::clear()
+{
+    voxelMap.clear();
+    blockMap.clear();
+    voxelKeyVec.clear();
+    slotVec.clear();
+    positionVec.clear();
+}
+
+void SpatialIndex::radiusQuery(const Vector3d & center, double radius,
+        vector<LandmarkId> & idVec) const
+{
+    const Vector3d delta = Vector3d::Constant(radius);
+    const double radius2 = radius * radius;
+    forEachVoxel(cell(center - delta), cell(center + delta),
+            [](const Vector3i &) { return true; },
+            [&](const Vector3i &, const vector<LandmarkId> & ids)
+    {
+        for (auto id : ids)
+        {
+            if ((positionVec[id] - center).squaredNorm() <= radius2) idVec.push_back(id);
+        }
+    });
+}
+
+namespace
+{
+
+//the bounding cone of the field of view of a camera
+struct ViewCone
+{
+    const ICamera * cam;
+    bool bounded;
+    Matrix3d RcamOrig;
+    Vector3d PcamOrig;
+    Vector3d center, axis, axisCam;
+    double halfAngle, cosHalfAngle;
+
+    void init(const Transformation<double> & TorigCam, const ICamera * camera)
+    {
+        cam = camera;
+        bounded = cam->width > 1 and cam->height > 1;
+        TorigCam.toRotTransInv(RcamOrig, PcamOrig);
+        center = -RcamOrig.transpose() * PcamOrig;
+        halfAngle = M_PI;
+        if (not bounded or not cam->reconstructPoint(
+                Vector2d(0.5 * cam->width, 0.5 * cam->height), axisCam)) return;
+        if (not axisCam.allFinite()) return;
+        axisCam.normalize();
+        axis = RcamOrig.transpose() * axisCam;
+        //the widest angle along the image border
+        const int numSamples = 8;
+        double maxAngle = 0;
+        for (int i = 0; i <= numSamples; i++)
+        {
+            const double u = cam->width * i / numSamples;
+            const double v = cam->height * i / numSamples;
+            const Vector2d border[4] = {Vector2d(u, 0), Vector2d(u, cam->height),
+                    Vector2d(0, v), Vector2d(cam->width, v)};
+            for (auto & pt : border)
+            {
+                Vector3d bearing;
+                if (not cam->reconstructPoint(pt, bearing) or not bearing.allFinite()) return;
+                maxAngle = max(maxAngle, acos(min(1., axisCam.dot(bearing.normalized()))));
+            }
+        }
+        halfAngle = maxAngle;
+        cosHalfAngle = cos(halfAngle);
+    }
+
+    //whether a sphere may intersect the cone
+    bool intersects(const Vector3d & sphereCenter, double radius) const
+    {
+        if (halfAngle >= M_PI) return true;
+        const Vector3d v = sphereCenter - center;
+        const double d = v.norm();
+        if (d <= radius) return true;
+        const double angle = acos(max(-1., min(1., axis.dot(v) / d)));
+        return angle <= halfAngle + asin(radius / d);
+    }
+
+    bool sees(const Vector3d & X) const
+    {
+        const Vector3d Xcam = RcamOrig * X + PcamOrig;
+        Vector2d pt;
+        if (not cam->projectPoint(Xcam, pt)) return false;
+        if (not bounded) return true;
+        //some models project the points out of their domain into the image
+        if (halfAngle < M_PI and axisCam.dot(Xcam) < cosHalfAngle * Xcam.norm()) return false;
+        return pt[0] >= 0 and pt[0] < cam->width and pt[1] >= 0 and pt[1] < cam->height;
+    }
+};
+
+}
+
+bool SpatialIndex::frustumQuery(const Transformation<double> & TorigBase,
+        const StereoSystem & stereo, double maxDepth, vector<LandmarkId> & idVec,
+        int maxSize) const
+{
+    if (int(idVec.size()) >= maxSize) return false;
+    ViewCone cone1, cone2;
+    cone1.init(TorigBase.compose(stereo.TbaseCam1), stereo.cam1);
+    cone2.init(TorigBase.compose(stereo.TbaseCam2), stereo.cam2);
+    const Vector3d base = TorigBase.trans();
+    const Vector3d delta = Vector3d::Constant(maxDepth);
+    const double maxDepth2 = maxDepth * maxDepth;
+    //bounding spheres of a cell of the given size
+    auto visible = [&](const Vector3i & c, double size, bool & in1, bool & in2)
+    {
+        const Vector3d cellCenter = (c.cast<double>() + Vector3d::Constant(0.5)) * size;
+        const double cellRadius = 0.5 * sqrt(3.) * size;
+        if ((cellCenter - base).norm() - cellRadius > maxDepth) return false;
+        in1 = cone1.intersects(cellCenter, cellRadius);
+        in2 = cone2.intersects(cellCenter, cellRadius);
+        return in1 or in2;
+    };
+    const double blockSize = voxelSize * (1 << blockBits);
+    bool full = false;
+    forEachVoxel(cell(base - delta), cell(base + delta),
+            [&](const Vector3i & b)
+    {
+        bool in1, in2;
+        return not full and visible(b, blockSize, in1, in2);
+    },
+            [&](const Vector3i & c, const vector<LandmarkId> & ids)
+    {
+        bool in1, in2;
+        if (full or not visible(c, voxelSize, in1, in2)) return;
+        for (auto id : ids)
+        {
+            const Vector3d & X = positionVec[id];
+            if ((X - base).squaredNorm() > maxDepth2) continue;
+            if ((in1 and cone1.sees(X)) or (in2 and cone2.sees(X)))
+            {
+                idVec.push_back(id);
+                if (int(idVec.size()) >= maxSize)
+                {
+                    full = true;
+                    return;
+                }
+            }
+        }
+    });
+    return not full;
+}
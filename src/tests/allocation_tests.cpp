@@ -0,0 +1,220 @@
+// checks that the tracking path does not touch the heap after the warm-up
+
+#include <iostream>
+#include <cstdlib>
+#include <cassert>
+#include <new>
+#include <random>
+
+#include <Eigen/Eigen>
+
+#include "cartography.h"
+#include "geometry.h"
+#include "mei.h"
+#include "matcher.h"
+#include "thread_pool.h"
+#include "tests/allocation_tests.h"
+
+using namespace std;
+using Eigen::Vector3d;
+using Eigen::Vector2d;
+
+// global allocation counter, only this test target replaces operator new
+// Eigen allocates its dynamic matrices with malloc directly, they are not counted
+static long long allocationCount = 0;
+
+void * operator new(size_t size)
+{
+    allocationCount++;
+    void * ptr = malloc(size == 0 ? 1 : size);
+    if (ptr == NULL) throw bad_alloc();
+    return ptr;
+}
+
+void operator delete(void * ptr) noexcept
+{
+    free(ptr);
+}
+
+void * operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete[](void * ptr) noexcept
+{
+    operator delete(ptr);
+}
+
+// a scene seen by a rig moving at a constant velocity
+struct TrackingScene
+{
+    TrackingScene()
+        : camMei(params), TbaseCam1(0, 0, 0, 0, 0, 0), TbaseCam2(0.8, 0, 0, 0, 0, 0),
+          cartograph(TbaseCam1, TbaseCam2, camMei, camMei),
+          delta(0.1, 0, 0.3, 0, 0.01, 0)
+    {
+        default_random_engine generator(1);
+        uniform_real_distribution<double> pX(-10, 10);
+        uniform_real_distribution<double> pZ(10, 30);
+        uniform_real_distribution<float> pD(0, 1);
+        for (unsigned int i = 0; i < 300; i++)
+        {
+            Vector3d X(pX(generator), pX(generator), pZ(generator));
+            LandmarkStore::Descriptor d;
+            for (unsigned int j = 0; j < 64; j++)
+            {
+                d[j] = pD(generator);
+            }
+            cartograph.LM.add(X, d);
+        }
+        cartograph.trajectory.reserve(100);
+        cartograph.trajectory.push_back(Transformation<double>());
+        cartograph.trajectory.push_back(delta);
+        featureVec.reserve(cartograph.LM.size());
+    }
+
+    // observations of all the landmarks from the next pose of the rig
+    void nextFrame()
+    {
+        Transformation<double> Tnext = cartograph.trajectory.back().compose(delta);
+        Eigen::Matrix3d RcamOrig;
+        Vector3d PcamOrig;
+        Tnext.toRotTransInv(RcamOrig, PcamOrig);
+        featureVec.clear();
+        for (LandmarkId id = 0; id < cartograph.LM.size(); id++)
+        {
+            Vector3d Xcam = RcamOrig * cartograph.LM.position(id) + PcamOrig;
+            Vector2d pt;
+            camMei.projectPoint(Xcam, pt);
+            featureVec.push_back(Feature(pt, cartograph.LM.descriptor(id)));
+        }
+    }
+
+    // runs the odometry and counts the allocations it makes
+    long long track()
+    {
+        nextFrame();
+        long long count = allocationCount;
+        Transformation<double> pose = cartograph.estimateOdometry(featureVec);
+        count = allocationCount - count;
+        cartograph.trajectory.push_back(pose);
+        return count;
+    }
+
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei;
+    Transformation<double> TbaseCam1, TbaseCam2;
+    StereoCartography cartograph;
+    Transformation<double> delta;
+    vector<Feature> featureVec;
+};
+
+void testTrackingAllocations()
+{
+    TrackingScene scene;
+    scene.cartograph.initTracking();
+    // warm-up, the vectors reach their size
+    scene.track();
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        assert(scene.track() == 0);
+        assert(scene.cartograph.odometryReport.quality == ODOMETRY_FULL);
+    }
+}
+
+void testParallelTrackingAllocations()
+{
+    ThreadPool threadPool(4);
+    TrackingScene scene;
+    scene.cartograph.threadPool = &threadPool;
+    scene.cartograph.initTracking();
+    scene.track();
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        assert(scene.track() == 0);
+        assert(scene.cartograph.odometryReport.quality == ODOMETRY_FULL);
+    }
+}
+
+void testGrowingMapAllocations()
+{
+    TrackingScene scene;
+    scene.cartograph.initTracking();
+    scene.track();
+    default_random_engine generator(2);
+    uniform_real_distribution<double> pX(-10, 10);
+    uniform_real_distribution<double> pZ(15, 35);
+    uniform_real_distribution<float> pD(0, 1);
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        // the mapping side adds landmarks in the field of view between two frames,
+        // more of them are visible than are matched
+        for (unsigned int k = 0; k < 100; k++)
+        {
+            const Vector3d X = scene.cartograph.trajectory.back().trans() +
+                    Vector3d(pX(generator), pX(generator), pZ(generator));
+            LandmarkStore::Descriptor d;
+            for (unsigned int j = 0; j < 64; j++)
+            {
+                d[j] = pD(generator);
+            }
+            scene.cartograph.LM.add(X, d);
+        }
+        scene.cartograph.indexNewLandmarks();
+        assert(scene.track() == 0);
+        assert(scene.cartograph.odometryReport.quality == ODOMETRY_FULL);
+    }
+}
+
+void testStationaryAllocations()
+{
+    TrackingScene scene;
+    scene.cartograph.detectStationary = true;
+    scene.cartograph.initTracking();
+    scene.track();
+    assert(scene.track() == 0);
+    assert(scene.cartograph.odometryReport.quality == ODOMETRY_FULL);
+    
+    // the same frame again
+    long long count = allocationCount;
+    scene.cartograph.estimateOdometry(scene.featureVec);
+    assert(allocationCount == count);
+    assert(scene.cartograph.odometryReport.quality == ODOMETRY_STATIONARY);
+}
+
+void testTrackingOverflow()
+{
+    TrackingScene scene;
+    scene.cartograph.maxFeatures = 100;
+    scene.cartograph.initTracking();
+    Transformation<double> Tpred = scene.cartograph.motionModel.predict(
+            scene.cartograph.trajectory);
+    assert(scene.track() == 0);
+    assert(scene.cartograph.odometryReport.quality == ODOMETRY_OVERFLOW);
+    assert((scene.cartograph.trajectory.back().trans() - Tpred.trans()).norm() == 0);
+}
+
+int main(int argc, char** argv)
+{
+    cout << "### Tracking allocation tests ### " << flush;
+    testTrackingAllocations();
+    cout << "OK." << endl;
+
+    cout << "### Parallel tracking allocation tests ### " << flush;
+    testParallelTrackingAllocations();
+    cout << "OK." << endl;
+
+    cout << "### Growing map allocation tests ### " << flush;
+    testGrowingMapAllocations();
+    cout << "OK." << endl;
+
+    cout << "### Stationary tracking allocation tests ### " << flush;
+    testStationaryAllocations();
+    cout << "OK." << endl;
+
+    cout << "### Tracking overflow tests ### " << flush;
+    testTrackingOverflow();
+    cout << "OK." << endl;
+    return 0;
+}
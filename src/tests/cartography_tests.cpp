@@ -1,9 +1,16 @@
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <ctime>
 #include <cmath>
 #include <stdlib.h>
 #include <random>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include <ceres/rotation.h>
 
@@ -12,9 +19,13 @@
 #include <opencv2/nonfree/features2d.hpp>
 
 #include "cartography.h"
+#include "concurrent_mapper.h"
 #include "geometry.h"
 #include "vision.h"
 #include "mei.h"
+#include "matcher.h"
+#include "recalibration.h"
+#include "spatial_index.h"
 #include "tests/cartography_tests.h"
 
 #define EPS 1e-6
@@ -36,6 +47,8 @@ public:
         params[2] = f;
     }
     virtual ~Pinhole() {}
+    
+    virtual Pinhole * clone() const { return new Pinhole(params[0], params[1], params[2]); }
 
     virtual bool reconstructPoint(const Vector2d & src, Vector3d & dst) const
     {
@@ -208,190 +221,1911 @@ void testMei()
 
 }
 
-void testBundleAdjustment()
+void testEssentialMatrix()
+{
+    const Quaternion<double> qR(-0.0166921, 0.0961855, -0.0121137, 0.99515);
+    const Vector3d tR(0.78, 0.05, 0.02);
+    Transformation<double> T12(tR, qR);
+    
+    int maxNum = 500;
+    
+    vector<Vector3d> xVec1, xVec2;
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        xVec1.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+    }
+    T12.inverseTransform(xVec1, xVec2);
+    
+    for (unsigned int i = 0; i < maxNum; i += 4)
+    {
+        xVec2[i] = Vector3d::Random();
+        xVec2[i][2] = 1;
+    }
+    
+    Matrix3d E;
+    vector<bool> inlierMask;
+    Transformation<double> T12est;
+    EssentialMatrixEstimator estimator;
+    bool success = estimator.compute(xVec1, xVec2, E, inlierMask, T12est);
+    assert(success);
+    
+    for (unsigned int i = 1; i < maxNum; i += 4)
+    {
+        assert(inlierMask[i]);
+    }
+    assertEqual(T12est.rot(), T12.rot());
+    assertEqual(T12est.trans(), T12.trans().normalized());
+}
+
+void testRecalibration()
 {
     double params[6]{0.5, 1, 375, 375, 650, 470};
     MeiCamera cam1mei(params);
     MeiCamera cam2mei(params);
     const Quaternion<double> qR(-0.0166921, 0.0961855, -0.0121137, 0.99515);
-    const Vector3d tR(0.78, 0, 0);  // (x, y, z) OL-OR expressed in CR reference frame?
+    const Vector3d tR(0.78, 0, 0);
     Transformation<double> T1, T2(tR, qR);
-    StereoCartography cartograph(T1, T2, cam1mei, cam2mei);
+    StereoSystem stereoTrue(T1, T2, cam1mei, cam2mei);
+    
+    Transformation<double> T2drift = T2;
+    T2drift.rot() += Vector3d(0.003, -0.002, 0.004);
+    StereoSystem stereo(T1, T2drift, cam1mei, cam2mei);
     
     int maxNum = 500;
     
     vector<Vector2d> proj1, proj2;
-    vector<Vector3d> cloud1, cloud2;
-    
-    cartograph.LM.resize(maxNum);
+    vector<Vector3d> cloud;
     for (unsigned int i = 0; i < maxNum; i++)
     {
-        cloud1.push_back(Vector3d(10*sin(i),
+        cloud.push_back(Vector3d(10*sin(i),
                         10*std::cos(i*1.7),
                         15.2+5*std::sin(i/3.14)));
-        cartograph.LM[i].X = cloud1[i];
     }
+    stereoTrue.projectPointCloud(cloud, proj1, proj2);
     
-    cartograph.trajectory.push_back(Transformation<double>(0, 0, 0, 0, 0, 0));
-    cartograph.trajectory.push_back(Transformation<double>(0, 0, 1, 0, 0.2, 0));
-    cartograph.trajectory.push_back(Transformation<double>(0.1, 0, 2, 0, 0.3, 0));
-    cartograph.trajectory.push_back(Transformation<double>(0.2, 0, 2.5, 0.1, 0.3, 0));
-    cartograph.trajectory.push_back(Transformation<double>(0.3, 0, 2.7, 0.15, 0.3, 0));
+    vector<Feature> fVec1, fVec2;
+    vector<int> matches;
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        fVec1.push_back(Feature(proj1[i], Matrix<float, 64, 1>::Zero()));
+        fVec2.push_back(Feature(proj2[i], Matrix<float, 64, 1>::Zero()));
+        matches.push_back(i);
+    }
     
-    for (unsigned int j = 0; j < cartograph.trajectory.size(); j++)
+    Matcher matcher;
+    OnlineStereoCalibrator calibrator(stereo);
+    calibrator.period = 0.01;
+    calibrator.start();
+    calibrator.addStereoMatches(fVec1, fVec2, matches);
+    
+    bool updated = false;
+    for (int attempt = 0; attempt < 1000 and not updated; attempt++)
     {
-        cartograph.projectPointCloud(cloud1, proj1, proj2, j);
-        for (unsigned int i = 0; i < maxNum; i++)
+        this_thread::sleep_for(chrono::milliseconds(10));
+        updated = calibrator.update(stereo, matcher);
+    }
+    calibrator.stop();
+    
+    assert(updated);
+    assert((stereo.TbaseCam2.rot() - T2.rot()).norm() < 1e-4);
+    assert(matcher.binMapL.rows() == stereo.cam1->height);
+}
+
+void testLandmarkStore()
+{
+    LandmarkStore store;
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        assert(store.add(Vector3d(i, 0, 0), LandmarkStore::Descriptor::Constant(i)) == i);
+    }
+    
+    // the observations come frame by frame
+    for (unsigned int j = 0; j < 3; j++)
+    {
+        for (unsigned int i = j; i < 5; i++)
         {
-            Observation obs1(proj1[i], j, LEFT);
-            Observation obs2(proj2[i], j, RIGHT);
-            cartograph.LM[i].observations.push_back(obs1);
-            cartograph.LM[i].observations.push_back(obs2);
+            store.addObservation(i, Observation(Vector2d(i, j), j, LEFT));
+        }
+        store.commitObservations();
+    }
+    assert(store.observations().size() == 12);
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        assert(store.numObservations(i) == min(i + 1, 3u));
+        assert(store.lastSeen(i) == min(i, 2u));
+        unsigned int j = 0;
+        for (auto obs = store.observationBegin(i); obs != store.observationEnd(i); ++obs, ++j)
+        {
+            assert(obs->poseIdx == j);
+            assertEqual(obs->pt, Vector2d(i, j));
         }
     }
     
-    for (unsigned int i = 0; i < maxNum; i++)
+    // the ids survive a removal
+    store.remove(1);
+    store.addObservation(1, Observation(Vector2d(1, 3), 3, LEFT));
+    store.addObservation(3, Observation(Vector2d(3, 3), 3, LEFT));
+    store.commitObservations();
+    assert(store.numAlive() == 4 and store.size() == 5);
+    assert(not store.alive(1) and store.numObservations(1) == 0);
+    assert(store.numObservations(3) == 4);
+    assert(store.observationBegin(3)[3].poseIdx == 3);
+    assertEqual(store.position(4), Vector3d(4, 0, 0));
+    assert(store.descriptor(4)[0] == 4);
+    assert(store.add(Vector3d::Zero(), LandmarkStore::Descriptor::Zero()) == 5);
+    
+    // culling a pose
+    store.removeObservations([](LandmarkId id, const Observation & observation)
+    {
+        return observation.poseIdx == 3;
+    });
+    assert(store.numObservations(3) == 3 and store.lastSeen(3) == 2);
+    assert(store.numObservations(0) == 1 and store.lastSeen(0) == 0);
+    assert(store.observations().size() == 10);
+    
+    // merging into an older landmark, the staged observations come last
+    LandmarkId older = store.add(Vector3d::Zero(), LandmarkStore::Descriptor::Zero());
+    LandmarkId newer = store.add(Vector3d::Zero(), LandmarkStore::Descriptor::Zero());
+    store.addObservation(older, Observation(Vector2d(0, 0), 4, LEFT));
+    store.addObservation(newer, Observation(Vector2d(1, 1), 5, LEFT));
+    store.commitObservations();
+    store.addObservation(newer, Observation(Vector2d(2, 2), 6, RIGHT));
+    store.merge(newer, older);
+    store.commitObservations();
+    assert(not store.alive(newer) and store.numObservations(newer) == 0);
+    assert(store.numObservations(older) == 3 and store.lastSeen(older) == 6);
+    assert(store.observationBegin(older)[1].poseIdx == 5);
+    assert(store.observationBegin(older)[2].cameraId == RIGHT);
+    assert(store.resolve(newer) == older and store.resolve(older) == older);
+    
+    // the journal lists the landmarks whose observations have changed
+    auto changes = [&store](uint64_t position)
+    {
+        vector<LandmarkId> idVec;
+        for (; position < store.endChange(); position++)
+        {
+            idVec.push_back(store.changedLandmark(position));
+        }
+        sort(idVec.begin(), idVec.end());
+        idVec.erase(unique(idVec.begin(), idVec.end()), idVec.end());
+        return idVec;
+    };
+    store.trimChanges(store.endChange());
+    uint64_t position = store.endChange();
+    assert(store.firstChange() == position);
+    store.addObservation(2, Observation(Vector2d(2, 7), 7, LEFT));
+    store.addObservation(4, Observation(Vector2d(4, 7), 7, LEFT));
+    store.add(Vector3d::Zero(), LandmarkStore::Descriptor::Zero());
+    assert(store.endChange() == position);
+    store.commitObservations();
+    assert(changes(position) == vector<LandmarkId>({2, 4}));
+    position = store.endChange();
+    store.removeObservations([](LandmarkId id, const Observation & observation)
     {
-        cartograph.LM[i].X += Vector3d::Random();
+        return id == 3 and observation.poseIdx == 0;
+    });
+    store.remove(4);
+    assert(changes(position) == vector<LandmarkId>({3, 4}));
+
+    
+    // a reader behind the trimmed part has to check everything
+    store.trimChanges(position + 1);
+    assert(store.firstChange() == position + 1);
+    assert(changes(position + 1) == vector<LandmarkId>({4}));
+    
+    // the stamp tells a culling from an unchanged landmark
+    const int stamp = store.stamp(3);
+    store.addObservation(3, Observation(Vector2d(3, 8), 8, LEFT));
+    store.commitObservations();
+    assert(store.stamp(3) == stamp);
+    store.removeObservations([](LandmarkId id, const Observation & observation)
+    {
+        return id == 3 and observation.poseIdx == 1;
+    });
+    assert(store.stamp(3) == stamp + 1 and store.stamp(2) == 0);
+    
+    store.clear();
+    assert(store.firstChange() == store.endChange());
+}
+
+void testSpatialIndex()
+{
+    default_random_engine generator(3);
+    uniform_real_distribution<double> pX(-50, 50);
+    SpatialIndex index(2);
+    vector<Vector3d> cloud;
+    for (unsigned int i = 0; i < 5000; i++)
+    {
+        cloud.push_back(Vector3d(pX(generator), pX(generator), pX(generator)));
+        index.insert(i, cloud[i]);
     }
     
-    for (unsigned int j = 1; j < cartograph.trajectory.size(); j++)
+    // moves within a voxel and across voxels, removals
+    for (unsigned int i = 0; i < 5000; i += 7)
     {
-        cartograph.trajectory[j].rot() += Vector3d::Random()*0.1*j;
-        cartograph.trajectory[j].trans() += Vector3d::Random()*0.2*j;
+        cloud[i] += Vector3d(pX(generator), pX(generator), pX(generator)) * (i % 2 ? 0.01 : 0.2);
+        index.move(i, cloud[i]);
+    }
+    vector<bool> removed(cloud.size(), false);
+    for (unsigned int i = 3; i < 5000; i += 11)
+    {
+        index.remove(i);
+        removed[i] = true;
     }
     
-    cartograph.improveTheMap();
-    for (auto & lm : cartograph.LM)
+    // the queries return exactly the landmarks a brute force search finds
+    auto assertSameIds = [](vector<LandmarkId> idVec, vector<LandmarkId> expected)
+    {
+        sort(idVec.begin(), idVec.end());
+        assert(idVec == expected);
+    };
+    for (double radius : {0.5, 5., 30., 200.})
     {
-        cloud2.push_back(lm.X);
+        Vector3d center(pX(generator), pX(generator), pX(generator));
+        vector<LandmarkId> idVec, expected;
+        index.radiusQuery(center, radius, idVec);
+        for (unsigned int i = 0; i < cloud.size(); i++)
+        {
+            if (not removed[i] and (cloud[i] - center).norm() <= radius) expected.push_back(i);
+        }
+        assertSameIds(idVec, expected);
+    }
+    
+    Pinhole camera(650, 470, 375);
+    Transformation<double> TbaseCam1(0, 0, 0, 0, 0, 0), TbaseCam2(0.8, 0, 0, 0, 0, 0);
+    StereoSystem stereo(TbaseCam1, TbaseCam2, camera, camera);
+    for (auto & TorigBase : {Transformation<double>(0, 0, 0, 0, 0, 0),
+            Transformation<double>(10, -5, 3, 0.3, 2, -0.4)})
+    {
+        const double maxDepth = 30;
+        vector<LandmarkId> idVec, expected;
+        assert(index.frustumQuery(TorigBase, stereo, maxDepth, idVec));
+        for (unsigned int i = 0; i < cloud.size(); i++)
+        {
+            if (removed[i] or (cloud[i] - TorigBase.trans()).norm() > maxDepth) continue;
+            bool visible = false;
+            for (auto & TbaseCam : {TbaseCam1, TbaseCam2})
+            {
+                Matrix3d R;
+                Vector3d t;
+                TorigBase.compose(TbaseCam).toRotTransInv(R, t);
+                Vector3d Xcam = R * cloud[i] + t;
+                Vector2d pt;
+                visible = visible or (camera.projectPoint(Xcam, pt) and pt[0] >= 0 and pt[0] < 1300 
+                        and pt[1] >= 0 and pt[1] < 940);
+            }
+            if (visible) expected.push_back(i);
+        }
+        assert(not expected.empty());
+        assertSameIds(idVec, expected);
+        
+        // a bounded query stops with a part of them
+        idVec.clear();
+        const int maxSize = (expected.size() + 1) / 2;
+        assert(not index.frustumQuery(TorigBase, stereo, maxDepth, idVec, maxSize));
+        assert(idVec.size() == maxSize);
+        for (auto id : idVec)
+        {
+            assert(binary_search(expected.begin(), expected.end(), id));
+        }
     }
-    assertEqual(cloud1, cloud2);
 }
 
-void testOdometry()
+void testCovisibilityGraph()
+{
+    LandmarkStore store;
+    vector<vector<int>> posesSeen{{0, 1, 2}, {1, 2}, {2, 3}, {0, 3}};
+    for (unsigned int i = 0; i < posesSeen.size(); i++)
+    {
+        store.add(Vector3d::Zero(), LandmarkStore::Descriptor::Zero());
+    }
+    for (unsigned int j = 0; j < 4; j++)
+    {
+        for (unsigned int i = 0; i < posesSeen.size(); i++)
+        {
+            if (find(posesSeen[i].begin(), posesSeen[i].end(), j) == posesSeen[i].end()) continue;
+            store.addObservation(i, Observation(Vector2d::Zero(), j, LEFT));
+            store.addObservation(i, Observation(Vector2d::Zero(), j, RIGHT));
+        }
+    }
+    store.commitObservations();
+    
+    CovisibilityGraph graph;
+    graph.update(store);
+    assert(graph.numPoses() == 4);
+    assert(graph.weight(0, 1) == 1 and graph.weight(1, 0) == 1);
+    assert(graph.weight(1, 2) == 2 and graph.weight(2, 3) == 1 and graph.weight(0, 3) == 1);
+    assert(graph.weight(1, 3) == 0 and graph.neighbours(2).size() == 3);
+    
+    vector<int> poseVec;
+    graph.bestNeighbours(2, 2, poseVec);
+    assert(poseVec == vector<int>({1, 3}));
+    graph.bestNeighbours(2, 5, poseVec, 2);
+    assert(poseVec == vector<int>({1}));
+    
+    // a culled observation, a removed landmark and a new pose
+    store.removeObservations([](LandmarkId id, const Observation & observation)
+    {
+        return id == 1 and observation.poseIdx == 1;
+    });
+    store.remove(0);
+    store.addObservation(2, Observation(Vector2d::Zero(), 4, LEFT));
+    store.commitObservations();
+    graph.update(store);
+    assert(graph.weight(1, 2) == 0 and graph.weight(0, 1) == 0 and graph.weight(0, 2) == 0);
+    assert(graph.neighbours(1).empty());
+    assert(graph.weight(2, 4) == 1 and graph.weight(3, 4) == 1 and graph.weight(2, 3) == 1);
+    assert(graph.weight(0, 3) == 1);
+    
+    // nothing has changed
+    graph.update(store);
+    assert(graph.weight(2, 4) == 1 and graph.neighbours(2).size() == 2);
+    
+    // the landmarks of each pose
+    auto landmarks = [&graph](int poseIdx)
+    {
+        vector<LandmarkId> idVec = graph.landmarks(poseIdx);
+        sort(idVec.begin(), idVec.end());
+        return idVec;
+    };
+    assert(landmarks(0) == vector<LandmarkId>({3}));
+    assert(landmarks(1).empty());
+    assert(landmarks(2) == vector<LandmarkId>({1, 2}));
+    assert(landmarks(3) == vector<LandmarkId>({2, 3}));
+    assert(landmarks(4) == vector<LandmarkId>({2}));
+    
+    // a pose culled from a landmark in the middle of the list of the pose
+    store.removeObservations([](LandmarkId id, const Observation & observation)
+    {
+        return id == 2 and observation.poseIdx == 3;
+    });
+    graph.update(store);
+    assert(landmarks(3) == vector<LandmarkId>({3}));
+    assert(graph.weight(2, 3) == 0 and graph.weight(3, 4) == 0);
+    store.remove(3);
+    graph.update(store);
+    assert(landmarks(0).empty() and landmarks(3).empty());
+    
+    // a graph built from scratch agrees
+    CovisibilityGraph fresh;
+    fresh.update(store);
+    for (int j = 0; j < 5; j++)
+    {
+        assert(fresh.landmarks(j).size() == graph.landmarks(j).size());
+        assert(fresh.neighbours(j).size() == graph.neighbours(j).size());
+    }
+}
+
+void testPoseGraph()
 {
+    // analytic Jacobians against finite differences of the pose update
+    Transformation<double> pose1(0.3, -1, 2, 0.1, -0.4, 0.2), pose2(1.5, 0.2, 1, -0.3, 0.5, 0.6);
+    RelativePoseConstraint constraint{0, 1, Transformation<double>(1, 1, -1, 0.2, 0.3, 0.1),
+            Matrix6d::Identity()};
+    Vector6d error;
+    Matrix6d J1, J2;
+    PoseGraph::computeError(constraint, pose1, pose2, error, &J1, &J2);
+    const double delta = 1e-6;
+    for (unsigned int k = 0; k < 6; k++)
+    {
+        Vector6d dx = Vector6d::Zero();
+        dx[k] = delta;
+        Transformation<double> step(dx.head<3>(), dx.tail<3>());
+        Vector6d error1, error2;
+        PoseGraph::computeError(constraint, pose1.compose(step), pose2, error1);
+        PoseGraph::computeError(constraint, pose1, pose2.compose(step), error2);
+        assert(((error1 - error) / delta - J1.col(k)).norm() < 1e-4);
+        assert(((error2 - error) / delta - J2.col(k)).norm() < 1e-4);
+    }
+    
+    // a loop of 40 poses, the odometry drifts
+    const int numPoses = 40;
+    vector<Transformation<double>> truth, trajectory;
+    for (unsigned int j = 0; j < numPoses; j++)
+    {
+        const double angle = 2 * M_PI * j / numPoses;
+        truth.push_back(Transformation<double>(10 * sin(angle), 0, 10 * cos(angle), 0, angle, 0));
+    }
+    Transformation<double> bias(0.02, 0.01, 0, 0.002, 0.004, -0.001);
+    PoseGraph graph;
+    trajectory.push_back(truth[0]);
+    for (unsigned int j = 1; j < numPoses; j++)
+    {
+        Transformation<double> odometry = truth[j - 1].inverseCompose(truth[j]).compose(bias);
+        trajectory.push_back(trajectory.back().compose(odometry));
+        graph.addConstraint(j - 1, j, odometry);
+    }
+    graph.addConstraint(numPoses - 1, 0, truth[numPoses - 1].inverseCompose(truth[0]));
+    
+    auto maxError = [&]()
+    {
+        double res = 0;
+        for (unsigned int j = 0; j < numPoses; j++)
+        {
+            res = max(res, (trajectory[j].trans() - truth[j].trans()).norm());
+        }
+        return res;
+    };
+    const double errorBefore = maxError();
+    const Transformation<double> * data = trajectory.data();
+    const double costBefore = graph.cost(trajectory);
+    const double costAfter = graph.optimize(trajectory);
+    assert(costAfter < 1e-3 * costBefore);
+    assert(maxError() < 0.2 * errorBefore);
+    assert(trajectory.data() == data);
+    assertEqual(trajectory[0].trans(), truth[0].trans());
+    
+    // the landmarks follow the first pose they are seen from
     double params[6]{0.5, 1, 375, 375, 650, 470};
     MeiCamera camMei(params);
+    Transformation<double> xi1(0, 0, 0, 0, 0, 0), xi2(0.78, 0, 0, 0, 0, 0);
+    StereoCartography cartograph(xi1, xi2, camMei, camMei);
+    cartograph.trajectory = {Transformation<double>(0, 0, 0, 0, 0, 0),
+            Transformation<double>(1, 0, 0, 0, 0, 0), Transformation<double>(2, 0, 0, 0, 0.1, 0)};
+    cartograph.LM.add(Vector3d(2, 1, 10), LandmarkStore::Descriptor::Zero());
+    cartograph.LM.addObservation(0, Observation(Vector2d::Zero(), 2, LEFT));
     
-    Transformation<double> TbaseCam;
+    // pose 2 is seen from pose 0 with no rotation
+    cartograph.closeLoop(0, 2, Transformation<double>(2, 0, 0, 0, 0, 0));
+    assert(cartograph.trajectory[2].rot().norm() < 0.05);
+    Vector3d Xanchor = cartograph.trajectory[2].rotMat().transpose() * 
+            (cartograph.LM.position(0) - cartograph.trajectory[2].trans());
+    Transformation<double> oldPose(2, 0, 0, 0, 0.1, 0);
+    assertEqual(Xanchor, oldPose.rotMat().transpose() * (Vector3d(2, 1, 10) - oldPose.trans()));
+}
+
+void testMapFile()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera cam1mei(params);
+    MeiCamera cam2mei(params);
+    Transformation<double> xi1(0, 0, 0, 0, 0, 0), xi2(0.78, 0, 0, 0, 0.1, 0);
+    StereoCartography cartograph(xi1, xi2, cam1mei, cam2mei);
+    for (unsigned int i = 0; i < 7; i++)
+    {
+        cartograph.LM.add(Vector3d(i, -1, 10 + i), LandmarkStore::Descriptor::Constant(0.5 * i));
+    }
+    for (unsigned int j = 0; j < 3; j++)
+    {
+        cartograph.trajectory.push_back(Transformation<double>(0.1 * j, 0, 0, 0, 0.01 * j, 0));
+        for (unsigned int i = j; i < 7; i++)
+        {
+            cartograph.LM.addObservation(i, Observation(Vector2d(i, j), j, LEFT));
+            cartograph.LM.addObservation(i, Observation(Vector2d(i, j + 0.5), j, RIGHT));
+        }
+    }
+    cartograph.LM.remove(4);
+    const string fileName = "map_file_test.bin";
+    assert(cartograph.saveMap(fileName));
     
-    const int maxNum = 500;
-    Odometry odometry(Transformation<double>(), TbaseCam, camMei);
+    // used in place
+    MapView view;
+    assert(view.open(fileName) and view.verify());
+    assert(view.numLandmarks() == 7 and view.numPoses() == 3);
+    assert(view.numObservations() == cartograph.LM.observations().size());
+    assert(not view.alive(4) and view.alive(5) and view.numObservations(4) == 0);
+    assertEqual(Vector3d(view.position(6)), Vector3d(6, -1, 16));
+    assert(view.descriptor(6)[63] == 3);
+    assert(view.numObservations(2) == 6);
+    assert(view.observationBegin(2)[5].poseIdx == 2 and view.observationBegin(2)[5].cameraId == RIGHT);
+    assert(view.observationBegin(2)[5].v == 2.5);
+    assertEqual(view.pose(2).rot(), Vector3d(0, 0.02, 0));
+    assertEqual(view.TbaseCam(RIGHT).rot(), xi2.rot());
+    assert(view.camera(LEFT).numParams == 6 and view.camera(LEFT).params[4] == 650);
     
-    Transformation<double> Torig2(0.1, 0.2, 0.5, 0.1, 0.1, 0.1);
-       
-    for (unsigned int i = 0; i < maxNum; i++)
+    // copied back
+    LandmarkStore LM;
+    vector<Transformation<double>> trajectory;
+    view.copyTo(LM, trajectory);
+    assert(LM.size() == 7 and LM.numAlive() == 6 and trajectory.size() == 3);
+    assert(LM.observations().size() == cartograph.LM.observations().size());
+    for (LandmarkId id = 0; id < LM.size(); id++)
     {
-        odometry.cloud.push_back(Vector3d(10*sin(i),
-                        10*std::cos(i*1.7),
-                        15.2+5*std::sin(i/3.14)));
+        assert(LM.numObservations(id) == cartograph.LM.numObservations(id));
+        assert(LM.lastSeen(id) == cartograph.LM.lastSeen(id));
+        assert(LM.descriptor(id) == cartograph.LM.descriptor(id));
     }
-    vector<Vector3d> cloud2;
-    Torig2.inverseTransform(odometry.cloud, cloud2);
-    camMei.projectPointCloud(cloud2, odometry.observationVec); 
+    assertEqual(trajectory[1].trans(), cartograph.trajectory[1].trans());
+    view.close();
     
-    for (unsigned int i = 0; i < maxNum; i += 3)
+    // a damaged section is only found by verify, a damaged header by open
     {
-        odometry.observationVec[i] = Vector2d::Random()*100;
-        odometry.observationVec[i][0] += 100;
-        odometry.observationVec[i][1] += 100;
+        fstream file(fileName, ios::in | ios::out | ios::binary);
+        // within the positions, after the header
+        file.seekp(300);
+        file.put(1);
     }
+    assert(view.open(fileName) and not view.verify());
+    {
+        fstream file(fileName, ios::in | ios::out | ios::binary);
+        file.seekp(20);
+        file.put(1);
+    }
+    assert(not view.open(fileName));
+    remove(fileName.c_str());
     
-    
-    odometry.Ransac();
-    odometry.computeTransformation();
-    assertEqual(odometry.TorigBase.rot(), Torig2.rot());
-    assertEqual(odometry.TorigBase.trans(), Torig2.trans());
+    // the file cannot replace a directory, the temporary one is removed
+    const string directory = "map_file_test_dir";
+    mkdir(directory.c_str(), 0755);
+    assert(not cartograph.saveMap(directory));
+    assert(access((directory + ".tmp").c_str(), F_OK) != 0);
+    rmdir(directory.c_str());
 }
 
-int main(int argc, char** argv)
+void testTiledMap()
 {
-    clock_t begin, end;
-    double dt;
+    // a street along x, one landmark every 0.5 m, tiles of 50 m
+    default_random_engine generator(5);
+    uniform_real_distribution<float> pD(0, 1);
+    LandmarkStore prior;
+    for (unsigned int i = 0; i < 1000; i++)
+    {
+        LandmarkStore::Descriptor d;
+        for (unsigned int j = 0; j < 64; j++)
+        {
+            d[j] = pD(generator);
+        }
+        prior.add(Vector3d(0.5 * i, 3 + 3 * sin(i), 10 + 5 * cos(1.3 * i)), d);
+    }
+    prior.remove(7);
+    const string directory = "tiled_map_test";
+    assert(TiledMap::write(directory, prior, 50));
     
-    cout << "### Geometry tests ### " << flush;
-    begin = clock();
-    testGeometry();
-    end = clock();
-    dt = double(end - begin) / CLOCKS_PER_SEC;
-    cout << "OK. elapsed " << dt << endl;
+    TiledMap tiledMap;
+    tiledMap.prefetchRadius = 60;
+    tiledMap.memoryBudget = 3 * TiledMap::tileBytes(100);
+    assert(tiledMap.open(directory));
+    assert(tiledMap.numTiles() == 10 and tiledMap.numResidentTiles() == 0);
     
-    cout << "### Mei tests ### " << flush;
-    begin = clock();
-    testMei();
-    end = clock();
-    dt = double(end - begin) / CLOCKS_PER_SEC;
-    cout << "OK. elapsed " << dt << endl;
+    // loaded on the spot without the prefetch thread, the queries only see
+    // the tiles within reach
+    tiledMap.setPose(Vector3d(125, 0, 10));
+    assert(tiledMap.numResidentTiles() == 3 and tiledMap.numResidentLandmarks() == 300);
+    assert(tiledMap.memoryUsage() <= tiledMap.memoryBudget);
+    vector<LandmarkId> idVec;
+    tiledMap.radiusQuery(Vector3d(125, 0, 10), 80, idVec);
+    sort(idVec.begin(), idVec.end());
+    assert(idVec.size() == 300 and idVec.front() == 100 and idVec.back() == 399);
+    assertEqual(tiledMap.position(250), prior.position(250));
+    assert(tiledMap.descriptor(250) == prior.descriptor(250));
     
-    cout << "### Stereo tests ### " << flush;
-    begin = clock();
-    testVision();
-    end = clock();
-    dt = double(end - begin) / CLOCKS_PER_SEC;
-    cout << "OK. elapsed " << dt << endl;
+    // the prefetch thread, the farthest tiles are evicted to stay within the budget
+    tiledMap.start();
+    tiledMap.setPose(Vector3d(175, 0, 10));
+    tiledMap.waitForPrefetch();
+    assert(tiledMap.numResidentTiles() == 3);
+    assert(not tiledMap.contains(150) and tiledMap.contains(300) and tiledMap.contains(450));
+    tiledMap.prefetchRadius = 10;
+    tiledMap.setPose(Vector3d(325, 0, 10));
+    tiledMap.waitForPrefetch();
+    assert(tiledMap.numResidentTiles() == 3 and tiledMap.contains(650));
+    assert(tiledMap.memoryUsage() <= tiledMap.memoryBudget);
+    tiledMap.stop();
     
-    cout << "### Odometry tests ### " << flush;
-    begin = clock();
-    testOdometry();
-    end = clock();
-    dt = double(end - begin) / CLOCKS_PER_SEC;
-    cout << "OK. elapsed " << dt << endl;
+    // tracking against the prebuilt map only
+    assert(tiledMap.open(directory));
+    tiledMap.prefetchRadius = 30;
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei(params);
+    Transformation<double> TbaseCam1(0, 0, 0, 0, 0, 0), TbaseCam2(0.8, 0, 0, 0, 0, 0);
+    StereoCartography cartograph(TbaseCam1, TbaseCam2, camMei, camMei);
+    cartograph.tiledMap = &tiledMap;
+    cartograph.maxLandmarkDepth = 30;
+    Transformation<double> delta(0.3, 0, 0, 0, 0, 0);
+    cartograph.trajectory.push_back(Transformation<double>(200, 0, 0, 0, 0, 0));
+    cartograph.trajectory.push_back(cartograph.trajectory.back().compose(delta));
+    Transformation<double> Tnext = cartograph.trajectory.back().compose(delta);
+    Matrix3d R;
+    Vector3d t;
+    Tnext.toRotTransInv(R, t);
+    vector<Feature> featureVec;
+    for (LandmarkId id = 0; id < prior.size(); id++)
+    {
+        Vector2d pt;
+        if (not prior.alive(id) or (prior.position(id) - Tnext.trans()).norm() > 25) continue;
+        if (camMei.projectPoint(R * prior.position(id) + t, pt))
+        {
+            featureVec.push_back(Feature(pt, prior.descriptor(id)));
+        }
+    }
+    cartograph.initTracking();
+    // the prefetch window follows the last pose, out of the odometry
+    tiledMap.setPose(cartograph.trajectory.back().trans());
+    Transformation<double> pose = cartograph.estimateOdometry(featureVec);
+    assert(cartograph.odometryReport.numInliers > 20);
+    assertEqual(pose.trans(), Tnext.trans());
+    // the matches of the prebuilt map are reported apart
+    assert(cartograph.odometryReport.matchVec.empty());
+    assert(int(cartograph.odometryReport.tiledMatchVec.size()) == cartograph.odometryReport.numInliers);
     
-    cout << "### Bundle Adjustment tests ### " << flush;
-    begin = clock();
-    testBundleAdjustment();
-    end = clock();
-    dt = double(end - begin) / CLOCKS_PER_SEC;
-    cout << "OK. elapsed " << dt << endl;
-    return 0;
+    for (int k = 0; k < 10; k++)
+    {
+        ostringstream name;
+        name << directory << "/tile_" << k << "_0_0.bin";
+        remove(name.str().c_str());
+    }
+    remove((directory + "/tiles.index").c_str());
+    rmdir(directory.c_str());
 }
 
-
-/* EPIPOLAR TESTS
-TODO: TO BE DONE IN THE FUTURE
-
-    /// RECOMPUTE THE CALIBRATION
+void testLocalBundleAdjustment()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera cam1mei(params);
+    MeiCamera cam2mei(params);
+    const Quaternion<double> qR(-0.0166921, 0.0961855, -0.0121137, 0.99515);
+    const Vector3d tR(0.78, 0, 0);
+    Transformation<double> T1, T2(tR, qR);
+    StereoCartography cartograph(T1, T2, cam1mei, cam2mei);
+    cartograph.localWindowSize = 2;
     
-    vector<Vector3d> xVec1, xVec2;
-    cam1mei.reconstructPointCloud(pVec1, xVec1);
-    cam2mei.reconstructPointCloud(pVec2, xVec2);
+    int maxNum = 500;
     
-    Matrix3d E;
-    computeEssentialMatrix(xVec1, xVec2, E);
+    vector<Vector2d> proj1, proj2;
+    vector<Vector3d> cloud1;
+    
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        cloud1.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+        cartograph.LM.add(cloud1[i], LandmarkStore::Descriptor::Zero());
+    }
     
-    Matrix3d Eold = hat(T2.trans()) * T2.rotMat();
-    Eold = Eold / Eold(2, 2);
-    cout << "old E : " << endl;
-    cout <<  Eold << endl;
+    vector<Transformation<double>> trajectory;
+    trajectory.push_back(Transformation<double>(0, 0, 0, 0, 0, 0));
+    trajectory.push_back(Transformation<double>(0, 0, 1, 0, 0.2, 0));
+    trajectory.push_back(Transformation<double>(0.1, 0, 2, 0, 0.3, 0));
+    trajectory.push_back(Transformation<double>(0.2, 0, 2.5, 0.1, 0.3, 0));
+    trajectory.push_back(Transformation<double>(0.3, 0, 2.7, 0.15, 0.3, 0));
+    cartograph.trajectory = trajectory;
     
-    cout << xVec1[18].transpose() * E * xVec2[18] << endl;
-    cout << xVec1[18].transpose() * Eold * xVec2[18] << endl;
-    cout << "#######" << endl;
+    // the first half of the landmarks is not seen from the window
+    for (unsigned int j = 0; j < cartograph.trajectory.size(); j++)
+    {
+        cartograph.projectPointCloud(cloud1, proj1, proj2, j);
+        for (unsigned int i = 0; i < maxNum; i++)
+        {
+            if (i < maxNum / 2 and j >= 3) continue;
+            cartograph.LM.addObservation(i, Observation(proj1[i], j, LEFT));
+            cartograph.LM.addObservation(i, Observation(proj2[i], j, RIGHT));
+        }
+    }
     
-    JacobiSVD<Matrix3d> svd(E, Eigen::ComputeFullU | Eigen::ComputeFullV);
-    cout << svd.singularValues() << endl;
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        cartograph.LM.position(i) += Vector3d::Random() * 0.1;
+    }
+    vector<Vector3d> cloudNoisy = cartograph.LM.positions();
+    for (unsigned int j = 3; j < cartograph.trajectory.size(); j++)
+    {
+        cartograph.trajectory[j].rot() += Vector3d::Random()*0.01;
+        cartograph.trajectory[j].trans() += Vector3d::Random()*0.02;
+    }
     
-    Matrix3d R90;
-    Matrix3d Rm90;
-    R90 << 0, -1, 0, 1, 0, 0, 0, 0, 1;
-    Rm90 << 0, 1, 0, -1, 0, 0, 0, 0, 1;
-    Matrix3d R = svd.matrixU() * Rm90 * svd.matrixV().transpose();
-    cout << "new rotation : " << endl;
-    cout << R << endl;
-    R = -svd.matrixU() * R90 * svd.matrixV().transpose();
-    Quaternion<double> newQ(R);
-    cout << newQ << endl;
-    cout << R << endl;
-    cout << "original rotation : " << endl;
-    cout << T2.rotMat() << endl;
-    cout << "left sing vecs : " << endl;
-    cout << svd.matrixU() << endl;    
-    ///
-
-
-*/
-
-
-
+    cartograph.improveTheMap();
+    
+    // the poses and the landmarks out of the window are untouched
+    for (unsigned int j = 0; j < 3; j++)
+    {
+        assertEqual(cartograph.trajectory[j].trans(), trajectory[j].trans());
+        assertEqual(cartograph.trajectory[j].rot(), trajectory[j].rot());
+    }
+    for (unsigned int i = 0; i < maxNum / 2; i++)
+    {
+        assertEqual(cartograph.LM.position(i), cloudNoisy[i]);
+    }
+    // the others are corrected
+    for (unsigned int j = 3; j < cartograph.trajectory.size(); j++)
+    {
+        assertEqual(cartograph.trajectory[j].trans(), trajectory[j].trans());
+        assertEqual(cartograph.trajectory[j].rot(), trajectory[j].rot());
+    }
+    for (unsigned int i = maxNum / 2; i < maxNum; i++)
+    {
+        assertEqual(cartograph.LM.position(i), cloud1[i]);
+    }
+}
 
+void testIncrementalMapping()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera cam1mei(params);
+    MeiCamera cam2mei(params);
+    const Quaternion<double> qR(-0.0166921, 0.0961855, -0.0121137, 0.99515);
+    const Vector3d tR(0.78, 0, 0);
+    Transformation<double> T1, T2(tR, qR);
+    StereoCartography cartograph(T1, T2, cam1mei, cam2mei);
+    IncrementalSmoother smoother(cartograph.stereo);
+    
+    int maxNum = 200;
+    vector<Vector2d> proj1, proj2;
+    vector<Vector3d> cloud1;
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        cloud1.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+    }
+    
+    // the first pose sees most of the landmarks,
+    // each next one sees a new landmark and the previous one
+    for (unsigned int i = 0; i < maxNum - 4; i++)
+    {
+        cartograph.LM.add(cloud1[i], LandmarkStore::Descriptor::Zero());
+    }
+    for (unsigned int j = 0; j < 4; j++)
+    {
+        cartograph.trajectory.push_back(Transformation<double>(0.1*j, 0, 0.5*j, 0, 0.05*j, 0));
+        if (j > 0)
+        {
+            cartograph.LM.add(cloud1[cartograph.LM.size()], LandmarkStore::Descriptor::Zero());
+        }
+        cartograph.projectPointCloud(cloud1, proj1, proj2, j);
+        for (unsigned int i = 0; i < cartograph.LM.size(); i++)
+        {
+            if (j > 0 and i < cartograph.LM.size() - 2) continue;
+            cartograph.LM.addObservation(i, Observation(proj1[i], j, LEFT));
+            cartograph.LM.addObservation(i, Observation(proj2[i], j, RIGHT));
+        }
+        smoother.update(cartograph.LM, cartograph.trajectory);
+        if (j == 0)
+        {
+            assert(smoother.numActivePoses() == 1);
+            assert(smoother.numActiveLandmarks() == cartograph.LM.size());
+        }
+        else
+        {
+            // the exact data does not move the converged variables
+            assert(smoother.numActivePoses() == 1);
+            assert(smoother.numActiveLandmarks() == 2);
+        }
+    }
+    for (unsigned int i = 0; i < cartograph.LM.size(); i++)
+    {
+        assertEqual(cartograph.LM.position(i), cloud1[i]);
+    }
+    
+    // nothing new, nothing to do
+    smoother.update(cartograph.LM, cartograph.trajectory);
+    assert(smoother.numActivePoses() == 0);
+    assert(smoother.numActiveLandmarks() == 0);
+    
+    // the slots of the dropped factors are reused
+    const int numFactors = smoother.numFactors();
+    const int numSlots = smoother.numFactorSlots();
+    cartograph.LM.remove(0);
+    smoother.update(cartograph.LM, cartograph.trajectory);
+    assert(smoother.numFactors() == numFactors - 2);
+    cartograph.LM.addObservation(1, Observation(proj1[1], 3, LEFT));
+    cartograph.LM.addObservation(1, Observation(proj2[1], 3, RIGHT));
+    smoother.update(cartograph.LM, cartograph.trajectory);
+    assert(smoother.numFactors() == numFactors and smoother.numFactorSlots() == numSlots);
+    assert(smoother.numActivePoses() == 1 and smoother.numActiveLandmarks() == 1);
+    
+    // an observation culled and another one added, the landmark is rebuilt
+    cartograph.LM.removeObservations([](LandmarkId id, const Observation & observation)
+    {
+        return id == 1 and observation.poseIdx == 3;
+    });
+    cartograph.LM.addObservation(1, Observation(proj1[1], 2, LEFT));
+    cartograph.LM.addObservation(1, Observation(proj2[1], 2, RIGHT));
+    smoother.update(cartograph.LM, cartograph.trajectory);
+    assert(smoother.numFactors() == numFactors);
+    assert(smoother.numActiveLandmarks() == 1);
+}
+
+void testPersistentMapping()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera cam1mei(params);
+    MeiCamera cam2mei(params);
+    Transformation<double> T1, T2(0.78, 0, 0, 0, 0, 0);
+    StereoCartography cartograph(T1, T2, cam1mei, cam2mei);
+    
+    int maxNum = 100;
+    vector<Vector2d> proj1, proj2;
+    vector<Vector3d> cloud1;
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        cloud1.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+        cartograph.LM.add(cloud1[i], LandmarkStore::Descriptor::Zero());
+    }
+    cartograph.trajectory.reserve(10);
+    auto addPose = [&](const Transformation<double> & pose)
+    {
+        const int j = cartograph.trajectory.size();
+        cartograph.trajectory.push_back(pose);
+        cartograph.projectPointCloud(cloud1, proj1, proj2, j);
+        // the second half of the landmarks is seen only from the first pose
+        for (unsigned int i = 0; i < maxNum; i++)
+        {
+            if (j > 0 and i >= maxNum / 2) continue;
+            cartograph.LM.addObservation(i, Observation(proj1[i], j, LEFT));
+            cartograph.LM.addObservation(i, Observation(proj2[i], j, RIGHT));
+        }
+    };
+    addPose(Transformation<double>(0, 0, 0, 0, 0, 0));
+    addPose(Transformation<double>(0, 0, 1, 0, 0.2, 0));
+    
+    MapInitializer initializer;
+    initializer.update(cartograph.LM, cartograph.trajectory, cartograph.stereo, 0);
+    assert(initializer.numObservations() == 3 * maxNum);
+    initializer.compute();
+    
+    // only the new observations are added
+    addPose(Transformation<double>(0.1, 0, 2, 0, 0.3, 0));
+    initializer.update(cartograph.LM, cartograph.trajectory, cartograph.stereo, 0);
+    assert(initializer.numObservations() == 4 * maxNum);
+    
+    // the culled ones are removed
+    cartograph.LM.removeObservations([](LandmarkId id, const Observation & observation)
+    {
+        return id == 0 and observation.poseIdx > 0;
+    });
+    initializer.update(cartograph.LM, cartograph.trajectory, cartograph.stereo, 0);
+    assert(initializer.numObservations() == 4 * maxNum - 4);
+    
+    // the landmarks not seen from the window are removed, the first one included
+    initializer.update(cartograph.LM, cartograph.trajectory, cartograph.stereo, 1);
+    assert(initializer.numObservations() == 3 * maxNum - 6);
+    
+    // the storage has moved, the problem is rebuilt
+    cartograph.trajectory.shrink_to_fit();
+    cartograph.trajectory.reserve(20);
+    initializer.update(cartograph.LM, cartograph.trajectory, cartograph.stereo, 0);
+    assert(initializer.numObservations() == 4 * maxNum - 4);
+    initializer.compute();
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        assertEqual(cartograph.LM.position(i), cloud1[i]);
+    }
+    
+    // driven by the covisibility graph, only the landmarks of the poses
+    // entering or leaving the window and the changed ones are checked
+    CovisibilityGraph covisibility;
+    covisibility.update(cartograph.LM);
+    MapInitializer windowed;
+    windowed.update(cartograph.LM, cartograph.trajectory, cartograph.stereo,
+            vector<bool>{false, true, true}, &covisibility);
+    assert(windowed.numObservations() == 3 * maxNum - 6);
+    windowed.update(cartograph.LM, cartograph.trajectory, cartograph.stereo,
+            vector<bool>{true, false, false}, &covisibility);
+    assert(windowed.numObservations() == 4 * maxNum - 4);
+    windowed.update(cartograph.LM, cartograph.trajectory, cartograph.stereo,
+            vector<bool>{false, false, true}, &covisibility);
+    assert(windowed.numObservations() == 3 * maxNum - 6);
+    addPose(Transformation<double>(0.2, 0, 3, 0, 0.4, 0));
+    cartograph.LM.commitObservations();
+    covisibility.update(cartograph.LM);
+    windowed.update(cartograph.LM, cartograph.trajectory, cartograph.stereo,
+            vector<bool>{false, false, true, true}, &covisibility);
+    assert(windowed.numObservations() == 4 * maxNum - 4);
+    MapInitializer full;
+    full.update(cartograph.LM, cartograph.trajectory, cartograph.stereo,
+            vector<bool>{false, false, true, true});
+    assert(full.numObservations() == windowed.numObservations());
+}
+
+void testPoseCache()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei(params);
+    Transformation<double> TbaseCam(0.78, 0.1, 0, 0.01, 0.02, -0.01);
+    Transformation<double> pose(0.3, 0.1, 1, 0.1, 0.2, -0.05);
+    Vector3d X(1, -2, 15);
+    
+    PoseCache cache;
+    const PoseCacheEntry * entry = cache.addPose(pose.rotData(), TbaseCam);
+    ReprojectionErrorStereo errorCached(Vector2d(600, 400), TbaseCam, &camMei, entry);
+    ReprojectionErrorStereo error(Vector2d(600, 400), TbaseCam, &camMei);
+    
+    for (unsigned int k = 0; k < 2; k++)
+    {
+        double const * args[3]{X.data(), pose.transData(), pose.rotData()};
+        double res[2], resCached[2];
+        double jac[3][6], jacCached[3][6];
+        double * jacPtr[3]{jac[0], jac[1], jac[2]};
+        double * jacCachedPtr[3]{jacCached[0], jacCached[1], jacCached[2]};
+        error.Evaluate(args, res, jacPtr);
+        errorCached.Evaluate(args, resCached, jacCachedPtr);
+        assertEqual(Vector2d(res), Vector2d(resCached));
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            assertEqual(Vector3d(jac[i]), Vector3d(jacCached[i]));
+            assertEqual(Vector3d(jac[i] + 3), Vector3d(jacCached[i] + 3));
+        }
+        
+        // a new evaluation point
+        pose.rot() += Vector3d(0.05, -0.1, 0.02);
+        cache.activate(entry);
+        cache.PrepareForEvaluation(true, true);
+    }
+    
+    // only the active entries follow their poses
+    Transformation<double> pose2(0.1, 0.2, 0.3, -0.1, 0.1, 0.2);
+    const PoseCacheEntry * entry2 = cache.addPose(pose2.rotData(), TbaseCam);
+    assert(cache.numActive() == 1);
+    pose.rot() += Vector3d(0.01, 0.01, 0.01);
+    pose2.rot() += Vector3d(0.01, 0.01, 0.01);
+    cache.PrepareForEvaluation(true, true);
+    assertEqual(entry->rotCached, pose.rot());
+    assert(entry2->rotCached != pose2.rot());
+    
+    // an entry is refreshed when activated
+    cache.activate(entry2);
+    assertEqual(entry2->rotCached, pose2.rot());
+    cache.deactivate(entry);
+    assert(cache.numActive() == 1);
+    pose.rot() += Vector3d(0.01, 0.01, 0.01);
+    cache.PrepareForEvaluation(true, true);
+    assert(entry->rotCached != pose.rot());
+    cache.deactivateAll();
+    assert(cache.numActive() == 0);
+}
+
+void testBundleAdjustment()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera cam1mei(params);
+    MeiCamera cam2mei(params);
+    const Quaternion<double> qR(-0.0166921, 0.0961855, -0.0121137, 0.99515);
+    const Vector3d tR(0.78, 0, 0);  // (x, y, z) OL-OR expressed in CR reference frame?
+    Transformation<double> T1, T2(tR, qR);
+    StereoCartography cartograph(T1, T2, cam1mei, cam2mei);
+    
+    int maxNum = 500;
+    
+    vector<Vector2d> proj1, proj2;
+    vector<Vector3d> cloud1, cloud2;
+    
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        cloud1.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+        cartograph.LM.add(cloud1[i], LandmarkStore::Descriptor::Zero());
+    }
+    
+    cartograph.trajectory.push_back(Transformation<double>(0, 0, 0, 0, 0, 0));
+    cartograph.trajectory.push_back(Transformation<double>(0, 0, 1, 0, 0.2, 0));
+    cartograph.trajectory.push_back(Transformation<double>(0.1, 0, 2, 0, 0.3, 0));
+    cartograph.trajectory.push_back(Transformation<double>(0.2, 0, 2.5, 0.1, 0.3, 0));
+    cartograph.trajectory.push_back(Transformation<double>(0.3, 0, 2.7, 0.15, 0.3, 0));
+    
+    for (unsigned int j = 0; j < cartograph.trajectory.size(); j++)
+    {
+        cartograph.projectPointCloud(cloud1, proj1, proj2, j);
+        for (unsigned int i = 0; i < maxNum; i++)
+        {
+            Observation obs1(proj1[i], j, LEFT);
+            Observation obs2(proj2[i], j, RIGHT);
+            cartograph.LM.addObservation(i, obs1);
+            cartograph.LM.addObservation(i, obs2);
+        }
+    }
+    
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        cartograph.LM.position(i) += Vector3d::Random();
+    }
+    
+    for (unsigned int j = 1; j < cartograph.trajectory.size(); j++)
+    {
+        cartograph.trajectory[j].rot() += Vector3d::Random()*0.1*j;
+        cartograph.trajectory[j].trans() += Vector3d::Random()*0.2*j;
+    }
+    
+    cartograph.improveTheMap();
+    cloud2 = cartograph.LM.positions();
+    assertEqual(cloud1, cloud2);
+}
+
+void testOdometry()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei(params);
+    
+    Transformation<double> TbaseCam;
+    
+    const int maxNum = 500;
+    Odometry odometry(Transformation<double>(), TbaseCam, camMei);
+    
+    Transformation<double> Torig2(0.1, 0.2, 0.5, 0.1, 0.1, 0.1);
+       
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        odometry.cloud.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+    }
+    vector<Vector3d> cloud2;
+    Torig2.inverseTransform(odometry.cloud, cloud2);
+    camMei.projectPointCloud(cloud2, odometry.observationVec); 
+    
+    for (unsigned int i = 0; i < maxNum; i += 3)
+    {
+        odometry.observationVec[i] = Vector2d::Random()*100;
+        odometry.observationVec[i][0] += 100;
+        odometry.observationVec[i][1] += 100;
+    }
+    
+    
+    odometry.Ransac();
+    odometry.computeTransformation();
+    assertEqual(odometry.TorigBase.rot(), Torig2.rot());
+    assertEqual(odometry.TorigBase.trans(), Torig2.trans());
+}
+
+void testParallelRansac()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei(params);
+    
+    Transformation<double> TbaseCam;
+    
+    const int maxNum = 500;
+    Odometry odometry(Transformation<double>(), TbaseCam, camMei);
+    
+    Transformation<double> Torig2(0.1, 0.2, 0.5, 0.1, 0.1, 0.1);
+       
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        odometry.cloud.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+    }
+    vector<Vector3d> cloud2;
+    Torig2.inverseTransform(odometry.cloud, cloud2);
+    camMei.projectPointCloud(cloud2, odometry.observationVec); 
+    
+    for (unsigned int i = 0; i < maxNum; i += 2)
+    {
+        odometry.observationVec[i] = Vector2d::Random()*100;
+        odometry.observationVec[i][0] += 100;
+        odometry.observationVec[i][1] += 100;
+    }
+    
+    ThreadPool threadPool(4);
+    odometry.threadPool = &threadPool;
+    odometry.seed = 42;
+    odometry.numIterMax = 200;
+    
+    odometry.Ransac();
+    Transformation<double> Tfirst = odometry.TorigBase;
+    vector<bool> firstMask = odometry.inlierMask;
+    
+    odometry.TorigBase = Transformation<double>();
+    odometry.Ransac();
+    
+    // same seed and same number of threads give the same result
+    assert(Tfirst.rot() == odometry.TorigBase.rot());
+    assert(Tfirst.trans() == odometry.TorigBase.trans());
+    assert(firstMask == odometry.inlierMask);
+    assertEqual(odometry.TorigBase.rot(), Torig2.rot());
+    assertEqual(odometry.TorigBase.trans(), Torig2.trans());
+}
+
+void testProsac()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei(params);
+    
+    Transformation<double> TbaseCam;
+    
+    const int maxNum = 500;
+    Odometry odometry(Transformation<double>(), TbaseCam, camMei);
+    
+    Transformation<double> Torig2(0.1, 0.2, 0.5, 0.1, 0.1, 0.1);
+       
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        odometry.cloud.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+    }
+    vector<Vector3d> cloud2;
+    Torig2.inverseTransform(odometry.cloud, cloud2);
+    camMei.projectPointCloud(cloud2, odometry.observationVec); 
+    
+    // most of the matches are wrong, but the best ranked ones are right
+    odometry.qualityVec.resize(maxNum);
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        odometry.qualityVec[i].distance = 0.1;
+        odometry.qualityVec[i].ratio = 0.3 + 0.001 * (i % 100);
+        if (i % 10 < 7)
+        {
+            odometry.observationVec[i] = Vector2d::Random()*100;
+            odometry.observationVec[i][0] += 100;
+            odometry.observationVec[i][1] += 100;
+            odometry.qualityVec[i].ratio += 0.3;
+        }
+    }
+    
+    // a uniform sampler would need about 170 iterations
+    odometry.numIterMax = 3;
+    odometry.Ransac();
+    assertEqual(odometry.TorigBase.rot(), Torig2.rot());
+    assertEqual(odometry.TorigBase.trans(), Torig2.trans());
+    
+    // the iteration count of a very low inlier ratio does not fit in an int
+    odometry.observationVec.resize(1000);
+    assert(odometry.requiredIterations(1) == odometry.numIterMax);
+    
+    // a match without a second candidate in the window is not ranked as distinctive
+    vector<Feature> fVec1, fVec2;
+    fVec1.push_back(Feature(Vector2d(10, 10), LandmarkStore::Descriptor::Constant(0.1f)));
+    fVec2.push_back(Feature(Vector2d(11, 10), LandmarkStore::Descriptor::Constant(0.11f)));
+    fVec2.push_back(Feature(Vector2d(200, 10), LandmarkStore::Descriptor::Constant(0.12f)));
+    Matcher matcher;
+    vector<int> matchVec;
+    vector<MatchQuality> qualityVec;
+    matcher.guidedMatch(fVec1, fVec2, 5, matchVec, qualityVec);
+    assert(matchVec[0] == 0 and qualityVec[0].ratio == 1);
+    matcher.guidedMatch(fVec1, fVec2, 500, matchVec, qualityVec);
+    assert(matchVec[0] == 0 and qualityVec[0].ratio < 1);
+}
+
+void testMotionModel()
+{
+    MotionModel motionModel;
+    vector<Transformation<double>> trajectory;
+    trajectory.push_back(Transformation<double>(0.1, 0.2, 0.5, 0.1, 0.1, 0.1));
+    assertEqual(motionModel.predict(trajectory).trans(), trajectory.back().trans());
+    assert(motionModel.searchRadius(trajectory) < 0);
+    
+    // constant velocity in the base frame
+    Transformation<double> delta(0.3, -0.1, 0.05, 0.02, -0.01, 0.03);
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        trajectory.push_back(trajectory.back().compose(delta));
+    }
+    Transformation<double> Tnext = trajectory.back().compose(delta);
+    Transformation<double> Tpred = motionModel.predict(trajectory);
+    assertEqual(Tpred.rot(), Tnext.rot());
+    assertEqual(Tpred.trans(), Tnext.trans());
+    
+    motionModel.predictionError = 0;
+    assert(motionModel.searchRadius(trajectory) == motionModel.minSearchRadius);
+    
+    // with an exact prediction RANSAC needs no sample at all
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei(params);
+    Transformation<double> TbaseCam;
+    Odometry odometry(Tnext, TbaseCam, camMei);
+    for (unsigned int i = 0; i < 100; i++)
+    {
+        odometry.cloud.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+    }
+    vector<Vector3d> cloud2;
+    Tnext.inverseTransform(odometry.cloud, cloud2);
+    camMei.projectPointCloud(cloud2, odometry.observationVec);
+    odometry.numIterMax = 0;
+    odometry.Ransac();
+    for (unsigned int i = 0; i < odometry.inlierMask.size(); i++)
+    {
+        assert(odometry.inlierMask[i]);
+    }
+    assertEqual(odometry.TorigBase.trans(), Tnext.trans());
+    
+    // nothing matched, the next frame is searched in the widest window
+    Transformation<double> TbaseCam2(0.8, 0, 0, 0, 0, 0);
+    StereoCartography cartograph(TbaseCam, TbaseCam2, camMei, camMei);
+    cartograph.trajectory = trajectory;
+    cartograph.motionModel.predictionError = 0;
+    vector<Feature> featureVec(1, Feature(Vector2d(100, 100), LandmarkStore::Descriptor::Zero()));
+    cartograph.estimateOdometry(featureVec);
+    assert(cartograph.odometryReport.quality == ODOMETRY_PREDICTED);
+    assert(cartograph.motionModel.searchRadius(trajectory) == cartograph.motionModel.maxSearchRadius);
+}
+
+void testOdometryDeadline()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei(params);
+    
+    Transformation<double> TbaseCam;
+    Transformation<double> Torig2(0.1, 0.2, 0.5, 0.1, 0.1, 0.1);
+    Odometry odometry(Transformation<double>(), TbaseCam, camMei);
+    for (unsigned int i = 0; i < 500; i++)
+    {
+        odometry.cloud.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+    }
+    vector<Vector3d> cloud2;
+    Torig2.inverseTransform(odometry.cloud, cloud2);
+    camMei.projectPointCloud(cloud2, odometry.observationVec);
+    
+    // an expired deadline keeps the initial guess
+    odometry.deadline = chrono::steady_clock::now();
+    assert(not odometry.Ransac());
+    assert(not odometry.computeTransformation());
+    assertEqual(odometry.TorigBase.trans(), Vector3d::Zero());
+    
+    // without deadline
+    odometry.deadline = chrono::steady_clock::time_point::max();
+    assert(odometry.Ransac());
+    assert(odometry.computeTransformation());
+    assertEqual(odometry.TorigBase.trans(), Torig2.trans());
+    
+    // the matching stops at the deadline and leaves the rest unmatched
+    vector<Feature> fVec;
+    for (unsigned int i = 0; i < 10; i++)
+    {
+        fVec.push_back(Feature(Vector2d(i, i), Matrix<float, 64, 1>::Zero()));
+    }
+    Matcher matcher;
+    vector<int> matches;
+    vector<MatchQuality> qualities;
+    assert(not matcher.guidedMatch(fVec, fVec, 100, matches, qualities,
+            chrono::steady_clock::now()));
+    for (unsigned int i = 0; i < fVec.size(); i++)
+    {
+        assert(matches[i] == -1);
+    }
+    assert(matcher.guidedMatch(fVec, fVec, 0.5, matches, qualities));
+    for (unsigned int i = 0; i < fVec.size(); i++)
+    {
+        assert(matches[i] == i);
+    }
+}
+
+void testStationaryDetector()
+{
+    vector<Feature> fVec;
+    for (unsigned int i = 0; i < 200; i++)
+    {
+        Matrix<float, 64, 1> desc = Matrix<float, 64, 1>::Random();
+        fVec.push_back(Feature(Vector2d(10*sin(i) + 500, 20*cos(i*1.7) + 400), desc));
+    }
+    StationaryDetector detector;
+    detector.maxSkipped = 3;
+    assert(not detector.isStationary(fVec));
+    detector.setReference(fVec);
+    
+    // sub-pixel noise is not a motion
+    vector<Feature> fVecNoisy = fVec;
+    for (auto & feature : fVecNoisy)
+    {
+        feature.pt += Vector2d::Random() * 0.3;
+    }
+    assert(detector.isStationary(fVecNoisy));
+    
+    // a global shift is
+    vector<Feature> fVecShifted = fVec;
+    for (auto & feature : fVecShifted)
+    {
+        feature.pt[0] += 5;
+    }
+    assert(not detector.isStationary(fVecShifted));
+    
+    // the skipping is bounded
+    assert(detector.isStationary(fVec));
+    assert(detector.isStationary(fVec));
+    assert(not detector.isStationary(fVec));
+    detector.setReference(fVec);
+    assert(detector.isStationary(fVec));
+}
+
+void testKeyframeSelector()
+{
+    KeyframeSelector selector;
+    selector.maxFrames = 5;
+    Transformation<double> pose(0, 0, 0, 0, 0, 0);
+    assert(selector.isKeyframe(pose, 100, 10));
+    selector.setKeyframe(pose, 100);
+    
+    // small motion, most landmarks tracked
+    assert(not selector.isKeyframe(Transformation<double>(0.3, 0, 0, 0, 0, 0), 90, 10));
+    // parallax
+    assert(selector.isKeyframe(Transformation<double>(0.3, 0, 0, 0, 0, 0), 90, 5));
+    // rotation
+    assert(selector.isKeyframe(Transformation<double>(0, 0, 0, 0, 0.3, 0), 90, 10));
+    // tracking is fading
+    assert(selector.isKeyframe(pose, 50, 10));
+    // too long since the last keyframe
+    assert(selector.isKeyframe(pose, 100, 10));
+    selector.setKeyframe(pose, 100);
+    assert(not selector.isKeyframe(pose, 100, 10));
+    
+    // a frame the odometry has found no inliers in is not a keyframe,
+    // here the matches all come from the same point
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei(params);
+    Transformation<double> TbaseCam1(0, 0, 0, 0, 0, 0), TbaseCam2(0.8, 0, 0, 0, 0, 0);
+    StereoCartography cartograph(TbaseCam1, TbaseCam2, camMei, camMei);
+    cartograph.trajectory.push_back(pose);
+    vector<Feature> featureVec;
+    for (unsigned int i = 0; i < 3; i++)
+    {
+        cartograph.LM.add(Vector3d(i, 0, 10), LandmarkStore::Descriptor::Constant(0.3 * i));
+        featureVec.push_back(Feature(Vector2d(100, 100), cartograph.LM.descriptor(i)));
+    }
+    cartograph.initTracking();
+    cartograph.estimateOdometry(featureVec);
+    assert(cartograph.odometryReport.numMatches == 3);
+    assert(cartograph.odometryReport.numInliers == 0);
+    assert(not cartograph.odometryReport.keyframe);
+}
+
+void testKeyframeCulling()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera cam1mei(params);
+    MeiCamera cam2mei(params);
+    Transformation<double> xi1(0, 0, 0, 0, 0, 0), xi2(0.78, 0, 0, 0, 0, 0);
+    StereoCartography cartograph(xi1, xi2, cam1mei, cam2mei);
+    cartograph.localWindowSize = 2;
+    cartograph.minRedundantObservers = 3;
+    
+    // all the poses see the same landmarks, pose 2 also sees two of its own
+    for (unsigned int i = 0; i < 12; i++)
+    {
+        cartograph.LM.add(Vector3d(i, 0, 10), LandmarkStore::Descriptor::Zero());
+    }
+    for (unsigned int j = 0; j < 6; j++)
+    {
+        cartograph.trajectory.push_back(Transformation<double>(0.1 * j, 0, 0, 0, 0, 0));
+        for (unsigned int i = 0; i < 12; i++)
+        {
+            if (i >= 10 and j != 2) continue;
+            cartograph.LM.addObservation(i, Observation(Vector2d::Zero(), j, LEFT));
+            cartograph.LM.addObservation(i, Observation(Vector2d::Zero(), j, RIGHT));
+        }
+    }
+    
+    // pose 1 is redundant, pose 2 is not, pose 3 is once pose 1 is gone,
+    // the first pose and the window are kept
+    assert(cartograph.cullKeyframes() == 2);
+    for (unsigned int i = 0; i < 10; i++)
+    {
+        assert(cartograph.LM.numObservations(i) == 8);
+        for (auto obs = cartograph.LM.observationBegin(i); obs != cartograph.LM.observationEnd(i); ++obs)
+        {
+            assert(obs->poseIdx != 1 and obs->poseIdx != 3);
+        }
+    }
+    assert(cartograph.LM.numObservations(10) == 2);
+    
+    // the remaining ones are not redundant enough
+    assert(cartograph.cullKeyframes() == 0);
+    
+    // the window counts keyframes, not the frames tracked since
+    for (unsigned int j = 6; j < 8; j++)
+    {
+        cartograph.trajectory.push_back(Transformation<double>(0.1 * j, 0, 0, 0, 0, 0));
+    }
+    assert(cartograph.cullKeyframes() == 0);
+    assert(cartograph.LM.numObservations(0) == 8);
+    
+    // pose 2 is judged again once its own landmarks are seen from enough keyframes,
+    // it no longer counts for pose 8 then
+    for (unsigned int j = 8; j < 11; j++)
+    {
+        cartograph.trajectory.push_back(Transformation<double>(0.1 * j, 0, 0, 0, 0, 0));
+        for (unsigned int i = 10; i < 12; i++)
+        {
+            cartograph.LM.addObservation(i, Observation(Vector2d::Zero(), j, LEFT));
+        }
+    }
+    assert(cartograph.cullKeyframes() == 1);
+    assert(cartograph.LM.numObservations(0) == 6 and cartograph.LM.numObservations(10) == 3);
+}
+
+void testLandmarkFusion()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera cam1mei(params);
+    MeiCamera cam2mei(params);
+    Transformation<double> xi1(0, 0, 0, 0, 0, 0), xi2(0.78, 0, 0, 0, 0, 0);
+    StereoCartography cartograph(xi1, xi2, cam1mei, cam2mei);
+    default_random_engine generator(7);
+    uniform_real_distribution<float> pD(0, 1);
+    auto randomDescriptor = [&]()
+    {
+        LandmarkStore::Descriptor d;
+        for (unsigned int j = 0; j < 64; j++)
+        {
+            d[j] = pD(generator);
+        }
+        return d;
+    };
+    auto observe = [&](LandmarkId id, unsigned int firstPose, unsigned int lastPose)
+    {
+        for (unsigned int j = firstPose; j <= lastPose; j++)
+        {
+            cartograph.LM.addObservation(id, Observation(Vector2d::Zero(), j, LEFT));
+            cartograph.LM.addObservation(id, Observation(Vector2d::Zero(), j, RIGHT));
+        }
+    };
+    for (unsigned int j = 0; j < 8; j++)
+    {
+        cartograph.trajectory.push_back(Transformation<double>(0.1 * j, 0, 0, 0, 0, 0));
+    }
+    
+    // seen from the poses 0 to 2, then again after a tracking gap as new landmarks,
+    // the first one with another descriptor, the second one seen from pose 2 too
+    for (unsigned int i = 0; i < 20; i++)
+    {
+        cartograph.LM.add(Vector3d(i, 0, 10), randomDescriptor());
+        observe(i, 0, 2);
+    }
+    for (unsigned int i = 0; i < 20; i++)
+    {
+        LandmarkStore::Descriptor d = cartograph.LM.descriptor(i);
+        d += LandmarkStore::Descriptor::Constant(0.01);
+        cartograph.LM.add(Vector3d(i + 0.1, 0.05, 10), i == 0 ? randomDescriptor() : d);
+        observe(20 + i, i == 1 ? 2 : 3, 5);
+    }
+    // really new ones
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        cartograph.LM.add(Vector3d(i, 5, 10), randomDescriptor());
+        observe(40 + i, 3, 5);
+    }
+    
+    assert(cartograph.fuseLandmarks() == 18);
+    assert(cartograph.LM.numAlive() == 27);
+    assert(cartograph.LM.alive(20) and cartograph.LM.alive(21) and not cartograph.LM.alive(25));
+    assert(cartograph.LM.numObservations(5) == 12 and cartograph.LM.lastSeen(5) == 5);
+    for (unsigned int k = 0; k < 12; k++)
+    {
+        assert(cartograph.LM.observationBegin(5)[k].poseIdx == k / 2);
+    }
+    cartograph.covisibility.update(cartograph.LM);
+    assert(cartograph.covisibility.weight(0, 5) == 18);
+    assert(cartograph.fuseLandmarks() == 0);
+    
+    // only the landmarks added since are checked
+    for (unsigned int i = 0; i < 5; i++)
+    {
+        cartograph.LM.add(Vector3d(i, 5, 10.1), cartograph.LM.descriptor(40 + i));
+        observe(45 + i, 6, 7);
+    }
+    assert(cartograph.fuseLandmarks() == 5);
+    assert(cartograph.LM.numAlive() == 27 and cartograph.LM.lastSeen(44) == 7);
+    
+    // the fused landmarks leave the index through the journal
+    assert(cartograph.landmarkIndex.contains(44) and not cartograph.landmarkIndex.contains(49));
+    assert(not cartograph.landmarkIndex.contains(25));
+    cartograph.LM.remove(44);
+    cartograph.indexNewLandmarks();
+    assert(not cartograph.landmarkIndex.contains(44));
+}
+
+void testConcurrentMapping()
+{
+    // a scene in front of the first keyframe
+    default_random_engine generator(11);
+    uniform_real_distribution<double> pX(-8, 8), pZ(8, 25);
+    uniform_real_distribution<float> pD(0, 1);
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei(params);
+    Transformation<double> TbaseCam1(0, 0, 0, 0, 0, 0), TbaseCam2(0.8, 0, 0, 0, 0, 0);
+    StereoCartography mapping(TbaseCam1, TbaseCam2, camMei, camMei);
+    StereoCartography tracking(TbaseCam1, TbaseCam2, camMei, camMei);
+    vector<Vector3d> cloud;
+    LandmarkStore::DescriptorVec descriptorVec;
+    for (unsigned int i = 0; i < 350; i++)
+    {
+        cloud.push_back(Vector3d(pX(generator), pX(generator) / 2, pZ(generator)));
+        LandmarkStore::Descriptor d;
+        for (unsigned int j = 0; j < 64; j++)
+        {
+            d[j] = pD(generator);
+        }
+        descriptorVec.push_back(d);
+    }
+    
+    // the stereo observations of the landmark X from pose
+    auto observe = [&](KeyframeData & keyframe, LandmarkId id, const Vector3d & X) {
+        Matrix3d R;
+        Vector3d t;
+        Vector2d pt1, pt2;
+        keyframe.pose.compose(TbaseCam1).toRotTransInv(R, t);
+        const bool visible1 = camMei.projectPoint(R * X + t, pt1);
+        keyframe.pose.compose(TbaseCam2).toRotTransInv(R, t);
+        if (not visible1 or not camMei.projectPoint(R * X + t, pt2)) return;
+        keyframe.observationVec.push_back(make_pair(id, Observation(pt1, 0, LEFT)));
+        keyframe.observationVec.push_back(make_pair(id, Observation(pt2, 0, RIGHT)));
+    };
+    
+    KeyframeData keyframe1;
+    for (unsigned int k = 0; k < 300; k++)
+    {
+        keyframe1.newLandmarkVec.push_back(cloud[k]);
+        keyframe1.newDescriptorVec.push_back(descriptorVec[k]);
+        observe(keyframe1, KeyframeData::newLandmarkId(k), cloud[k]);
+    }
+    
+    ConcurrentMapper mapper(mapping);
+    assert(mapper.snapshot() == NULL);
+    mapper.start();
+    mapper.addKeyframe(keyframe1);
+    mapper.waitForMapping();
+    shared_ptr<const MapSnapshot> snapshot1 = mapper.snapshot();
+    assert(snapshot1 != NULL and snapshot1->version == 1 and snapshot1->numPoses == 1);
+    assert(snapshot1->idVec.size() == 300 and snapshot1->idVec.back() == 299);
+    assert(mapping.LM.size() == 300 and mapping.trajectory.size() == 1);
+    
+    // the tracking only sees the snapshot, its own map stays empty
+    assert(mapper.loadSnapshot(tracking) and tracking.mapSnapshot == snapshot1);
+    assert(not mapper.loadSnapshot(tracking));
+    tracking.maxLandmarkDepth = 30;
+    Transformation<double> delta(0.3, 0, 0, 0, 0, 0);
+    tracking.trajectory.push_back(Transformation<double>(0, 0, 0, 0, 0, 0));
+    tracking.trajectory.push_back(tracking.trajectory.back().compose(delta));
+    Transformation<double> Tnext = tracking.trajectory.back().compose(delta);
+    Matrix3d R;
+    Vector3d t;
+    Tnext.toRotTransInv(R, t);
+    vector<Feature> featureVec;
+    vector<int> cloudIdxVec;
+    for (unsigned int i = 0; i < 300; i++)
+    {
+        Vector2d pt;
+        if (camMei.projectPoint(R * cloud[i] + t, pt))
+        {
+            featureVec.push_back(Feature(pt, descriptorVec[i]));
+            cloudIdxVec.push_back(i);
+        }
+    }
+    tracking.initTracking();
+    Transformation<double> pose = tracking.estimateOdometry(featureVec);
+    assert(tracking.odometryReport.numInliers > 20 and tracking.LM.size() == 0);
+    assertEqual(pose.trans(), Tnext.trans());
+    
+    // the matched landmarks are reported with the ids of the snapshot
+    const vector<pair<int, LandmarkId>> matchVec = tracking.odometryReport.matchVec;
+    const vector<Feature> matchedFeatureVec = featureVec;
+    assert(int(matchVec.size()) == tracking.odometryReport.numInliers);
+    assert(tracking.odometryReport.tiledMatchVec.empty());
+    for (auto & match : matchVec)
+    {
+        assert(match.second == snapshot1->idVec[cloudIdxVec[match.first]]);
+    }
+    
+    // the odometry follows a change of the extrinsic
+    tracking.stereo.TbaseCam1 = Transformation<double>(0, 0.2, 0, 0, 0, 0);
+    Tnext.compose(tracking.stereo.TbaseCam1).toRotTransInv(R, t);
+    featureVec.clear();
+    for (unsigned int i = 0; i < 300; i++)
+    {
+        Vector2d pt;
+        if (camMei.projectPoint(R * cloud[i] + t, pt))
+        {
+            featureVec.push_back(Feature(pt, descriptorVec[i]));
+        }
+    }
+    pose = tracking.estimateOdometry(featureVec);
+    assertEqual(pose.trans(), Tnext.trans());
+    tracking.stereo.TbaseCam1 = TbaseCam1;
+    
+    // a keyframe with new landmarks and the tracked ones,
+    // the snapshot held by the tracking does not change
+    KeyframeData keyframe2;
+    keyframe2.pose = Tnext;
+    for (unsigned int k = 0; k < 50; k++)
+    {
+        keyframe2.newLandmarkVec.push_back(cloud[300 + k]);
+        keyframe2.newDescriptorVec.push_back(descriptorVec[300 + k]);
+        observe(keyframe2, KeyframeData::newLandmarkId(k), cloud[300 + k]);
+    }
+    for (auto & match : matchVec)
+    {
+        keyframe2.observationVec.push_back(make_pair(match.second,
+                Observation(matchedFeatureVec[match.first].pt, 0, LEFT)));
+    }
+    const LandmarkId tracked = matchVec[0].second;
+    const int numTrackedObservations = mapping.LM.numObservations(tracked);
+    mapper.addKeyframe(keyframe2);
+    mapper.waitForMapping();
+    shared_ptr<const MapSnapshot> snapshot2 = mapper.snapshot();
+    assert(snapshot2->version == 2 and snapshot2->numPoses == 2 and snapshot2->idVec.size() == 350);
+    assert(snapshot1->version == 1 and snapshot1->idVec.size() == 300);
+    assert(snapshot2->lastSeenVec[tracked] == 1 and mapping.LM.lastSeen(tracked) == 1);
+    assert(mapping.LM.numObservations(tracked) == numTrackedObservations + 1);
+    
+    // without the thread, on the spot; the observations of the removed landmarks are dropped,
+    // the ones of the fused landmarks go to the landmark they have been fused into
+    mapper.stop();
+    mapping.LM.remove(5);
+    mapping.LM.merge(7, 8);
+    const int numObservations8 = mapping.LM.numObservations(7) + mapping.LM.numObservations(8);
+    KeyframeData keyframe3;
+    keyframe3.pose = Tnext;
+    observe(keyframe3, 5, cloud[5]);
+    observe(keyframe3, 6, cloud[6]);
+    observe(keyframe3, 7, cloud[7]);
+    mapper.addKeyframe(keyframe3);
+    shared_ptr<const MapSnapshot> snapshot3 = mapper.snapshot();
+    assert(snapshot3->version == 3 and snapshot3->numPoses == 3 and snapshot3->idVec.size() == 348);
+    assert(mapping.LM.lastSeen(6) == 2 and mapping.LM.numObservations(5) == 0);
+    assert(mapping.LM.lastSeen(8) == 2 and mapping.LM.numObservations(8) == numObservations8 + 2);
+    
+    // the optimization moves the map, the next keyframe follows the mapped ones
+    // and the tracking is moved onto the map when it loads the snapshot
+    Transformation<double> shift(1, 0.5, 0, 0, 0, 0.05);
+    for (auto & mappedPose : mapping.trajectory)
+    {
+        mappedPose = shift.compose(mappedPose);
+    }
+    shift.transform(mapping.LM.positions(), mapping.LM.positions());
+    KeyframeData keyframe4;
+    keyframe4.pose = Tnext.compose(delta);
+    observe(keyframe4, 6, cloud[6]);
+    mapper.addKeyframe(keyframe4);
+    shared_ptr<const MapSnapshot> snapshot4 = mapper.snapshot();
+    const Transformation<double> mapped4 = shift.compose(keyframe4.pose);
+    assertEqual(snapshot4->lastPose.trans(), mapped4.trans());
+    assertEqual(snapshot4->lastPose.rot(), mapped4.rot());
+    const Transformation<double> corrected = shift.compose(tracking.trajectory.back());
+    assert(mapper.loadSnapshot(tracking) and tracking.mapSnapshot == snapshot4);
+    assertEqual(tracking.trajectory.back().trans(), corrected.trans());
+    assertEqual(tracking.trajectory.back().rot(), corrected.rot());
+    
+    // a keyframe handed over in the corrected frame is not corrected twice
+    KeyframeData keyframe5;
+    keyframe5.pose = tracking.trajectory.back();
+    mapper.addKeyframe(keyframe5);
+    assert(mapper.loadSnapshot(tracking));
+    assertEqual(mapper.snapshot()->lastPose.trans(), corrected.trans());
+    assertEqual(tracking.trajectory.back().trans(), corrected.trans());
+    assertEqual(tracking.trajectory.back().rot(), corrected.rot());
+}
+
+void testPoseRefinement()
+{
+    double params[6]{0.5, 1, 375, 375, 650, 470};
+    MeiCamera camMei(params);
+    
+    Transformation<double> TbaseCam(0.5, 0.1, 0, 0.02, -0.01, 0.03);
+    
+    const int maxNum = 500;
+    Transformation<double> Torig2(0.1, 0.2, 0.5, 0.1, 0.1, 0.1);
+    Transformation<double> Tinit(0.15, 0.1, 0.6, 0.12, 0.05, 0.08);
+    Odometry odometry(Tinit, TbaseCam, camMei);
+       
+    for (unsigned int i = 0; i < maxNum; i++)
+    {
+        odometry.cloud.push_back(Vector3d(10*sin(i),
+                        10*std::cos(i*1.7),
+                        15.2+5*std::sin(i/3.14)));
+    }
+    vector<Vector3d> cloud2;
+    Torig2.compose(TbaseCam).inverseTransform(odometry.cloud, cloud2);
+    camMei.projectPointCloud(cloud2, odometry.observationVec); 
+    
+    // a few undetected outliers are handled by the Huber weighting
+    odometry.inlierMask.assign(maxNum, true);
+    for (unsigned int i = 0; i < maxNum; i += 50)
+    {
+        odometry.observationVec[i] += Vector2d(3, -4);
+    }
+    odometry.huberThreshold = 1;
+    odometry.refineIterMax = 50;
+    odometry.computeTransformation();
+    assert((odometry.TorigBase.rot() - Torig2.rot()).norm() < 1e-3);
+    assert((odometry.TorigBase.trans() - Torig2.trans()).norm() < 1e-2);
+    
+    // exact solution on clean data
+    for (unsigned int i = 0; i < maxNum; i += 50)
+    {
+        odometry.inlierMask[i] = false;
+    }
+    odometry.TorigBase = Tinit;
+    odometry.huberThreshold = 0;
+    odometry.computeTransformation();
+    assertEqual(odometry.TorigBase.rot(), Torig2.rot());
+    assertEqual(odometry.TorigBase.trans(), Torig2.trans());
+    
+    // the last step is not returned before its cost has been checked
+    odometry.TorigBase = Tinit;
+    odometry.refineIterMax = 1;
+    odometry.computeTransformation();
+    assert(odometry.TorigBase.trans() == Tinit.trans() and odometry.TorigBase.rot() == Tinit.rot());
+}
+
+int main(int argc, char** argv)
+{
+    clock_t begin, end;
+    double dt;
+    
+    cout << "### Geometry tests ### " << flush;
+    begin = clock();
+    testGeometry();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Mei tests ### " << flush;
+    begin = clock();
+    testMei();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Stereo tests ### " << flush;
+    begin = clock();
+    testVision();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Essential matrix tests ### " << flush;
+    begin = clock();
+    testEssentialMatrix();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Recalibration tests ### " << flush;
+    begin = clock();
+    testRecalibration();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Odometry tests ### " << flush;
+    begin = clock();
+    testOdometry();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Pose refinement tests ### " << flush;
+    begin = clock();
+    testPoseRefinement();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Parallel RANSAC tests ### " << flush;
+    begin = clock();
+    testParallelRansac();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### PROSAC tests ### " << flush;
+    begin = clock();
+    testProsac();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Odometry deadline tests ### " << flush;
+    begin = clock();
+    testOdometryDeadline();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Stationary detector tests ### " << flush;
+    begin = clock();
+    testStationaryDetector();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Motion model tests ### " << flush;
+    begin = clock();
+    testMotionModel();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Pose cache tests ### " << flush;
+    begin = clock();
+    testPoseCache();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Bundle Adjustment tests ### " << flush;
+    begin = clock();
+    testBundleAdjustment();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Incremental mapping tests ### " << flush;
+    begin = clock();
+    testIncrementalMapping();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Persistent mapping tests ### " << flush;
+    begin = clock();
+    testPersistentMapping();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Landmark store tests ### " << flush;
+    begin = clock();
+    testLandmarkStore();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Spatial index tests ### " << flush;
+    begin = clock();
+    testSpatialIndex();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Covisibility graph tests ### " << flush;
+    begin = clock();
+    testCovisibilityGraph();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Keyframe selection tests ### " << flush;
+    begin = clock();
+    testKeyframeSelector();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Keyframe culling tests ### " << flush;
+    begin = clock();
+    testKeyframeCulling();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Landmark fusion tests ### " << flush;
+    begin = clock();
+    testLandmarkFusion();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Concurrent mapping tests ### " << flush;
+    begin = clock();
+    testConcurrentMapping();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Pose graph tests ### " << flush;
+    begin = clock();
+    testPoseGraph();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Map file tests ### " << flush;
+    begin = clock();
+    testMapFile();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Tiled map tests ### " << flush;
+    begin = clock();
+    testTiledMap();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    
+    cout << "### Local Bundle Adjustment tests ### " << flush;
+    begin = clock();
+    testLocalBundleAdjustment();
+    end = clock();
+    dt = double(end - begin) / CLOCKS_PER_SEC;
+    cout << "OK. elapsed " << dt << endl;
+    return 0;
+}
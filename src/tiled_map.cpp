@@ -0,0 +1,463 @@
+//STL
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cerrno>
+
+//POSIX
+#include <sys/stat.h>
+
+#include "map_file.h"
+#include "tiled_map.h"
+
+namespace
+{
+
+const uint32_t TILE_FILE_VERSION = 1;
+const char TILE_INDEX_MAGIC[8] = {'S', 'P', 'C', 'T', 'I', 'D', 'X', 0};
+const char TILE_FILE_MAGIC[8] = {'S', 'P', 'C', 'T', 'I', 'L', 'E', 0};
+
+// The index: the header, then the entries ordered by key.
+// A tile: the header, then the ids, padded to 8 bytes,
+// 3 doubles and 64 floats per landmark; little-endian.
+struct TileIndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numTiles;
+    double tileSize;
+    //of the entries
+    uint64_t checksum;
+};
+
+struct TileIndexEntry
+{
+    int64_t key;
+    uint64_t numLandmarks;
+};
+
+struct TileFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numLandmarks;
+    int64_t key;
+    //of the rest of the file
+    uint64_t checksum;
+};
+
+//21 bits per coordinate, as in SpatialIndex
+int64_t tileKey(const Vector3i & c)
+{
+    const int64_t mask = (1 << 21) - 1;
+    return ((c[0] + (1 << 20)) & mask) << 42 | ((c[1] + (1 << 20)) & mask) << 21 |
+            ((c[2] + (1 << 20)) & mask);
+}
+
+Vector3i cellOfTileKey(int64_t k)
+{
+    const int64_t mask = (1 << 21) - 1;
+    return Vector3i(int((k >> 42) & mask) - (1 << 20), int((k >> 21) & mask) - (1 << 20),
+            int(k & mask) - (1 << 20));
+}
+
+Vector3i tileCell(const Vector3d & X, double tileSize)
+{
+    return Vector3i(floor(X[0] / tileSize), floor(X[1] / tileSize), floor(X[2] / tileSize));
+}
+
+size_t idBytes(int numLandmarks)
+{
+    return (numLandmarks * sizeof(int32_t) + 7) / 8 * 8;
+}
+
+}
+
+bool TiledMap::write(const string & directory, const LandmarkStore & LM, double tileSize)
+{
+    if (mkdir(directory.c_str(), 0755) != 0 and errno != EEXIST) return false;
+
+    unordered_map<int64_t, vector<LandmarkId>> tileIdMap;
+    for (LandmarkId id = 0; id < LM.size(); id++)
+    {
+        if (LM.alive(id)) tileIdMap[tileKey(tileCell(LM.position(id), tileSize))].push_back(id);
+    }
+
+    vector<TileIndexEntry> entryVec;
+    vector<uint8_t> payload;
+    for (auto & tile : tileIdMap)
+    {
+        const vector<LandmarkId> & ids = tile.second;
+        const int n = ids.size();
+        payload.assign(idBytes(n) + n * (3 * sizeof(double) + sizeof(LandmarkStore::Descriptor)), 0);
+        uint8_t * dst = payload.data();
+        for (auto id : ids)
+        {
+            const int32_t id32 = id;
+            memcpy(dst, &id32, sizeof(id32));
+            dst += sizeof(id32);
+        }
+        dst = payload.data() + idBytes(n);
+        for (auto id : ids)
+        {
+            memcpy(dst, LM.position(id).data(), 3 * sizeof(double));
+            dst += 3 * sizeof(double);
+        }
+        for (auto id : ids)
+        {
+            memcpy(dst, LM.descriptor(id).data(), sizeof(LandmarkStore::Descriptor));
+            dst += sizeof(LandmarkStore::Descriptor);
+        }
+
+        TileFileHeader header;
+        memset(&header, 0, sizeof(header));
+        copy(TILE_FILE_MAGIC, TILE_FILE_MAGIC + 8, header.magic);
+        header.version = TILE_FILE_VERSION;
+        header.numLandmarks = n;
+        header.key = tile.first;
+        header.checksum = mapFileChecksum(payload.data(), payload.size());
+        ofstream file(directory + "/" + tileName(tile.first), ios::binary | ios::trunc);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(payload.data()), payload.size());
+        if (not file) return false;
+        entryVec.push_back({tile.first, uint64_t(n)});
+    }
+
+    sort(entryVec.begin(), entryVec.end(), [](const TileIndexEntry & a, const TileIndexEntry & b) {
+        return a.key < b.key;
+    });
+    TileIndexHeader header;
+    memset(&header, 0, sizeof(header));
+    copy(TILE_INDEX_MAGIC, TILE_INDEX_MAGIC + 8, header.magic);
+    header.version = TILE_FILE_VERSION;
+    header.numTiles = entryVec.size();
+    header.tileSize = tileSize;
+    header.checksum = mapFileChecksum(entryVec.data(), entryVec.size() * sizeof(TileIndexEntry));
+    ofstream file(directory + "/tiles.index", ios::binary | ios::trunc);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(entryVec.data()),
+            entryVec.size() * sizeof(TileIndexEntry));
+    return bool(file);
+}
+
+bool TiledMap::open(const string & directoryName)
+{
+    stop();
+    residentIdMap.clear();
+    residentVec.clear();
+    tileInfoMap.clear();
+    memoryUsed = 0;
+    numRequested = 0;
+
+    ifstream file(directoryName + "/tiles.index", ios::binary);
+    TileIndexHeader header;
+    if (not file.read(reinterpret_cast<char *>(&header), sizeof(header))) return false;
+    if (not equal(TILE_INDEX_MAGIC, TILE_INDEX_MAGIC + 8, header.magic) or
+            header.version != TILE_FILE_VERSION or not (header.tileSize > 0))
+    {
+        return false;
+    }
+    vector<TileIndexEntry> entryVec(header.numTiles);
+    if (not file.read(reinterpret_cast<char *>(entryVec.data()),
+            entryVec.size() * sizeof(TileIndexEntry)))
+    {
+        return false;
+    }
+    if (mapFileChecksum(entryVec.data(), entryVec.size() * sizeof(TileIndexEntry)) !=
+            header.checksum)
+    {
+        return false;
+    }
+    directory = directoryName;
+    tileSize = header.tileSize;
+    for (auto & entry : entryVec)
+    {
+        tileInfoMap[entry.key] = {int(entry.numLandmarks), TILE_ABSENT, 0};
+    }
+    return true;
+}
+
+string TiledMap::tileName(int64_t key)
+{
+    const Vector3i c = cellOfTileKey(key);
+    ostringstream name;
+    name << "tile_" << c[0] << "_" << c[1] << "_" << c[2] << ".bin";
+    return name.str();
+}
+
+unique_ptr<TiledMap::Tile> TiledMap::loadTile(int64_t key) const
+{
+    ifstream file(directory + "/" + tileName(key), ios::binary);
+    TileFileHeader header;
+    if (not file.read(reinterpret_cast<char *>(&header), sizeof(header))) return NULL;
+    if (not equal(TILE_FILE_MAGIC, TILE_FILE_MAGIC + 8, header.magic) or
+            header.version != TILE_FILE_VERSION or header.key != key)
+    {
+        return NULL;
+    }
+    const int n = header.numLandmarks;
+    vector<uint8_t> payload(idBytes(n) + n * (3 * sizeof(double) + sizeof(LandmarkStore::Descriptor)));
+    if (not file.read(reinterpret_cast<char *>(payload.data()), payload.size())) return NULL;
+    if (mapFileChecksum(payload.data(), payload.size()) != header.checksum) return NULL;
+
+    unique_ptr<Tile> tile(new Tile(voxelSize));
+    tile->key = key;
+    tile->cell = cellOfTileKey(key);
+    tile->idVec.resize(n);
+    tile->descriptorVec.resize(n);
+    tile->index.reserve(n);
+    const uint8_t * src = payload.data();
+    memcpy(tile->idVec.data(), src, n * sizeof(int32_t));
+    src += idBytes(n);
+    for (int i = 0; i < n; i++)
+    {
+        Vector3d X;
+        memcpy(X.data(), src, 3 * sizeof(double));
+        src += 3 * sizeof(double);
+        tile->index.insert(i, X);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        tile->descriptorVec[i] = Eigen::Map<const LandmarkStore::Descriptor>(
+                reinterpret_cast<const float *>(src));
+        src += sizeof(LandmarkStore::Descriptor);
+    }
+    return tile;
+}
+
+size_t TiledMap::tileBytes(int numLandmarks)
+{
+    //the tile arrays, the spatial index and the entry of the id map
+    const size_t perLandmark = sizeof(LandmarkId) + sizeof(LandmarkStore::Descriptor) +
+            sizeof(Vector3d) + sizeof(int64_t) + sizeof(int) + sizeof(LandmarkId) + 48;
+    return 4096 + numLandmarks * perLandmark;
+}
+
+double TiledMap::tileDistance(const Vector3d & X, const Vector3i & cell) const
+{
+    const Vector3d lo = cell.cast<double>() * tileSize;
+    const Vector3d hi = lo + Vector3d::Constant(tileSize);
+    return (X.cwiseMax(lo).cwiseMin(hi) - X).norm();
+}
+
+void TiledMap::makeResident(int64_t key, unique_ptr<Tile> tile)
+{
+    TileInfo & info = tileInfoMap[key];
+    numRequested--;
+    if (tile == NULL)
+    {
+        info.state = TILE_FAILED;
+        memoryUsed -= tileBytes(info.numLandmarks);
+        return;
+    }
+    info.state = TILE_RESIDENT;
+    for (unsigned int i = 0; i < tile->idVec.size(); i++)
+    {
+        residentIdMap[tile->idVec[i]] = make_pair(tile.get(), int(i));
+    }
+    residentVec.push_back(move(tile));
+}
+
+void TiledMap::evict(int64_t key)
+{
+    auto tile = find_if(residentVec.begin(), residentVec.end(),
+            [key](const unique_ptr<Tile> & t) { return t->key == key; });
+    for (auto id : (*tile)->idVec)
+    {
+        residentIdMap.erase(id);
+    }
+    *tile = move(residentVec.back());
+    residentVec.pop_back();
+    TileInfo & info = tileInfoMap[key];
+    info.state = TILE_ABSENT;
+    memoryUsed -= tileBytes(info.numLandmarks);
+}
+
+void TiledMap::collectLoaded()
+{
+    vector<pair<int64_t, unique_ptr<Tile>>> collected;
+    {
+        lock_guard<mutex> lock(prefetchMutex);
+        collected.swap(loadedVec);
+    }
+    for (auto & loaded : collected)
+    {
+        makeResident(loaded.first, move(loaded.second));
+    }
+}
+
+void TiledMap::setPose(const Vector3d & position)
+{
+    if (tileSize <= 0) return;
+    collectLoaded();
+    numSetPose++;
+
+    //the tiles within reach, the nearest first
+    wantedVec.clear();
+    const int range = ceil(prefetchRadius / tileSize);
+    const Vector3i center = tileCell(position, tileSize);
+    for (int x = -range; x <= range; x++)
+    {
+        for (int y = -range; y <= range; y++)
+        {
+            for (int z = -range; z <= range; z++)
+            {
+                const Vector3i c = center + Vector3i(x, y, z);
+                auto info = tileInfoMap.find(tileKey(c));
+                if (info == tileInfoMap.end()) continue;
+                const double distance = tileDistance(position, c);
+                if (distance > prefetchRadius) continue;
+                info->second.lastWanted = numSetPose;
+                wantedVec.emplace_back(distance, info->first);
+            }
+        }
+    }
+    sort(wantedVec.begin(), wantedVec.end());
+
+    bool requested = false;
+    for (auto & wanted : wantedVec)
+    {
+        TileInfo & info = tileInfoMap[wanted.second];
+        if (info.state != TILE_ABSENT) continue;
+        const size_t bytes = tileBytes(info.numLandmarks);
+        //room is made by the least recently wanted tiles which are not wanted now
+        while (memoryUsed + bytes > memoryBudget)
+        {
+            int64_t oldest = 0;
+            uint64_t oldestWanted = numSetPose;
+            for (auto & tile : residentVec)
+            {
+                const uint64_t lastWanted = tileInfoMap[tile->key].lastWanted;
+                if (lastWanted < oldestWanted)
+                {
+                    oldestWanted = lastWanted;
+                    oldest = tile->key;
+                }
+            }
+            if (oldestWanted == numSetPose) break;
+            evict(oldest);
+        }
+        //the farther tiles would not fit either
+        if (memoryUsed + bytes > memoryBudget) break;
+
+        info.state = TILE_REQUESTED;
+        memoryUsed += bytes;
+        numRequested++;
+        if (running)
+        {
+            lock_guard<mutex> lock(prefetchMutex);
+            requestQueue.push_back(wanted.second);
+            requested = true;
+        }
+        else
+        {
+            makeResident(wanted.second, loadTile(wanted.second));
+        }
+    }
+    if (requested) requestCondition.notify_one();
+}
+
+void TiledMap::waitForPrefetch()
+{
+    while (numRequested > 0 and running)
+    {
+        {
+            unique_lock<mutex> lock(prefetchMutex);
+            loadedCondition.wait(lock, [this] { return not loadedVec.empty(); });
+        }
+        collectLoaded();
+    }
+}
+
+void TiledMap::start()
+{
+    if (running) return;
+    running = true;
+    prefetchThread = thread(&TiledMap::prefetchLoop, this);
+}
+
+void TiledMap::stop()
+{
+    if (not running) return;
+    {
+        lock_guard<mutex> lock(prefetchMutex);
+        running = false;
+    }
+    requestCondition.notify_all();
+    prefetchThread.join();
+    collectLoaded();
+    //the requests left are dropped
+    for (auto key : requestQueue)
+    {
+        TileInfo & info = tileInfoMap[key];
+        info.state = TILE_ABSENT;
+        memoryUsed -= tileBytes(info.numLandmarks);
+        numRequested--;
+    }
+    requestQueue.clear();
+}
+
+void TiledMap::prefetchLoop()
+{
+    unique_lock<mutex> lock(prefetchMutex);
+    while (true)
+    {
+        requestCondition.wait(lock, [this] { return not running or not requestQueue.empty(); });
+        if (not running) break;
+        const int64_t key = requestQueue.front();
+        requestQueue.pop_front();
+        lock.unlock();
+        unique_ptr<Tile> tile = loadTile(key);
+        lock.lock();
+        loadedVec.emplace_back(key, move(tile));
+        loadedCondition.notify_all();
+    }
+}
+
+const Vector3d & TiledMap::position(LandmarkId id) const
+{
+    const pair<const Tile *, int> & place = residentIdMap.find(id)->second;
+    return place.first->index.position(place.second);
+}
+
+const LandmarkStore::Descriptor & TiledMap::descriptor(LandmarkId id) const
+{
+    const pair<const Tile *, int> & place = residentIdMap.find(id)->second;
+    return place.first->descriptorVec[place.second];
+}
+
+void TiledMap::radiusQuery(const Vector3d & center, double radius, vector<LandmarkId> & idVec) const
+{
+    for (auto & tile : residentVec)
+    {
+        if (tileDistance(center, tile->cell) > radius) continue;
+        localIdVec.clear();
+        tile->index.radiusQuery(center, radius, localIdVec);
+        for (auto i : localIdVec)
+        {
+            idVec.push_back(tile->idVec[i]);
+        }
+    }
+}
+
+bool TiledMap::frustumQuery(const Transformation<double> & TorigBase, const StereoSystem & stereo,
+        double maxDepth, vector<LandmarkId> & idVec, int maxSize) const
+{
+    for (auto & tile : residentVec)
+    {
+        if (tileDistance(TorigBase.trans(), tile->cell) > maxDepth) continue;
+        //the places in the tile are appended, then replaced by the ids
+        const int first = idVec.size();
+        const bool complete = tile->index.frustumQuery(TorigBase, stereo, maxDepth, idVec, maxSize);
+        for (unsigned int k = first; k < idVec.size(); k++)
+        {
+            idVec[k] = tile->idVec[idVec[k]];
+        }
+        if (not complete) return false;
+    }
+    return true;
+}
@@ -8,6 +8,7 @@ Stereo vision definition.
 #include <assert.h>
 #include <vector>
 #include <algorithm>
+#include <complex>
 //Eigen
 #include <Eigen/Eigen>
 
@@ -20,43 +21,368 @@ using Eigen::Matrix;
 using Eigen::Vector2d;
 using Eigen::Vector3d;
 
-void computeEssentialMatrix(const vector<Vector3d> & xVec1,
+void EssentialMatrixEstimator::solve(const int * idxs, int numPoints, Matrix3d & E) const
+{
+    Matrix<double, 9, 9> AtA = Matrix<double, 9, 9>::Zero();
+    for (int k = 0; k < numPoints; k++)
+    {
+        const int i = idxs[k];
+        const double & x = X1(0, i);
+        const double & y = X1(1, i);
+        const double & z = X1(2, i);
+        const double & u = X2(0, i);
+        const double & v = X2(1, i);
+        const double & w = X2(2, i);
+        Matrix<double, 9, 1> A;
+        A << x*u, x*v, x*w, y*u, y*v, y*w, z*u, z*v, z*w;
+        AtA += A * A.transpose();
+    }
+    
+    // the null vector is the eigenvector of the smallest eigenvalue
+    Eigen::SelfAdjointEigenSolver<Matrix<double, 9, 9>> eigenSolver(AtA);
+    Matrix<double, 9, 1> e = eigenSolver.eigenvectors().col(0);
+    E << e(0), e(1), e(2), e(3), e(4), e(5), e(6), e(7), e(8);
+    
+    //projection onto the essential manifold
+    Eigen::JacobiSVD<Matrix3d> svd(E, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    E = svd.matrixU() * Vector3d(1, 1, 0).asDiagonal() * svd.matrixV().transpose();
+}
+
+int EssentialMatrixEstimator::countInliers(const Matrix3d & E)
+{
+    // Sampson error, evaluated row by row over the whole set at once
+    for (int k = 0; k < 3; k++)
+    {
+        EX2.row(k) = E(k, 0)*X2.row(0) + E(k, 1)*X2.row(1) + E(k, 2)*X2.row(2);
+        EtX1.row(k) = E(0, k)*X1.row(0) + E(1, k)*X1.row(1) + E(2, k)*X1.row(2);
+    }
+    errVec = (X1.row(0)*EX2.row(0) + X1.row(1)*EX2.row(1) + X1.row(2)*EX2.row(2)).square() /
+            (EX2.row(0).square() + EX2.row(1).square() + EX2.row(2).square() +
+            EtX1.row(0).square() + EtX1.row(1).square() + EtX1.row(2).square());
+    return (errVec < threshold).count();
+}
+
+bool EssentialMatrixEstimator::compute(const vector<Vector3d> & xVec1,
         const vector<Vector3d> & xVec2,
-        Matrix3d & E)
+        Matrix3d & E, vector<bool> & inlierMask,
+        Transformation<double> & T12)
 {
     assert(xVec1.size() == xVec2.size());
-    Matrix<double, 8, 8> AtA = Matrix<double, 8, 8>::Zero();
-    Matrix<double, 8, 1> AtB = Matrix<double, 8, 1>::Zero();
+    const int numPoints = xVec1.size();
+    const int sampleSize = 8;
+    inlierMask.assign(numPoints, false);
+    if (numPoints < max(sampleSize, minInliers))
+    {
+        return false;
+    }
+    
+    X1.resize(3, numPoints);
+    X2.resize(3, numPoints);
+    EX2.resize(3, numPoints);
+    EtX1.resize(3, numPoints);
+    idxVec.resize(numPoints);
+    for (int i = 0; i < numPoints; i++)
+    {
+        X1.col(i) = xVec1[i].normalized();
+        X2.col(i) = xVec2[i].normalized();
+    }
     
-    for (unsigned int i = 0; i < xVec1.size(); i++)
+    uniform_int_distribution<int> distrib(0, numPoints - 1);
+    Matrix3d bestE = Matrix3d::Zero();
+    int bestInliers = 0;
+    int numIter = numIterMax;
+    for (int iteration = 0; iteration < numIter; iteration++)
     {
-        const double & x = xVec1[i][0];
-        const double & y = xVec1[i][1];
-        const double & z = xVec1[i][2];
-        const double & u = xVec2[i][0];
-        const double & v = xVec2[i][1];
-        const double & w = xVec2[i][2];
-        Matrix<double, 1, 8> A;
-        A << x*u, x*v, x*w, y*u, y*v, y*w, z*u, z*v;
-
-        double b = -z*w;
-        AtA += A.transpose() * A;
-        AtB += A.transpose() * b;
-        if (AtA != AtA)
+        int sample[sampleSize];
+        for (int k = 0; k < sampleSize; k++)
         {
-            cout << i << endl << A << endl;
+            do
+            {
+                sample[k] = distrib(generator);
+            } while (find(sample, sample + k, sample[k]) != sample + k);
+        }
+        
+        Matrix3d hypothesis;
+        solve(sample, sampleSize, hypothesis);
+        int countHyp = countInliers(hypothesis);
+        if (countHyp > bestInliers)
+        {
+            //local optimization, the minimal solution is sensitive to noise
+            while (true)
+            {
+                int numInliers = 0;
+                for (int i = 0; i < numPoints; i++)
+                {
+                    if (errVec(i) < threshold) idxVec[numInliers++] = i;
+                }
+                Matrix3d refined;
+                solve(idxVec.data(), numInliers, refined);
+                int countRefined = countInliers(refined);
+                if (countRefined <= countHyp) break;
+                countHyp = countRefined;
+                hypothesis = refined;
+            }
+            bestInliers = countHyp;
+            bestE = hypothesis;
+            
+            //number of iterations to reach the required confidence
+            double logOutlier = log(1. - pow(double(countHyp) / numPoints, sampleSize));
+            if (logOutlier < 0)
+            {
+                //clamped before the conversion, the count overflows int for a low inlier ratio
+                numIter = int(min(double(numIterMax), ceil(log(1. - confidence) / logOutlier)));
+            }
         }
     }
+    if (bestInliers < minInliers)
+    {
+        return false;
+    }
+    
+    E = bestE;
+    countInliers(E);
+    for (int i = 0; i < numPoints; i++)
+    {
+        inlierMask[i] = errVec(i) < threshold;
+    }
+    return decompose(E, xVec1, xVec2, inlierMask, T12);
+}
+
+bool EssentialMatrixEstimator::decompose(const Matrix3d & E,
+        const vector<Vector3d> & xVec1,
+        const vector<Vector3d> & xVec2,
+        const vector<bool> & inlierMask,
+        Transformation<double> & T12)
+{
+    Eigen::JacobiSVD<Matrix3d> svd(E, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Matrix3d U = svd.matrixU();
+    Matrix3d V = svd.matrixV();
+    if (U.determinant() < 0) U *= -1;
+    if (V.determinant() < 0) V *= -1;
+    Matrix3d W;
+    W << 0, -1, 0, 1, 0, 0, 0, 0, 1;
     
-    cout << "E computations" << endl;
-    cout << AtA << endl << endl;
-    cout << AtB << endl;
+    const Matrix3d Rcand[2] = {U * W * V.transpose(), U * W.transpose() * V.transpose()};
+    const Vector3d tcand[2] = {U.col(2), -U.col(2)};
     
-    Matrix<double, 8, 1> H = AtA.inverse() * AtB;
-    E << H(0), H(1), H(2), H(3), H(4), H(5), H(6), H(7), 1;
-    cout << E << endl;
+    //cheirality check
+    int bestCount = 0;
+    for (auto & R : Rcand)
+    {
+        for (auto & t : tcand)
+        {
+            int countFront = 0;
+            for (unsigned int i = 0; i < xVec1.size(); i++)
+            {
+                if (not inlierMask[i]) continue;
+                Vector3d v2 = R * xVec2[i];
+                Vector3d X;
+                if (not StereoSystem::triangulate(xVec1[i], v2, t, X)) continue;
+                if (X.dot(xVec1[i]) > 0 and (X - t).dot(v2) > 0) countFront++;
+            }
+            if (countFront > bestCount)
+            {
+                bestCount = countFront;
+                T12 = Transformation<double>(t, Quaternion<double>(R));
+            }
+        }
+    }
+    return bestCount > 0;
+}
+
+bool computeEssentialMatrix(const vector<Vector3d> & xVec1,
+        const vector<Vector3d> & xVec2,
+        Matrix3d & E, vector<bool> & inlierMask,
+        Transformation<double> & T12)
+{
+    EssentialMatrixEstimator estimator;
+    return estimator.compute(xVec1, xVec2, E, inlierMask, T12);
 }
 
+namespace
+{
+
+// real roots of a quartic polynomial (Ferrari), factors[0] is the leading coefficient
+// the solutions are polished with a few Newton steps
+int solveQuartic(const double * factors, double * roots)
+{
+    typedef complex<double> Complex;
+    const double & A = factors[0];
+    const double & B = factors[1];
+    const double & C = factors[2];
+    const double & D = factors[3];
+    const double & E = factors[4];
+
+    const double A2 = A*A;
+    const double B2 = B*B;
+    const double A3 = A2*A;
+    const double B3 = B2*B;
+    const double A4 = A3*A;
+    const double B4 = B3*B;
+
+    const double alpha = -3*B2/(8*A2) + C/A;
+    const double beta = B3/(8*A3) - B*C/(2*A2) + D/A;
+    const double gamma = -3*B4/(256*A4) + B2*C/(16*A3) - B*D/(4*A2) + E/A;
+
+    const double alpha2 = alpha*alpha;
+    const double alpha3 = alpha2*alpha;
+
+    const Complex P(-alpha2/12 - gamma, 0);
+    const Complex Q(-alpha3/108 + alpha*gamma/3 - beta*beta/8, 0);
+    const Complex R = -Q/2. + sqrt(Q*Q/4. + P*P*P/27.);
+
+    const Complex U = pow(R, 1./3);
+    Complex y;
+    if (U.real() == 0)
+    {
+        y = -5*alpha/6 - pow(Q, 1./3);
+    }
+    else
+    {
+        y = -5*alpha/6 - P/(3.*U) + U;
+    }
+    const Complex w = sqrt(alpha + 2.*y);
+
+    Complex candidates[4];
+    candidates[0] = -B/(4*A) + 0.5*(w + sqrt(-(3*alpha + 2.*y + 2*beta/w)));
+    candidates[1] = -B/(4*A) + 0.5*(w - sqrt(-(3*alpha + 2.*y + 2*beta/w)));
+    candidates[2] = -B/(4*A) + 0.5*(-w + sqrt(-(3*alpha + 2.*y - 2*beta/w)));
+    candidates[3] = -B/(4*A) + 0.5*(-w - sqrt(-(3*alpha + 2.*y - 2*beta/w)));
+
+    int numRoots = 0;
+    for (auto & candidate : candidates)
+    {
+        double x = candidate.real();
+        if (x != x) continue;
+        for (int iter = 0; iter < 2; iter++)
+        {
+            double f = (((A*x + B)*x + C)*x + D)*x + E;
+            double df = ((4*A*x + 3*B)*x + 2*C)*x + D;
+            if (df == 0) break;
+            x -= f/df;
+        }
+        double f = (((A*x + B)*x + C)*x + D)*x + E;
+        double scale = abs(A) + abs(B) + abs(C) + abs(D) + abs(E);
+        if (abs(f) > 1e-6 * scale) continue;
+        roots[numRoots++] = x;
+    }
+    return numRoots;
+}
+
+}
+
+int solveP3P(const Vector3d * fVec, const Vector3d * XVec,
+        Transformation<double> * solutions)
+{
+    Vector3d P1 = XVec[0];
+    Vector3d P2 = XVec[1];
+    Vector3d P3 = XVec[2];
+
+    // degenerate configuration
+    if ((P2 - P1).cross(P3 - P1).norm() < 1e-10) return 0;
+
+    Vector3d f1 = fVec[0].normalized();
+    Vector3d f2 = fVec[1].normalized();
+    Vector3d f3 = fVec[2].normalized();
+
+    // intermediate camera frame
+    Vector3d e1 = f1;
+    Vector3d e3 = f1.cross(f2).normalized();
+    Vector3d e2 = e3.cross(e1);
+    Matrix3d T;
+    T.row(0) = e1;
+    T.row(1) = e2;
+    T.row(2) = e3;
+    Vector3d f3T = T * f3;
+
+    // enforces theta in [0, pi]
+    if (f3T(2) > 0)
+    {
+        swap(f1, f2);
+        swap(P1, P2);
+        e1 = f1;
+        e3 = f1.cross(f2).normalized();
+        e2 = e3.cross(e1);
+        T.row(0) = e1;
+        T.row(1) = e2;
+        T.row(2) = e3;
+        f3T = T * f3;
+    }
+
+    // intermediate world frame
+    Vector3d n1 = (P2 - P1).normalized();
+    Vector3d n3 = n1.cross(P3 - P1).normalized();
+    Vector3d n2 = n3.cross(n1);
+    Matrix3d N;
+    N.row(0) = n1;
+    N.row(1) = n2;
+    N.row(2) = n3;
+    Vector3d P3N = N * (P3 - P1);
+
+    const double d12 = (P2 - P1).norm();
+    const double phi1 = f3T(0) / f3T(2);
+    const double phi2 = f3T(1) / f3T(2);
+    const double p1 = P3N(0);
+    const double p2 = P3N(1);
+
+    const double cosBeta = f1.dot(f2);
+    double b = 1. / (1. - cosBeta*cosBeta) - 1;
+    b = cosBeta < 0 ? -sqrt(b) : sqrt(b);
+
+    const double phi1_2 = phi1*phi1;
+    const double phi2_2 = phi2*phi2;
+    const double p1_2 = p1*p1;
+    const double p1_3 = p1_2*p1;
+    const double p1_4 = p1_3*p1;
+    const double p2_2 = p2*p2;
+    const double p2_3 = p2_2*p2;
+    const double p2_4 = p2_3*p2;
+    const double d12_2 = d12*d12;
+    const double b_2 = b*b;
+
+    double factors[5];
+    factors[0] = -phi2_2*p2_4 - p2_4*phi1_2 - p2_4;
+    factors[1] = 2*p2_3*d12*b + 2*phi2_2*p2_3*d12*b - 2*phi2*p2_3*phi1*d12;
+    factors[2] = -phi2_2*p2_2*p1_2 - phi2_2*p2_2*d12_2*b_2 - phi2_2*p2_2*d12_2
+            + phi2_2*p2_4 + p2_4*phi1_2 + 2*p1*p2_2*d12 + 2*phi1*phi2*p1*p2_2*d12*b
+            - p2_2*p1_2*phi1_2 + 2*p1*p2_2*phi2_2*d12 - p2_2*d12_2*b_2 - 2*p1_2*p2_2;
+    factors[3] = 2*p1_2*p2*d12*b + 2*phi2*p2_3*phi1*d12
+            - 2*phi2_2*p2_3*d12*b - 2*p1*p2*d12_2*b;
+    factors[4] = -2*phi2*p2_2*phi1*p1*d12*b + phi2_2*p2_2*d12_2 + 2*p1_3*d12
+            - p1_2*d12_2 + phi2_2*p2_2*p1_2 - p1_4 - 2*phi2_2*p2_2*p1*d12
+            + p2_2*phi1_2*p1_2 + phi2_2*p2_2*d12_2*b_2;
+
+    double roots[4];
+    const int numRoots = solveQuartic(factors, roots);
+
+    int numSolutions = 0;
+    for (int i = 0; i < numRoots; i++)
+    {
+        const double cosTheta = max(-1., min(1., roots[i]));
+        const double cotAlpha = (-phi1*p1/phi2 - cosTheta*p2 + d12*b) /
+                (-phi1*cosTheta*p2/phi2 + p1 - d12);
+
+        const double sinTheta = sqrt(1 - cosTheta*cosTheta);
+        const double sinAlpha = sqrt(1. / (cotAlpha*cotAlpha + 1));
+        double cosAlpha = sqrt(1. - sinAlpha*sinAlpha);
+        if (cotAlpha < 0) cosAlpha = -cosAlpha;
+
+        const double k = d12 * sinAlpha * (sinAlpha*b + cosAlpha);
+        Vector3d C(d12 * cosAlpha * (sinAlpha*b + cosAlpha), cosTheta * k, sinTheta * k);
+        C = P1 + N.transpose() * C;
+
+        Matrix3d R;
+        R << -cosAlpha, -sinAlpha*cosTheta, -sinAlpha*sinTheta,
+             sinAlpha, -cosAlpha*cosTheta, -cosAlpha*sinTheta,
+             0, -sinTheta, cosTheta;
+        R = N.transpose() * R.transpose() * T;
+
+        Eigen::AngleAxisd rotation(R);
+        solutions[numSolutions++] = Transformation<double>(C,
+                Vector3d(rotation.angle() * rotation.axis()));
+    }
+    return numSolutions;
+}
 
 void StereoSystem::projectPointCloud(const vector<Vector3d> & src,
         vector<Vector2d> & dst1, vector<Vector2d> & dst2) const